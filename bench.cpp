@@ -0,0 +1,299 @@
+/* Benchmark suite: microbenchmarks of the shape, shading and tracer routines,
+   and single-threaded renders of the scene files at a fixed seed. Prints one
+   JSON document, so runs can be compared to catch regressions. */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include "vector.h"
+#include "ray.h"
+#include "shapes.h"
+#include "sampler.h"
+#include "tracer.h"
+#include "image.h"
+#include "camera.h"
+#include "scenefile.h"
+
+#ifndef SCENE_DIR
+#define SCENE_DIR "scenes"
+#endif
+
+static const uint64_t BENCH_SEED = 26;
+static const size_t BATCH = 4096;  // inputs per microbenchmark, cycled through
+
+struct BenchResult {
+    std::string name, unit;  // unit: what one operation is
+    uint64_t ops = 0;
+    double seconds = 0;
+    // Scene renders only
+    uint64_t rays = 0;
+    unsigned int width = 0, height = 0, spp = 0;
+    Vector mean;
+};
+
+// Result of every operation goes here, so the compiler cannot drop the work
+static volatile double sink;
+
+// Times `batch()`, which performs `opsPerBatch` operations, for at least
+// `minSeconds`; repeated `repeats` times, the fastest repetition is kept
+template <typename F>
+BenchResult measure(const std::string &name, const std::string &unit, uint64_t opsPerBatch, double minSeconds, int repeats, F &&batch) {
+    BenchResult best;
+    best.name = name;
+    best.unit = unit;
+    for (int r = 0; r < repeats; ++r) {
+        uint64_t ops = 0;
+        double sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed(0);
+        while (elapsed.count() < minSeconds) {
+            sum += batch();
+            ops += opsPerBatch;
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+        sink = sum;
+        if (best.ops == 0 || elapsed.count() / ops < best.seconds / best.ops) {
+            best.ops = ops;
+            best.seconds = elapsed.count();
+        }
+    }
+    return best;
+}
+
+// Rays from random points around `target`, aimed at it with a spread of
+// `spread`, so that a good part of them hit and the rest miss
+std::vector<Ray> raysToward(const Vector &target, double distance, double spread, Sampler &sampler) {
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < BATCH; ++i) {
+        sampler.startPixelSample(i, 0);
+        double z = 2 * sampler.get1D() - 1, phi = 2 * M_PI * sampler.get1D();
+        double s = sqrt(1 - z * z);
+        Vector origin = target + Vector(s * cos(phi), z, s * sin(phi)) * distance;
+        Vector aim = target + Vector(sampler.get1D() - 0.5, sampler.get1D() - 0.5, sampler.get1D() - 0.5) * spread;
+        rays.push_back(Ray(origin, (aim - origin).normalize()));
+    }
+    return rays;
+}
+
+// Renders a scene file single-threaded, one pass over the image per sample
+BenchResult renderScene(const std::string &name, const std::string &path, unsigned int w, unsigned int h, unsigned int spp, int repeats) {
+    BenchResult result;
+    result.name = name;
+    result.unit = "sample";
+    SceneCamera sceneCamera;
+    std::vector<Shape *> shapes;
+    std::string error;
+    if (!parseSceneFile(path, sceneCamera, shapes, error)) {
+        std::cerr << "Could not load scene: " << error << std::endl;
+        return result;
+    }
+    Camera camera(sceneCamera, w, h);
+    Tracer tracer(std::make_shared<const CompiledScene>(shapes), camera.view.origin);
+    RandomSampler sampler(BENCH_SEED);
+
+    // Every repetition renders the same image; the fastest one is kept
+    for (int r = 0; r < repeats; ++r) {
+        Image img(w, h);
+        tracer.traversalStats = BVHTraversalStats();
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned int pass = 0; pass < spp; ++pass) {
+            for (unsigned int y = 0; y < h; ++y) {
+                for (unsigned int x = 0; x < w; ++x) {
+                    sampler.startPixelSample(img.index(x, y), pass);
+                    Vector rads = tracer.getRadiance(camera.generateRay(x, y, sampler), sampler);
+                    rads.clamp();
+                    img.setPixel(x, y, rads);
+                }
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (r > 0 && elapsed.count() >= result.seconds) continue;
+        result.seconds = elapsed.count();
+        result.rays = tracer.traversalStats.rays;
+        result.mean = Vector();
+        for (size_t i = 0; i < img.pixelCount(); ++i) result.mean += img.mean(i) / double(img.pixelCount());
+    }
+    result.ops = uint64_t(w) * h * spp;
+    result.width = w;
+    result.height = h;
+    result.spp = spp;
+    for (Shape *shape : shapes) delete shape;
+    return result;
+}
+
+void writeJSON(std::ostream &out, const std::vector<BenchResult> &results, bool quick) {
+    out << std::setprecision(6);
+    out << "{\n";
+    out << "  \"seed\": " << BENCH_SEED << ",\n";
+    out << "  \"kernels\": \"" << simdKernels().name << "\",\n";
+    out << "  \"precision\": \"" << (sizeof(Scalar) == sizeof(float) ? "float" : "double") << "\",\n";
+    out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+    out << "  \"quick\": " << (quick ? "true" : "false") << ",\n";
+    out << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        double perSecond = r.seconds > 0 ? r.ops / r.seconds : 0;
+        out << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit << "\", \"ops\": " << r.ops
+            << ", \"seconds\": " << r.seconds << ", \"ns_per_op\": " << (r.ops ? 1e9 * r.seconds / r.ops : 0)
+            << ", \"ops_per_sec\": " << perSecond;
+        if (r.unit == "ray") out << ", \"rays_per_sec\": " << perSecond << ", \"ns_per_ray\": " << 1e9 * r.seconds / r.ops;
+        if (r.unit == "sample") {
+            out << ", \"spp_per_sec\": " << perSecond << ", \"rays\": " << r.rays
+                << ", \"rays_per_sec\": " << (r.seconds > 0 ? r.rays / r.seconds : 0)
+                << ", \"ns_per_ray\": " << (r.rays ? 1e9 * r.seconds / r.rays : 0);
+        }
+        if (r.width) {
+            out << ", \"width\": " << r.width << ", \"height\": " << r.height << ", \"spp\": " << r.spp
+                << ", \"mean\": [" << r.mean.x << ", " << r.mean.y << ", " << r.mean.z << "]";
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+int main(int argc, const char *argv[]) {
+    bool quick = false;
+    std::string filter, outFile, sceneDir = SCENE_DIR;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--quick") {
+            quick = true;
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--out" && i + 1 < argc) {
+            outFile = argv[++i];
+        } else if (arg == "--scenes" && i + 1 < argc) {
+            sceneDir = argv[++i];
+        } else {
+            std::cout << "Usage: " << argv[0] << " [--quick] [--filter <text>] [--out <file.json>] [--scenes <dir>]" << std::endl;
+            return 1;
+        }
+    }
+    double minSeconds = quick ? 0.05 : 0.3;
+    int repeats = quick ? 1 : 5;
+    auto selected = [&](const std::string &name) {
+        if (!filter.empty() && name.find(filter) == std::string::npos) return false;
+        std::cerr << "Running " << name << std::endl;
+        return true;
+    };
+
+    RandomSampler sampler(BENCH_SEED);
+    std::vector<BenchResult> results;
+
+    Sphere sphere(Vector(50, 40, 50), 16.5, Vector(1, 1, 1), Vector(), DIFFUSE);
+    std::vector<Ray> sphereRays = raysToward(sphere.center, 100, 60, sampler);
+    if (selected("sphere_intersects")) {
+        results.push_back(measure("sphere_intersects", "ray", BATCH, minSeconds, repeats, [&] {
+            double sum = 0;
+            for (const Ray &r : sphereRays) sum += sphere.intersects(r);
+            return sum;
+        }));
+    }
+    Cube cube(Vector(60, 0, 60), Vector(85, 40, 85), Vector(1, 1, 1), Vector(), DIFFUSE, M_PI / 4);
+    std::vector<Ray> cubeRays = raysToward(cube.center, 100, 60, sampler);
+    if (selected("cube_intersects")) {
+        results.push_back(measure("cube_intersects", "ray", BATCH, minSeconds, repeats, [&] {
+            double sum = 0;
+            for (const Ray &r : cubeRays) sum += cube.intersects(r);
+            return sum;
+        }));
+    }
+    Plane plane(Vector(0, 1, 0), 0, Vector(1, 1, 1), Vector(), DIFFUSE);
+    std::vector<Ray> planeRays = raysToward(Vector(50, 0, 50), 100, 200, sampler);
+    if (selected("plane_intersects")) {
+        results.push_back(measure("plane_intersects", "ray", BATCH, minSeconds, repeats, [&] {
+            double sum = 0;
+            for (const Ray &r : planeRays) sum += plane.intersects(r);
+            return sum;
+        }));
+    }
+    Checkerboard checker(Vector(0, 1, 0), 0, Vector(0.75, 0.75, 0.25), Vector(0.5, 0.25, 0.5), 10, Vector(), DIFFUSE);
+    std::vector<Vector> floorPoints;
+    for (size_t i = 0; i < BATCH; ++i) {
+        sampler.startPixelSample(i, 1);
+        floorPoints.push_back(Vector(200 * sampler.get1D() - 50, 0, 200 * sampler.get1D() - 50));
+    }
+    if (selected("checkerboard_getColor")) {
+        results.push_back(measure("checkerboard_getColor", "lookup", BATCH, minSeconds, repeats, [&] {
+            double sum = 0;
+            for (const Vector &p : floorPoints) sum += checker.getColor(p).x;
+            return sum;
+        }));
+    }
+
+    // refract and fresnel on random incident directions and normals, as at a glass sphere
+    SceneCamera sceneCamera;
+    std::vector<Shape *> shapes;
+    std::string error;
+    if (!parseSceneFile(sceneDir + "/complex.scene", sceneCamera, shapes, error)) {
+        std::cerr << "Could not load scene: " << error << std::endl;
+        return 1;
+    }
+    Camera camera(sceneCamera, 256, 256);
+    Tracer tracer(std::make_shared<const CompiledScene>(shapes), camera.view.origin);
+    std::vector<Vector> incident, normals;
+    for (size_t i = 0; i < BATCH; ++i) {
+        sampler.startPixelSample(i, 2);
+        double z = 2 * sampler.get1D() - 1, phi = 2 * M_PI * sampler.get1D();
+        incident.push_back(Vector(sqrt(1 - z * z) * cos(phi), z, sqrt(1 - z * z) * sin(phi)));
+        z = 2 * sampler.get1D() - 1, phi = 2 * M_PI * sampler.get1D();
+        normals.push_back(Vector(sqrt(1 - z * z) * cos(phi), z, sqrt(1 - z * z) * sin(phi)));
+    }
+    if (selected("tracer_refract")) {
+        results.push_back(measure("tracer_refract", "call", BATCH, minSeconds, repeats, [&] {
+            double sum = 0;
+            for (size_t i = 0; i < BATCH; ++i) sum += tracer.refract(incident[i], normals[i], 1.5).x;
+            return sum;
+        }));
+    }
+    if (selected("tracer_fresnel")) {
+        results.push_back(measure("tracer_fresnel", "call", BATCH, minSeconds, repeats, [&] {
+            double sum = 0;
+            for (size_t i = 0; i < BATCH; ++i) sum += tracer.fresnel(incident[i], normals[i], 1.5);
+            return sum;
+        }));
+    }
+
+    // One full path per operation, through random pixels of the complex scene
+    if (selected("tracer_getRadiance")) {
+        unsigned int pass = 0;
+        results.push_back(measure("tracer_getRadiance", "sample", BATCH, minSeconds, repeats, [&] {
+            double sum = 0;
+            for (size_t i = 0; i < BATCH; ++i) {
+                sampler.startPixelSample(i, 3 + pass);
+                int x = sampler.get1D() * 256, y = sampler.get1D() * 256;
+                sum += tracer.getRadiance(camera.generateRay(x, y, sampler), sampler).x;
+            }
+            ++pass;
+            return sum;
+        }));
+        // The ray counter covers every repetition; scale it to the one kept
+        BenchResult &r = results.back();
+        r.rays = uint64_t(double(tracer.traversalStats.rays) / (uint64_t(pass) * BATCH) * r.ops);
+    }
+    for (Shape *shape : shapes) delete shape;
+
+    unsigned int spp = quick ? 2 : 4;
+    if (selected("scene_simple")) results.push_back(renderScene("scene_simple", sceneDir + "/simple.scene", 128, 96, spp, repeats));
+    if (selected("scene_complex")) results.push_back(renderScene("scene_complex", sceneDir + "/complex.scene", 128, 96, spp, repeats));
+
+    if (outFile.empty()) {
+        writeJSON(std::cout, results, quick);
+    } else {
+        std::ofstream out(outFile);
+        writeJSON(out, results, quick);
+        if (!out) {
+            std::cerr << "Could not write " << outFile << std::endl;
+            return 1;
+        }
+        std::cerr << "Wrote " << outFile << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,340 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#include "vector.h"
+#include "ray.h"
+
+// Axis-aligned bounding box
+struct AABB {
+    Vector lo, hi;
+    AABB() : lo(1e30, 1e30, 1e30), hi(-1e30, -1e30, -1e30) {}
+    AABB(const Vector &lo_, const Vector &hi_) : lo(lo_), hi(hi_) {}
+
+    void grow(const Vector &p) {
+        lo = Vector(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = Vector(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+    void grow(const AABB &b) {
+        lo = Vector(std::min(lo.x, b.lo.x), std::min(lo.y, b.lo.y), std::min(lo.z, b.lo.z));
+        hi = Vector(std::max(hi.x, b.hi.x), std::max(hi.y, b.hi.y), std::max(hi.z, b.hi.z));
+    }
+    bool empty() const { return lo.x > hi.x; }
+    Vector centroid() const { return (lo + hi) * 0.5; }
+    Scalar surfaceArea() const {
+        if (empty()) return 0;
+        Vector d = hi - lo;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+};
+
+inline Scalar axisOf(const Vector &v, int axis) { return axis == 0 ? v.x : (axis == 1 ? v.y : v.z); }
+
+// Flattened node, 32 bytes so two share a cache line. Nodes are stored in
+// depth-first order: the left child of an interior node directly follows it
+// and `offset` is the index of the right child. For a leaf, `offset` is the
+// first entry of BVH::indices and `count` the number of primitives.
+struct BVHNode {
+    float lo[3], hi[3];
+    uint32_t offset;
+    uint16_t count;
+    uint8_t axis, pad;
+};
+
+struct BVHBuildStats {
+    double buildMs = 0;
+    unsigned int primitives = 0, nodes = 0, leaves = 0, maxDepth = 0;
+};
+
+// Traversal counters, kept per Tracer (and so per thread) and summed at the
+// end. They are only updated in builds with RENDER_STATS, like the other
+// render statistics (see stats.h), or with BVH_TRAVERSAL_STATS alone, which
+// the benchmarks use to report rays per second.
+#ifndef RENDER_STATS
+#define RENDER_STATS 0
+#endif
+#ifndef BVH_TRAVERSAL_STATS
+#define BVH_TRAVERSAL_STATS RENDER_STATS
+#endif
+struct BVHTraversalStats {
+    uint64_t rays = 0, nodeVisits = 0, primTests = 0;
+    BVHTraversalStats &operator+=(const BVHTraversalStats &o) {
+        rays += o.rays; nodeVisits += o.nodeVisits; primTests += o.primTests;
+        return *this;
+    }
+};
+
+inline bool hitsBox(const BVHNode &n, const Scalar *org, const Scalar *inv, Scalar tmax) {
+    Scalar tmin = 0;
+    for (int a = 0; a < 3; ++a) {
+        Scalar t0 = (n.lo[a] - org[a]) * inv[a];
+        Scalar t1 = (n.hi[a] - org[a]) * inv[a];
+        if (inv[a] < 0) std::swap(t0, t1);
+        // Written so that a NaN (ray origin on an axis-parallel slab) leaves the interval alone
+        tmin = t0 > tmin ? t0 : tmin;
+        tmax = t1 < tmax ? t1 : tmax;
+        if (tmin > tmax) return false;
+    }
+    return true;
+}
+
+// The builder keeps every tree within this many levels, so a traversal stack
+// of BVH_MAX_DEPTH entries cannot overflow (a ray pushes at most one node per
+// interior level it passes)
+const unsigned int BVH_MAX_DEPTH = 64;
+
+// Walks a flattened tree and calls hitLeaf(first, count, tmax) for every leaf
+// the ray reaches, where [first, first + count) are the leaf's slots. hitLeaf
+// shrinks tmax when it finds a closer hit; returning true from it stops the
+// traversal (used for occlusion queries). Works directly on a node array, so
+// trees that live in a mapped file need no copy.
+template <typename F>
+void traverseBVH(const BVHNode *nodes, const Ray &r, Scalar &tmax, F &&hitLeaf, BVHTraversalStats &stats) {
+    if (BVH_TRAVERSAL_STATS) stats.rays++;
+    Scalar inv[3] = {1 / r.direction.x, 1 / r.direction.y, 1 / r.direction.z};
+    Scalar org[3] = {r.origin.x, r.origin.y, r.origin.z};
+    bool neg[3] = {inv[0] < 0, inv[1] < 0, inv[2] < 0};
+    uint32_t stack[BVH_MAX_DEPTH];
+    int sp = 0;
+    uint32_t cur = 0;
+    while (true) {
+        const BVHNode &n = nodes[cur];
+        if (BVH_TRAVERSAL_STATS) stats.nodeVisits++;
+        if (hitsBox(n, org, inv, tmax)) {
+            if (n.count > 0) {
+                if (BVH_TRAVERSAL_STATS) stats.primTests += n.count;
+                if (hitLeaf(n.offset, n.count, tmax)) return;
+            } else {
+                // Visit the child on the near side of the split first
+                if (neg[n.axis]) {
+                    stack[sp++] = cur + 1;
+                    cur = n.offset;
+                } else {
+                    stack[sp++] = n.offset;
+                    cur = cur + 1;
+                }
+                continue;
+            }
+        }
+        if (sp == 0) break;
+        cur = stack[--sp];
+    }
+}
+
+// Checks a tree read from a file before traverseBVH walks it: every child
+// comes after its parent and within the `count` nodes, every leaf lies
+// within `slots` slots, and no node is deeper than BVH_MAX_DEPTH
+inline bool validBVH(const BVHNode *nodes, uint32_t count, uint64_t slots) {
+    std::vector<uint8_t> depth(count, 0);  // 0 for nodes the root does not reach
+    if (count) depth[0] = 1;
+    for (uint32_t i = 0; i < count; ++i) {
+        const BVHNode &n = nodes[i];
+        if (n.count > 0) {
+            if (n.offset > slots || n.count > slots - n.offset) return false;
+            continue;
+        }
+        if (n.axis > 2 || i + 1 >= count || n.offset <= i + 1 || n.offset >= count) return false;
+        if (depth[i] == 0) continue;
+        if (depth[i] + 1u > BVH_MAX_DEPTH) return false;
+        depth[i + 1] = std::max<uint8_t>(depth[i + 1], depth[i] + 1);
+        depth[n.offset] = std::max<uint8_t>(depth[n.offset], depth[i] + 1);
+    }
+    return true;
+}
+
+// Bounding volume hierarchy over primitive indices, built with binned SAH
+struct BVH {
+    static const int BINS = 16;
+    static constexpr int MAX_LEAF = 4;  // raised to the leaf width when that is larger
+
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> indices;  // primitive ids in leaf order
+    BVHBuildStats buildStats;
+
+    // leafWidth is how many primitives a leaf can test for the price of one
+    // (the SIMD width for primitives with vector kernels, 1 otherwise)
+    void build(const std::vector<AABB> &bounds, int leafWidth = 1) {
+        auto start = std::chrono::high_resolution_clock::now();
+        nodes.clear();
+        width = std::max(1, leafWidth);
+        maxLeaf = std::max(MAX_LEAF, width);
+        refs.resize(bounds.size());
+        for (uint32_t i = 0; i < bounds.size(); ++i) {
+            for (int a = 0; a < 3; ++a) {
+                refs[i].box.lo[a] = floatDown(axisOf(bounds[i].lo, a));
+                refs[i].box.hi[a] = floatUp(axisOf(bounds[i].hi, a));
+            }
+            refs[i].id = i;
+        }
+        buildStats = BVHBuildStats();
+        buildStats.primitives = bounds.size();
+        if (!refs.empty()) {
+            nodes.reserve(2 * refs.size() / maxLeaf + 1);
+            buildRecursive(0, refs.size(), 1);
+        }
+        indices.resize(refs.size());
+        for (uint32_t i = 0; i < refs.size(); ++i) indices[i] = refs[i].id;
+        buildStats.nodes = nodes.size();
+        refs.clear();
+        refs.shrink_to_fit();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+        buildStats.buildMs = elapsed.count();
+    }
+
+private:
+    // Single-precision box used while building. Bounds are rounded outwards
+    // once, up front, so everything derived from them stays conservative.
+    struct BuildBox {
+        float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+        void grow(const BuildBox &b) {
+            for (int a = 0; a < 3; ++a) {
+                lo[a] = std::min(lo[a], b.lo[a]);
+                hi[a] = std::max(hi[a], b.hi[a]);
+            }
+        }
+        void growPoint(const float *p) {
+            for (int a = 0; a < 3; ++a) {
+                lo[a] = std::min(lo[a], p[a]);
+                hi[a] = std::max(hi[a], p[a]);
+            }
+        }
+        float surfaceArea() const {
+            if (lo[0] > hi[0]) return 0;
+            float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+            return 2 * (dx * dy + dy * dz + dz * dx);
+        }
+    };
+
+    // Build-time copy of the primitive boxes, 32 bytes each, sorted in place into leaf order
+    struct PrimRef {
+        BuildBox box;
+        uint32_t id, pad;
+        float centroid(int a) const { return box.lo[a] + box.hi[a]; }  // doubled, which binning does not mind
+    };
+    std::vector<PrimRef> refs;
+    int width = 1, maxLeaf = MAX_LEAF;
+
+    static float floatDown(double x) { float f = x; return f > x ? nextafterf(f, -INFINITY) : f; }
+    static float floatUp(double x) { float f = x; return f < x ? nextafterf(f, INFINITY) : f; }
+
+    uint32_t buildRecursive(uint32_t begin, uint32_t end, unsigned int depth) {
+        uint32_t nodeIndex = nodes.size();
+        nodes.push_back(BVHNode());
+        buildStats.maxDepth = std::max(buildStats.maxDepth, depth);
+
+        BuildBox box, centroidBox;
+        for (uint32_t i = begin; i < end; ++i) {
+            float c[3] = {refs[i].centroid(0), refs[i].centroid(1), refs[i].centroid(2)};
+            box.grow(refs[i].box);
+            centroidBox.growPoint(c);
+        }
+        for (int a = 0; a < 3; ++a) {
+            nodes[nodeIndex].lo[a] = box.lo[a];
+            nodes[nodeIndex].hi[a] = box.hi[a];
+        }
+
+        uint32_t count = end - begin;
+        // Halving the list from here on still has to end within BVH_MAX_DEPTH
+        // levels; once one more uneven SAH split could break that, only median
+        // splits are left
+        bool median = depth + 1 + ceilLog2(count) > BVH_MAX_DEPTH;
+        int bestAxis = -1, bestSplit = 0;
+        float bestCost = (count + width - 1) / width;  // cost of making this node a leaf, in primitive tests
+        // Small nodes use fewer bins, so the fixed per-node cost does not dominate near the leaves
+        int bins = std::min<uint32_t>(BINS, count);
+        float binScale[3];
+        if (count > 1 && !median) {
+            // Binned SAH: bin the centroids along all three axes in one pass over the
+            // primitives, then sweep the bin boundaries and keep the cheapest split
+            BuildBox binBox[3][BINS];
+            uint32_t binCount[3][BINS] = {{0}};
+            for (int a = 0; a < 3; ++a) {
+                float extent = centroidBox.hi[a] - centroidBox.lo[a];
+                binScale[a] = extent > 0 ? bins / extent : 0;
+                if (!std::isfinite(binScale[a])) binScale[a] = 0;  // a denormal extent; such an axis is not worth splitting
+            }
+            for (uint32_t i = begin; i < end; ++i) {
+                for (int a = 0; a < 3; ++a) {
+                    int b = binOf(refs[i], a, bins, centroidBox, binScale);
+                    binBox[a][b].grow(refs[i].box);
+                    binCount[a][b]++;
+                }
+            }
+            float area = box.surfaceArea();
+            for (int a = 0; a < 3; ++a) {
+                if (binScale[a] == 0) continue;
+                float rightArea[BINS];
+                uint32_t rightCount[BINS];
+                BuildBox acc;
+                uint32_t n = 0;
+                for (int b = bins - 1; b > 0; --b) {
+                    acc.grow(binBox[a][b]);
+                    n += binCount[a][b];
+                    rightArea[b] = acc.surfaceArea();
+                    rightCount[b] = n;
+                }
+                acc = BuildBox();
+                n = 0;
+                for (int b = 0; b < bins - 1; ++b) {
+                    acc.grow(binBox[a][b]);
+                    n += binCount[a][b];
+                    if (n == 0 || rightCount[b + 1] == 0) continue;
+                    float cost = 1 + (acc.surfaceArea() * ((n + width - 1) / width)
+                                      + rightArea[b + 1] * ((rightCount[b + 1] + width - 1) / width)) / area;
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = a;
+                        bestSplit = b;
+                    }
+                }
+            }
+        }
+
+        uint32_t mid;
+        if (bestAxis >= 0) {
+            mid = std::partition(refs.begin() + begin, refs.begin() + end, [&](const PrimRef &p) {
+                return binOf(p, bestAxis, bins, centroidBox, binScale) <= bestSplit;
+            }) - refs.begin();
+        } else if (count <= uint32_t(maxLeaf)) {
+            nodes[nodeIndex].offset = begin;
+            nodes[nodeIndex].count = count;
+            buildStats.leaves++;
+            return nodeIndex;
+        } else if (median) {
+            bestAxis = 0;
+            for (int a = 1; a < 3; ++a) {
+                if (centroidBox.hi[a] - centroidBox.lo[a] > centroidBox.hi[bestAxis] - centroidBox.lo[bestAxis]) bestAxis = a;
+            }
+            mid = begin + count / 2;
+            std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end, [&](const PrimRef &p, const PrimRef &q) {
+                return p.centroid(bestAxis) < q.centroid(bestAxis);
+            });
+        } else {
+            // No split beats a leaf (or all centroids coincide), but the leaf would be too big: halve the list
+            bestAxis = 0;
+            mid = begin + count / 2;
+        }
+
+        nodes[nodeIndex].axis = bestAxis;
+        buildRecursive(begin, mid, depth + 1);
+        nodes[nodeIndex].offset = buildRecursive(mid, end, depth + 1);
+        nodes[nodeIndex].count = 0;
+        return nodeIndex;
+    }
+
+    static unsigned int ceilLog2(uint32_t n) {
+        unsigned int bits = 0;
+        while ((uint64_t(1) << bits) < n) ++bits;
+        return bits;
+    }
+
+    static int binOf(const PrimRef &p, int axis, int bins, const BuildBox &centroidBox, const float *binScale) {
+        return std::min(bins - 1, int((p.centroid(axis) - centroidBox.lo[axis]) * binScale[axis]));
+    }
+};
+
+#endif // BVH_H
@@ -0,0 +1,85 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <cmath>
+#include "vector.h"
+#include "ray.h"
+#include "sampler.h"
+
+// Where the camera stands and looks; `aperture` is the width of the image
+// plane at unit distance (the field of view)
+struct SceneCamera {
+    Vector position = Vector(50, 52, 295.6);
+    Vector direction = Vector(0, -0.042612, -1);
+    double aperture = 0.5135;
+};
+
+// Generates the camera rays of a width x height image. `apertureFactor`
+// zooms by moving the camera along its view direction; with `focusEffect`
+// the rays converge at `focalLength` past the image plane.
+struct Camera {
+    Ray view;        // position and normalised viewing direction
+    Vector cx, cy;   // image plane axes, scaled to the image width and height
+    int width, height;
+    double L = 140;  // distance from the camera to the image plane
+    bool focusEffect = false;
+    double focalLength = 35;
+
+    Camera(const SceneCamera &scene, int w, int h, double apertureFactor = 1) : width(w), height(h) {
+        double aperture = scene.aperture / apertureFactor;
+        Vector dir_norm = scene.direction.normalize();
+        Vector right = dir_norm.cross(Vector(0, 1, 0));  // the image's horizontal stays level
+        if (right.dot(right) < 1e-12) {
+            // Looking straight up or down: the image's top is the way a camera tilted there from -z would face
+            right = dir_norm.cross(Vector(0, 0, dir_norm.y > 0 ? 1 : -1));
+        }
+        cx = right.normalize() * ((w * aperture) / h);
+        double L_new = apertureFactor * L;
+        double L_diff = L - L_new;
+        Vector cam_shift = dir_norm * (L_diff);
+        if (L_diff < 0){
+            cam_shift = cam_shift * 1.5;
+        }
+        L = L_new;
+        view = Ray(scene.position + cam_shift, dir_norm);
+        cy = (cx.cross(view.direction)).normalize() * aperture;
+    }
+
+    // Ray through pixel (x, y), with tent-filtered jitter
+    Ray generateRay(int x, int y, Sampler &sampler) const {
+        return focusEffect ? generateRay<true>(x, y, sampler) : generateRay<false>(x, y, sampler);
+    }
+
+    // The same with `focusEffect` fixed at compile time, for the render loop
+    template <bool FocusEffect>
+    Ray generateRay(int x, int y, Sampler &sampler) const {
+        double Ux = 2 * sampler.get1D();
+        double Uy = 2 * sampler.get1D();
+        double dx;
+        if (Ux < 1) {
+            dx = sqrt(Ux) - 1;
+        } else {
+            dx = 1 - sqrt(2 - Ux);
+        }
+        double dy;
+        if (Uy < 1) {
+            dy = sqrt(Uy) - 1;
+        } else {
+            dy = 1 - sqrt(2 - Uy);
+        }
+        Vector d = (cx * (((x + dx) / float(width)) - 0.5)) + (cy * (((y + dy) / float(height)) - 0.5)) + view.direction;
+        Ray ray = Ray(view.origin + d * 140, d.normalize());
+        if constexpr (FocusEffect) {
+            Vector fp = (view.origin + d * L) + d.normalize() * focalLength;
+            Vector del_x = (cx * dx * L / float(width));
+            Vector del_y = (cy * dy * L / float(height));
+            Vector point = view.origin + d * L;
+            point = point + del_x + del_y;
+            d = (fp - point).normalize();
+            ray = Ray(view.origin + d * L, d.normalize());
+        }
+        return ray;
+    }
+};
+
+#endif // CAMERA_H
@@ -0,0 +1,239 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "image.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+#include "scheduler.h"
+
+// Checkpoint file of a progressive render. The image's pixel records live in
+// a shared mapping of the file, so every sample is in the file as soon as it
+// is accumulated and a checkpoint copies nothing: the render loop only notes
+// its progress in the header. The sampler has no state beyond its seed and
+// each pixel's sample count, which are in the file already.
+//
+// Progress is written before a pass or an adaptive round starts. A render
+// killed in the middle of one leaves some pixels with that sample and some
+// without; samples are keyed by (pixel, sample index) and each pixel knows
+// its own count, so the resumed render only takes the samples a pixel is
+// missing and ends with the image of an uninterrupted run.
+//
+// Layout: the header, the pixel records, then two slots for the adaptive
+// scheduler's state, each 64-byte aligned. A round is written to the slot
+// that is not current and then published by switching `slot`, so a kill
+// while writing it leaves the previous round intact.
+//
+// A render split over several processes with --shard writes one checkpoint
+// per process, and --merge combines their pixel records.
+
+enum ShardSplit : uint32_t {
+    SPLIT_TILES,   // shard i of n renders every n-th tile, starting with tile i
+    SPLIT_SAMPLES  // shard i of n renders the i-th n-th of the passes, over the whole frame
+};
+
+// The settings a checkpoint was rendered with; --resume takes them from the file
+struct CheckpointSettings {
+    uint32_t width, height;
+    uint32_t maxSpp, minSpp;
+    uint32_t adaptive, tileSize;
+    uint64_t seed;
+    double targetError;
+    char scene[256];  // built-in scene name or scene file
+    uint64_t shapes, triangles;  // tell whether the same --mesh files were given
+    uint32_t shard, shards;
+    uint32_t split;  // ShardSplit
+    uint32_t sampler;  // SamplerType, with SAMPLER_BLUE_NOISE
+};
+
+// Whether two checkpoints are shards of the same render
+inline bool sameRender(const CheckpointSettings &a, const CheckpointSettings &b) {
+    CheckpointSettings other = b;
+    other.shard = a.shard;
+    return memcmp(&a, &other, sizeof(a)) == 0;
+}
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version, recordSize;
+    CheckpointSettings settings;
+    uint32_t tiles;
+    uint32_t pass;  // uniform sampling: the pass started last
+    uint32_t slot;  // adaptive sampling: the scheduler slot written last, or NO_SLOT
+    uint32_t finished;
+};
+
+struct Checkpoint {
+    static const uint32_t VERSION = 4;
+    static const uint32_t NO_SLOT = UINT32_MAX;
+
+    bool isOpen() const { return file.data != nullptr; }
+    const CheckpointSettings &settings() const { return header()->settings; }
+    uint32_t pass() const { return header()->pass; }
+    void setPass(uint32_t pass) { header()->pass = pass; }
+    bool finished() const { return header()->finished; }
+    void finish() { header()->finished = 1; }
+    const PixelRecord<IMAGE_PRECISION> *records() const {
+        return reinterpret_cast<const PixelRecord<IMAGE_PRECISION> *>(file.data + recordsOffset());
+    }
+
+    // Creates the file for a new render, with an empty image and no progress
+    bool create(const std::string &path, const CheckpointSettings &settings, uint32_t tiles) {
+        if (!file.create(path, fileSize(settings.width, settings.height, tiles))) return false;
+        CheckpointHeader *h = header();
+        h->version = VERSION;
+        h->recordSize = sizeof(PixelRecord<IMAGE_PRECISION>);
+        h->settings = settings;
+        h->tiles = tiles;
+        h->pass = 0;
+        h->slot = NO_SLOT;
+        h->finished = 0;
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(h->magic, "MLCHKPT", 8);  // last, so a file cut short is never taken for a checkpoint
+        return true;
+    }
+
+    // Maps the file of an earlier render, writable to resume it or read-only
+    // to merge it; `error` says why it cannot be used
+    bool open(const std::string &path, std::string &error, bool writable) {
+        if (!(writable ? file.openWritable(path) : file.open(path))) {
+            error = "cannot open the file";
+        } else if (file.size < sizeof(CheckpointHeader) || memcmp(header()->magic, "MLCHKPT", 8) != 0) {
+            error = "not a checkpoint";
+        } else if (header()->version != VERSION) {
+            error = "written by another version";
+        } else if (header()->recordSize != sizeof(PixelRecord<IMAGE_PRECISION>)) {
+            error = "written with another IMAGE_PRECISION";
+        } else if (file.size != fileSize(settings().width, settings().height, header()->tiles) || !consistent()) {
+            error = "the file is damaged";
+        } else {
+            return true;
+        }
+        file.close();
+        return false;
+    }
+
+    // Renders `img` straight into the file
+    void attach(Image &img) { img.attach(reinterpret_cast<PixelRecord<IMAGE_PRECISION> *>(file.writableData() + recordsOffset())); }
+
+    // Records the scheduler after nextRound() together with the round's jobs
+    void saveRound(const AdaptiveScheduler &scheduler, const std::vector<Tile> &jobs) {
+        uint32_t next = header()->slot == 0 ? 1 : 0;
+        Slot s = slot(next);
+        s.head->spent = scheduler.spent;
+        s.head->rounds = scheduler.rounds;
+        s.head->active = scheduler.active.size();
+        s.head->jobs = jobs.size();
+        std::copy(scheduler.spp.begin(), scheduler.spp.end(), s.spp);
+        std::copy(scheduler.error.begin(), scheduler.error.end(), s.error);
+        std::copy(scheduler.active.begin(), scheduler.active.end(), s.active);
+        std::copy(jobs.begin(), jobs.end(), s.jobs);
+        std::atomic_thread_fence(std::memory_order_release);
+        header()->slot = next;
+    }
+
+    // Puts the scheduler back into the last recorded round and returns that
+    // round's jobs, to be rendered again; false if no round was recorded
+    bool restoreRound(AdaptiveScheduler &scheduler, std::vector<Tile> &jobs) const {
+        if (header()->slot == NO_SLOT) return false;
+        Slot s = slot(header()->slot);
+        uint32_t tiles = header()->tiles;
+        scheduler.spent = s.head->spent;
+        scheduler.rounds = s.head->rounds;
+        scheduler.spp.assign(s.spp, s.spp + tiles);
+        scheduler.error.assign(s.error, s.error + tiles);
+        scheduler.active.assign(s.active, s.active + s.head->active);
+        jobs.assign(s.jobs, s.jobs + s.head->jobs);
+        return true;
+    }
+
+    // Starts writing the samples taken so far to disk, or waits until they are
+    bool sync(bool wait) const { return file.sync(wait); }
+
+private:
+    MappedFile file;
+
+    struct SlotHeader {
+        uint64_t spent;
+        uint32_t rounds, active, jobs, reserved;
+    };
+    // A slot in the file: the header, then per tile its error, samples per
+    // pixel, entry of the active list and job
+    struct Slot {
+        SlotHeader *head;
+        uint32_t *spp;
+        double *error;
+        uint32_t *active;
+        Tile *jobs;
+    };
+
+    static uint64_t align(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+    static uint64_t slotSize(uint32_t tiles) {
+        return align(sizeof(SlotHeader) + tiles * (2 * sizeof(uint32_t) + sizeof(double) + sizeof(Tile)));
+    }
+    static uint64_t recordsOffset() { return align(sizeof(CheckpointHeader)); }
+    static uint64_t slotsOffset(uint32_t width, uint32_t height) {
+        return align(recordsOffset() + uint64_t(width) * height * sizeof(PixelRecord<IMAGE_PRECISION>));
+    }
+    static uint64_t fileSize(uint32_t width, uint32_t height, uint32_t tiles) {
+        return slotsOffset(width, height) + 2 * slotSize(tiles);
+    }
+
+    // Whether the tiles and the recorded round fit the image, so a resumed
+    // render never reads or writes outside it
+    bool consistent() const {
+        const CheckpointSettings &c = settings();
+        if (c.tileSize < 1 || uint64_t(std::max(c.width, c.height)) + c.tileSize > INT32_MAX) return false;
+        if (c.shards < 1 || c.shard >= c.shards) return false;
+        // A shard of a tile split keeps every n-th tile of the frame, starting with its own
+        uint32_t stride = c.shards > 1 && c.split == SPLIT_TILES ? c.shards : 1;
+        uint32_t offset = stride > 1 ? c.shard : 0;
+        std::vector<Tile> frame = makeTiles(c.width, c.height, c.tileSize);
+        size_t tiles = frame.size() > offset ? (frame.size() - offset + stride - 1) / stride : 0;
+        if (header()->tiles != tiles) return false;
+        if (header()->slot == NO_SLOT) return true;
+        if (header()->slot > 1) return false;
+        Slot s = slot(header()->slot);
+        if (s.head->active > tiles || s.head->jobs > tiles) return false;
+        std::vector<bool> seen(tiles);
+        for (uint32_t i = 0; i < s.head->active; ++i) {
+            if (s.active[i] >= tiles || seen[s.active[i]]) return false;
+            seen[s.active[i]] = true;
+        }
+        // Jobs are copies of tiles; each has to be one of this file's, and
+        // only once, for the workers to write disjoint pixels
+        uint32_t columns = (c.width + c.tileSize - 1) / c.tileSize;
+        seen.assign(tiles, false);
+        for (uint32_t i = 0; i < s.head->jobs; ++i) {
+            const Tile &job = s.jobs[i];
+            if (job.x0 < 0 || job.y0 < 0) return false;
+            uint64_t t = uint64_t(job.y0 / c.tileSize) * columns + job.x0 / c.tileSize;
+            if (t >= frame.size() || t % stride != offset || seen[t / stride]) return false;
+            const Tile &tile = frame[t];
+            if (job.x0 != tile.x0 || job.y0 != tile.y0 || job.x1 != tile.x1 || job.y1 != tile.y1) return false;
+            seen[t / stride] = true;
+        }
+        return true;
+    }
+
+    CheckpointHeader *header() const { return reinterpret_cast<CheckpointHeader *>(const_cast<char *>(file.data)); }
+
+    Slot slot(uint32_t i) const {
+        uint32_t tiles = header()->tiles;
+        char *p = const_cast<char *>(file.data) + slotsOffset(settings().width, settings().height) + i * slotSize(tiles);
+        Slot s;
+        s.head = reinterpret_cast<SlotHeader *>(p);
+        s.error = reinterpret_cast<double *>(p + sizeof(SlotHeader));
+        s.spp = reinterpret_cast<uint32_t *>(s.error + tiles);
+        s.active = s.spp + tiles;
+        s.jobs = reinterpret_cast<Tile *>(s.active + tiles);
+        return s;
+    }
+};
+
+#endif // CHECKPOINT_H
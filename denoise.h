@@ -0,0 +1,202 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "vector.h"
+#include "image.h"
+#include "threadpool.h"
+#include "tracer.h"
+
+// Running means of the first-hit SurfaceFeatures of every pixel, written by
+// the render loop next to the Image. Like the image, a pixel is only written
+// by the worker that owns its tile.
+struct FeatureRecord {
+    float normal[3], albedo[3];
+    float depth;
+    uint32_t samples;
+};
+
+struct FeatureBuffer {
+    unsigned int width = 0, height = 0;
+    std::vector<FeatureRecord> records;  // in the Image's pixel order
+
+    FeatureBuffer() {}
+    FeatureBuffer(unsigned int w, unsigned int h) : width(w), height(h), records(size_t(w) * h, FeatureRecord()) {}
+
+    void add(size_t i, const SurfaceFeatures &f) {
+        FeatureRecord &r = records[i];
+        r.samples += 1;
+        float weight = 1.0f / r.samples;
+        const Vector *in[2] = {&f.normal, &f.albedo};
+        float *out[2] = {r.normal, r.albedo};
+        for (int k = 0; k < 2; ++k) {
+            out[k][0] += (float(in[k]->x) - out[k][0]) * weight;
+            out[k][1] += (float(in[k]->y) - out[k][1]) * weight;
+            out[k][2] += (float(in[k]->z) - out[k][2]) * weight;
+        }
+        r.depth += (float(f.depth) - r.depth) * weight;
+    }
+
+    // The buffers as images, for checking what the denoiser was given: the
+    // normals mapped from [-1, 1] to [0, 1], and the depth scaled to its maximum
+    void snapshot(FrameBuffer &normal, FrameBuffer &albedo, FrameBuffer &depth) const {
+        float maxDepth = 0;
+        for (const FeatureRecord &r : records) maxDepth = std::max(maxDepth, r.depth);
+        for (FrameBuffer *f : {&normal, &albedo, &depth}) {
+            f->width = width;
+            f->height = height;
+            f->rgb.resize(records.size() * 3);
+        }
+        for (size_t i = 0; i < records.size(); ++i) {
+            for (int c = 0; c < 3; ++c) {
+                normal.rgb[3 * i + c] = records[i].normal[c] * 0.5f + 0.5f;
+                albedo.rgb[3 * i + c] = records[i].albedo[c];
+                depth.rgb[3 * i + c] = maxDepth > 0 ? records[i].depth / maxDepth : 0;
+            }
+        }
+    }
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) guided by the
+// variance of each pixel's estimate, in the manner of SVGF (Schied et al.
+// 2017) without the temporal part. The colour is divided by the albedo so
+// that textures are not blurred, then filtered in `iterations` passes of a
+// 5x5 B3 spline kernel whose taps are spread 1, 2, 4, ... pixels apart. A tap
+// counts for less the further its normal, depth and luminance are from the
+// centre's; the luminance is allowed to differ by a few standard deviations
+// of the centre's noise, so flat noisy regions are smoothed and edges and
+// converged detail are kept. The variance is filtered along with the colour.
+struct Denoiser {
+    int iterations = 4;
+    float sigmaLuminance = 4;  // in standard deviations of the centre pixel's noise
+    float sigmaNormal = 128;   // exponent of the normals' cosine
+    float sigmaDepth = 1;      // in multiples of the centre's depth gradient
+
+    // Writes the denoised `color` to `out`. `variance` is the variance of each
+    // pixel's mean, summed over the channels, in `color`'s pixel order.
+    void run(const FrameBuffer &color, const std::vector<float> &variance, const FeatureBuffer &features,
+             FrameBuffer &out, ThreadPool &pool) {
+        width = color.width;
+        height = color.height;
+        size_t n = size_t(width) * height;
+        std::vector<Tile> tiles = makeTiles(width, height, 32);
+        prepare(color, variance, features, n);
+
+        for (int i = 0; i < iterations; ++i) {
+            int step = 1 << i;
+            pool.run(tiles, [&](const Tile &tile, unsigned int) { filterTile(tile, step); });
+            illumination.swap(nextIllumination);
+            illuminationVariance.swap(nextVariance);
+        }
+
+        out.width = width;
+        out.height = height;
+        out.rgb.resize(n * 3);
+        for (size_t p = 0; p < n; ++p) {
+            for (int c = 0; c < 3; ++c) out.rgb[3 * p + c] = illumination[3 * p + c] * albedo[3 * p + c];
+        }
+    }
+
+private:
+    unsigned int width = 0, height = 0;
+    // Per pixel: colour over albedo, its variance, and the guides
+    std::vector<float> illumination, illuminationVariance, nextIllumination, nextVariance;
+    std::vector<float> albedo, normal, depth, depthGradient;
+    std::vector<uint8_t> hasFeatures;
+
+    static float luminance(const float *rgb) { return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2]; }
+
+    void prepare(const FrameBuffer &color, const std::vector<float> &variance, const FeatureBuffer &features, size_t n) {
+        illumination.assign(n * 3, 0);
+        nextIllumination.assign(n * 3, 0);
+        illuminationVariance.assign(n, 0);
+        nextVariance.assign(n, 0);
+        albedo.assign(n * 3, 1);
+        normal.assign(n * 3, 0);
+        depth.assign(n, 0);
+        depthGradient.assign(n, 0);
+        hasFeatures.assign(n, 0);
+        for (size_t p = 0; p < n; ++p) {
+            const FeatureRecord &f = features.records[p];
+            hasFeatures[p] = f.samples > 0;
+            // Black surfaces and misses are filtered as they are
+            for (int c = 0; c < 3; ++c) albedo[3 * p + c] = f.albedo[c] > 0.01f ? f.albedo[c] : 1;
+            float length = std::sqrt(f.normal[0] * f.normal[0] + f.normal[1] * f.normal[1] + f.normal[2] * f.normal[2]);
+            for (int c = 0; c < 3; ++c) normal[3 * p + c] = length > 0 ? f.normal[c] / length : 0;
+            depth[p] = f.depth;
+            for (int c = 0; c < 3; ++c) illumination[3 * p + c] = color.rgb[3 * p + c] / albedo[3 * p + c];
+            // Variance of the mean luminance, from the summed channel variance, in illumination units
+            float a = luminance(&albedo[3 * p]);
+            illuminationVariance[p] = variance[p] / 3 / (a * a);
+        }
+        for (unsigned int y = 0; y < height; ++y) {
+            for (unsigned int x = 0; x < width; ++x) {
+                size_t p = size_t(y) * width + x;
+                float dx = x + 1 < width ? std::fabs(depth[p + 1] - depth[p]) : 0;
+                float dy = y + 1 < height ? std::fabs(depth[p + width] - depth[p]) : 0;
+                depthGradient[p] = std::max(dx, dy);
+            }
+        }
+    }
+
+    // The centre's variance blurred over its 3x3 neighbourhood, which is far
+    // less noisy than the pixel's own estimate
+    float blurredVariance(int x, int y) const {
+        static const float kernel[2] = {0.25f, 0.125f};
+        float sum = 0, weights = 0;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                int qx = x + dx, qy = y + dy;
+                if (qx < 0 || qy < 0 || qx >= int(width) || qy >= int(height)) continue;
+                float w = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                sum += w * illuminationVariance[size_t(qy) * width + qx];
+                weights += w;
+            }
+        }
+        return sum / weights;
+    }
+
+    void filterTile(const Tile &tile, int step) {
+        static const float kernel[3] = {3.0f / 8, 1.0f / 4, 1.0f / 16};
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                size_t p = size_t(y) * width + x;
+                const float *cp = &illumination[3 * p];
+                const float *np = &normal[3 * p];
+                float lp = luminance(cp);
+                float luminanceScale = sigmaLuminance * std::sqrt(std::max(0.0f, blurredVariance(x, y))) + 1e-6f;
+                float depthScale = sigmaDepth * depthGradient[p] * step + 1e-3f * depth[p] + 1e-6f;
+                float sum[3] = {}, weights = 0, varianceSum = 0;
+                for (int dy = -2; dy <= 2; ++dy) {
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        int qx = x + dx * step, qy = y + dy * step;
+                        if (qx < 0 || qy < 0 || qx >= int(width) || qy >= int(height)) continue;
+                        size_t q = size_t(qy) * width + qx;
+                        const float *cq = &illumination[3 * q];
+                        float w = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                        if (q != p) {
+                            float exponent = std::fabs(lp - luminance(cq)) / luminanceScale;
+                            if (hasFeatures[p] && hasFeatures[q]) {
+                                const float *nq = &normal[3 * q];
+                                float cosine = np[0] * nq[0] + np[1] * nq[1] + np[2] * nq[2];
+                                w *= std::pow(std::max(0.0f, cosine), sigmaNormal);
+                                exponent += std::fabs(depth[p] - depth[q]) / (depthScale * std::max(std::abs(dx), std::abs(dy)));
+                            }
+                            w *= std::exp(-exponent);
+                        }
+                        for (int c = 0; c < 3; ++c) sum[c] += w * cq[c];
+                        weights += w;
+                        varianceSum += w * w * illuminationVariance[q];
+                    }
+                }
+                for (int c = 0; c < 3; ++c) nextIllumination[3 * p + c] = sum[c] / weights;
+                nextVariance[p] = varianceSum / (weights * weights);
+            }
+        }
+    }
+};
+
+#endif // DENOISE_H
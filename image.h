@@ -6,41 +6,157 @@
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <cstdio>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include "vector.h"
 
-struct Image {
+// Linear RGB of a whole frame, top row first, as handed to the file writers
+struct FrameBuffer {
+    unsigned int width = 0, height = 0;
+    std::vector<float> rgb;
+};
+
+// Binary 8-bit PPM (P6), gamma 2.2, in one pass over the buffer and one write
+inline bool writePPM(const std::string &filename, const FrameBuffer &frame) {
+    std::vector<unsigned char> bytes(frame.rgb.size());
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        bytes[i] = (unsigned char)fmin(255, pow(frame.rgb[i], 1 / 2.2f) * 255);
+    }
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) return false;
+    fprintf(f, "P6\n%u %u\n255\n", frame.width, frame.height);
+    bool ok = fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+    return fclose(f) == 0 && ok;
+}
+
+// Float PFM: linear radiance, little-endian (negative scale), bottom row first
+inline bool writePFM(const std::string &filename, const FrameBuffer &frame) {
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) return false;
+    fprintf(f, "PF\n%u %u\n-1.0\n", frame.width, frame.height);
+    bool ok = true;
+    for (unsigned int y = frame.height; y-- > 0;) {
+        size_t row = size_t(frame.width) * 3;
+        ok = ok && fwrite(frame.rgb.data() + y * row, sizeof(float), row, f) == row;
+    }
+    return fclose(f) == 0 && ok;
+}
+
+// Reads a colour PFM as written by writePFM (either byte order) into `frame`
+inline bool readPFM(const std::string &filename, FrameBuffer &frame) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    char magic[3] = {};
+    float scale = 0;
+    bool ok = fscanf(f, "%2s %u %u %f", magic, &frame.width, &frame.height, &scale) == 4 && std::string(magic) == "PF"
+              && fgetc(f) != EOF;  // the single whitespace character before the data
+    size_t row = size_t(frame.width) * 3;
+    frame.rgb.resize(row * frame.height);
+    for (unsigned int y = frame.height; ok && y-- > 0;) {
+        ok = fread(frame.rgb.data() + y * row, sizeof(float), row, f) == row;
+    }
+    fclose(f);
+    if (ok && scale > 0) {  // big-endian
+        for (float &v : frame.rgb) {
+            uint32_t bits;
+            memcpy(&bits, &v, 4);
+            bits = __builtin_bswap32(bits);
+            memcpy(&v, &bits, 4);
+        }
+    }
+    return ok;
+}
+
+// Root mean square difference of two frames of the same size, relative to the
+// RMS of `reference`; how far a render is from one of a higher quality build
+inline double relativeRMSError(const FrameBuffer &frame, const FrameBuffer &reference) {
+    double diff = 0, norm = 0;
+    for (size_t i = 0; i < frame.rgb.size(); ++i) {
+        double d = double(frame.rgb[i]) - reference.rgb[i];
+        diff += d * d;
+        norm += double(reference.rgb[i]) * reference.rgb[i];
+    }
+    return norm > 0 ? sqrt(diff / norm) : 0;
+}
+
+// Precision of the accumulation buffer; build with -DIMAGE_PRECISION=double
+// for a double-precision running mean
+#ifndef IMAGE_PRECISION
+#define IMAGE_PRECISION float
+#endif
+
+// Everything the renderer keeps per pixel, in one record: the running mean
+// and the sum of squared deviations (Welford), and the sample count
+template <typename Real>
+struct PixelRecord {
+    Real mean[3];
+    Real m2;
+    uint32_t samples;
+};
+
+template <typename Real>
+struct ImageT {
     unsigned int width, height;
-    Vector *pixels, *current;
-    unsigned int *samples;
-    double *variance;
-    std::vector<Vector> *raw_samples;
-    Image(unsigned int w, unsigned int h) : width(w), height(h) {
-        pixels = new Vector[width * height];
-        samples = new unsigned int[width * height];
-        current = new Vector[width * height];
-        variance = new double[width * height](); // Initialize to zero
+    PixelRecord<Real> *records;  // row-major, top row first; in `storage` unless attached elsewhere
+
+    ImageT(unsigned int w, unsigned int h) : width(w), height(h), storage(size_t(w) * h, PixelRecord<Real>()) {
+        records = storage.data();
     }
-    Vector getPixel(unsigned int x, unsigned int y) {
-        unsigned int index = (height - y - 1) * width + x;
-        return current[index];
+    ImageT(const ImageT &) = delete;
+    ImageT &operator=(const ImageT &) = delete;
+
+    // Accumulates into `external` from now on, such as a checkpoint mapping.
+    // It must hold width * height records and is taken as it is.
+    void attach(PixelRecord<Real> *external) {
+        records = external;
+        std::vector<PixelRecord<Real>>().swap(storage);
     }
+
+    size_t pixelCount() const { return size_t(width) * height; }
+    size_t index(unsigned int x, unsigned int y) const { return size_t(height - y - 1) * width + x; }
+    unsigned int samples(size_t i) const { return records[i].samples; }
+    // Mean squared deviation of the samples from their mean, summed over the channels
+    double variance(size_t i) const { return records[i].samples ? double(records[i].m2) / records[i].samples : 0; }
+    Vector mean(size_t i) const { return Vector(records[i].mean[0], records[i].mean[1], records[i].mean[2]); }
+
+    Vector getPixel(unsigned int x, unsigned int y) const { return mean(index(x, y)); }
+
+    // The record is updated in a copy and stored whole, so a render killed
+    // while the image is mapped to a checkpoint finds it before or after the sample
     void setPixel(unsigned int x, unsigned int y, const Vector &v) {
-        unsigned int index = (height - y - 1) * width + x;
-        pixels[index] += v;
-        samples[index] += 1;
-        current[index] = pixels[index] / samples[index];
-        
-        // Calculate the mean and variance
-        if (samples[index] > 1) {
-            Vector mean = pixels[index] / samples[index];
-            Vector diff = v - mean;
-            variance[index] = (variance[index] * (samples[index] - 1) + diff.dot(diff)) / samples[index];
+        PixelRecord<Real> p = records[index(x, y)];
+        p.samples += 1;
+        Real value[3] = {Real(v.x), Real(v.y), Real(v.z)};
+        Real m2 = 0, weight = Real(1) / p.samples;
+        for (int c = 0; c < 3; ++c) {
+            Real delta = value[c] - p.mean[c];
+            p.mean[c] += delta * weight;
+            m2 += delta * (value[c] - p.mean[c]);
         }
+        p.m2 += m2;
+        records[index(x, y)] = p;
     }
-    Vector getSurroundingAverage(int x, int y, int pattern=0) {
-        unsigned int index = (height - y - 1) * width + x;
+    // Adds the samples summarised in `other`, such as the same pixel rendered
+    // by another process, with Chan et al.'s pairwise update of the mean and
+    // M2. Exact when either side has no samples.
+    void merge(size_t i, const PixelRecord<Real> &other) {
+        PixelRecord<Real> &p = records[i];
+        if (!other.samples) return;
+        double na = p.samples, nb = other.samples, n = na + nb;
+        double m2 = double(p.m2) + double(other.m2);
+        for (int c = 0; c < 3; ++c) {
+            double delta = double(other.mean[c]) - double(p.mean[c]);
+            p.mean[c] = Real(p.mean[c] + delta * (nb / n));
+            m2 += delta * delta * (na * nb / n);
+        }
+        p.m2 = Real(m2);
+        p.samples += other.samples;
+    }
+    Vector getSurroundingAverage(int x, int y, int pattern=0) const {
         Vector avg;
-        int total;
+        int total = 0;
         for (int dy = -1; dy < 2; ++dy) {
             for (int dx = -1; dx < 2; ++dx) {
                 if (pattern == 0 && (dx != 0 && dy != 0)) continue;
@@ -48,46 +164,46 @@ struct Image {
                 if (dx == 0 && dy == 0) {
                     continue;
                 }
-                if (x + dx < 0 || x + dx > width - 1) continue;
-                if (y + dy < 0 || y + dy > height - 1) continue;
-                index = (height - (y + dy) - 1) * width + (x + dx);
-                avg += current[index];
+                if (x + dx < 0 || x + dx > int(width) - 1) continue;
+                if (y + dy < 0 || y + dy > int(height) - 1) continue;
+                avg += getPixel(x + dx, y + dy);
                 total += 1;
             }
         }
         return avg / total;
     }
-    inline double toInt(double x) {
-        return pow(x, 1 / 2.2f) * 255;
-    }
-    void save(std::string filePrefix) {
-        std::string filename = filePrefix + ".ppm";
-        std::ofstream f;
-        f.open(filename.c_str(), std::ofstream::out);
-        f << "P3 " << width << " " << height << " " << 255 << std::endl;
-        for (int i=0; i < width * height; i++) {
-            auto p = pixels[i] / samples[i];
-            unsigned int r = fmin(255, toInt(p.x)), g = fmin(255, toInt(p.y)), b = fmin(255, toInt(p.z));
-            f << r << " " << g << " " << b << std::endl;
+    // Copies the current estimate of every pixel into `frame`
+    void snapshot(FrameBuffer &frame) const {
+        frame.width = width;
+        frame.height = height;
+        frame.rgb.resize(pixelCount() * 3);
+        float *out = frame.rgb.data();
+        for (size_t i = 0; i < pixelCount(); ++i) {
+            *out++ = records[i].mean[0];
+            *out++ = records[i].mean[1];
+            *out++ = records[i].mean[2];
         }
     }
-    void saveHistogram(std::string filePrefix, int maxIters) {
+    void save(std::string filePrefix) const {
+        FrameBuffer frame;
+        snapshot(frame);
+        writePPM(filePrefix + ".ppm", frame);
+    }
+    void saveHistogram(std::string filePrefix, int maxIters) const {
         std::string filename = filePrefix + ".ppm";
         std::ofstream f;
         f.open(filename.c_str(), std::ofstream::out);
         f << "P3 " << width << " " << height << " " << 255 << std::endl;
-        for (int i=0; i < width * height; i++) {
-            auto p = samples[i] / maxIters;
-            unsigned int r, g, b;
-            r= g = b = fmin(255, 255 * p);
-            f << r << " " << g << " " << b << std::endl;
+        for (size_t i = 0; i < pixelCount(); ++i) {
+            unsigned int v = fmin(255, 255.0 * records[i].samples / maxIters);
+            f << v << " " << v << " " << v << "\n";
         }
     }
-    ~Image() {
-        delete[] pixels;
-        delete[] samples;
-        delete[] variance;
-    }
+
+private:
+    std::vector<PixelRecord<Real>> storage;
 };
 
+typedef ImageT<IMAGE_PRECISION> Image;
+
 #endif // IMAGE_H
@@ -0,0 +1,83 @@
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "image.h"
+
+// Writes image snapshots on a background thread. The render thread only
+// copies the pixel estimates into the back buffer (Image::snapshot); gamma,
+// encoding and disk I/O happen on the writer thread while it renders on.
+// With two buffers one frame can be queued while another is being written;
+// acquire() only waits if the disk falls more than a whole frame behind.
+struct ImageWriter {
+    ImageWriter() : thread(&ImageWriter::writerLoop, this) {}
+    ImageWriter(const ImageWriter &) = delete;
+    ImageWriter &operator=(const ImageWriter &) = delete;
+    ~ImageWriter() { finish(); }
+
+    // The buffer to fill for the next submit()
+    FrameBuffer &acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&] { return !pending; });
+        return buffers[back];
+    }
+
+    // Queues the back buffer to be written as filePrefix.ppm, and also as
+    // filePrefix.pfm when `pfm` is set
+    void submit(const std::string &filePrefix, bool pfm) {
+        std::lock_guard<std::mutex> lock(mutex);
+        prefix = filePrefix;
+        writePfm = pfm;
+        pending = true;
+        wake.notify_one();
+    }
+
+    // Waits for the queued frames to be written and stops the thread
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return;
+            stopping = true;
+            wake.notify_one();
+        }
+        thread.join();
+    }
+
+private:
+    FrameBuffer buffers[2];
+    int back = 0;
+    bool pending = false, stopping = false, writePfm = false;
+    std::string prefix;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::thread thread;
+
+    void writerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return pending || stopping; });
+            if (!pending) return;
+            // Hand the filled buffer to this thread and the other one back to the renderer
+            int front = back;
+            back ^= 1;
+            std::string filePrefix = prefix;
+            bool pfm = writePfm;
+            pending = false;
+            idle.notify_all();
+
+            lock.unlock();
+            if (!writePPM(filePrefix + ".ppm", buffers[front])) {
+                fprintf(stderr, "Could not write %s.ppm\n", filePrefix.c_str());
+            }
+            if (pfm && !writePFM(filePrefix + ".pfm", buffers[front])) {
+                fprintf(stderr, "Could not write %s.pfm\n", filePrefix.c_str());
+            }
+            lock.lock();
+        }
+    }
+};
+
+#endif // IMAGEWRITER_H
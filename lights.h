@@ -0,0 +1,90 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+
+// Walker/Vose alias table: draws index i with probability weights[i] / sum
+// in constant time, from a single uniform number
+struct AliasTable {
+    std::vector<double> prob;     // chance of keeping a bucket's own index
+    std::vector<uint32_t> alias;  // index taken otherwise
+    std::vector<double> pmf;
+
+    void build(const std::vector<double> &weights) {
+        size_t n = weights.size();
+        double total = 0;
+        for (double w : weights) total += w;
+        prob.assign(n, 1);
+        alias.resize(n);
+        pmf.resize(n);
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        for (uint32_t i = 0; i < n; ++i) {
+            pmf[i] = weights[i] / total;
+            scaled[i] = pmf[i] * n;
+            alias[i] = i;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            prob[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // Whatever is left over is 1 up to rounding, and keeps prob = 1
+    }
+
+    uint32_t sample(double u) const {
+        size_t n = prob.size();
+        uint32_t i = std::min<size_t>(n - 1, u * n);
+        double rest = u * n - i;  // the fraction is uniform again and picks within the bucket
+        return rest < prob[i] ? i : alias[i];
+    }
+
+    bool empty() const { return prob.empty(); }
+};
+
+// The emitters that can be sampled directly, picked in proportion to their
+// power (emitted radiance times surface area)
+struct LightTable {
+    std::vector<uint32_t> lights;  // primitive ids
+    AliasTable select;
+    std::vector<double> pmfOfPrimitive;  // by primitive id; 0 for primitives that are not in the table
+
+    void build(const std::vector<uint32_t> &ids, const std::vector<double> &power, size_t primitives) {
+        lights.clear();
+        std::vector<double> weights;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (power[i] > 0 && std::isfinite(power[i])) {
+                lights.push_back(ids[i]);
+                weights.push_back(power[i]);
+            }
+        }
+        pmfOfPrimitive.assign(primitives, 0);
+        if (lights.empty()) return;
+        select.build(weights);
+        for (size_t i = 0; i < lights.size(); ++i) pmfOfPrimitive[lights[i]] = select.pmf[i];
+    }
+
+    // The chance sample() has of returning primitive `id`
+    double pmf(uint32_t id) const { return pmfOfPrimitive[id]; }
+
+    bool empty() const { return lights.empty(); }
+
+    // Returns a light id and the probability it was picked with
+    uint32_t sample(double u, double &pmf) const {
+        uint32_t i = select.sample(u);
+        pmf = select.pmf[i];
+        return lights[i];
+    }
+};
+
+#endif // LIGHTS_H
@@ -5,15 +5,28 @@
 #include <sstream>
 #include <iomanip>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <chrono>
+#include <thread>
+#include <memory>
 #include "vector.h"
 #include "ray.h"
 #include "image.h"
+#include "imagewriter.h"
 #include "shapes.h"
 #include "tracer.h"
-
-bool EMITTER_SAMPLING = true;
+#include "mesh.h"
+#include "threadpool.h"
+#include "sampler.h"
+#include "wavefront.h"
+#include "scheduler.h"
+#include "checkpoint.h"
+#include "scenefile.h"
+#include "camera.h"
+#include "stats.h"
+#include "denoise.h"
+#include "server.h"
 
 std::vector<Shape *> simpleScene = {
     new Plane(Vector(1, 0, 0), 0, Vector(0.9, 0.6, 0.7) * 0.799, Vector(), DIFFUSE),  // Left wall
@@ -54,107 +67,639 @@ void printProgressBar(int sample, int totalSamples) {
     std::cout.flush();
 }
 
-int main(int argc, const char *argv[]) {
-    srand48(26);  // set random seed
-    EMITTER_SAMPLING = true;
+// Combines the shard files of a render split with --shard into one image
+int mergeShards(const std::string &filePrefix, const std::vector<std::string> &files, bool pfm) {
+    CheckpointSettings first;
+    std::unique_ptr<Image> img;
+    std::vector<bool> merged;
+    for (const std::string &file : files) {
+        Checkpoint shard;
+        std::string error;
+        if (!shard.open(file, error, false)) {
+            std::cout << "Could not merge " << file << ": " << error << std::endl;
+            return 1;
+        }
+        const CheckpointSettings &settings = shard.settings();
+        if (!img) {
+            first = settings;
+            img.reset(new Image(settings.width, settings.height));
+            merged.assign(settings.shards, false);
+        } else if (settings.shards != first.shards) {
+            std::cout << "Could not merge " << file << ": it is one of " << settings.shards << " shards, not "
+                      << first.shards << std::endl;
+            return 1;
+        } else if (!sameRender(first, settings)) {
+            std::cout << "Could not merge " << file << ": it is part of another render" << std::endl;
+            return 1;
+        }
+        if (!shard.finished()) {
+            std::cout << "Could not merge " << file << ": the shard is not finished, resume it first" << std::endl;
+            return 1;
+        }
+        if (settings.shard >= merged.size()) {
+            std::cout << "Could not merge " << file << ": there is no shard " << settings.shard << "/" << merged.size() << std::endl;
+            return 1;
+        }
+        if (merged[settings.shard]) {
+            std::cout << "Could not merge " << file << ": shard " << settings.shard << " was given twice" << std::endl;
+            return 1;
+        }
+        merged[settings.shard] = true;
+        for (size_t i = 0; i < img->pixelCount(); ++i) img->merge(i, shard.records()[i]);
+    }
+    for (size_t i = 0; i < merged.size(); ++i) {
+        if (!merged[i]) {
+            std::cout << "Shard " << i << "/" << merged.size() << " is missing" << std::endl;
+            return 1;
+        }
+    }
+    uint64_t samples = 0;
+    for (size_t i = 0; i < img->pixelCount(); ++i) samples += img->samples(i);
+    FrameBuffer frame;
+    img->snapshot(frame);
+    if (!writePPM(filePrefix + ".ppm", frame) || (pfm && !writePFM(filePrefix + ".pfm", frame))) {
+        std::cout << "Could not write " << filePrefix << std::endl;
+        return 1;
+    }
+    std::cout << "Merged " << files.size() << " shards, " << double(samples) / img->pixelCount()
+              << " samples per pixel on average, into " << filePrefix << std::endl;
+    return 0;
+}
+
+// The scene of --scene: a built-in scene, a scene file or a compiled scene
+// cache, with the --mesh files added; `error` is the message to print
+bool loadScene(const std::string &sceneName, const std::vector<std::string> &meshFiles, SceneCamera &sceneCamera,
+               std::shared_ptr<const CompiledScene> &compiled, std::string &error) {
+    std::vector<Shape *> scene;
+    compiled.reset();
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    if (sceneName == "simple" || sceneName == "complex") {
+        scene = sceneName == "simple" ? simpleScene : complexScene;
+    } else {
+        bool loaded = true;
+        if (isSceneCache(sceneName)) {
+            compiled = loadSceneCache(sceneName, sceneCamera, error);
+            loaded = compiled != nullptr;
+            if (loaded && !meshFiles.empty()) {
+                error = "A compiled scene cannot take --mesh files; add them to the scene file instead";
+                return false;
+            }
+        } else {
+            loaded = parseSceneFile(sceneName, sceneCamera, scene, error);
+        }
+        if (!loaded) {
+            error = "Could not load scene: " + error;
+            return false;
+        }
+    }
+    for (const std::string &file : meshFiles) {
+        auto loadStart = std::chrono::high_resolution_clock::now();
+        TriangleMesh *mesh = TriangleMesh::load(file, Vector(0.75, 0.75, 0.75), Vector(), DIFFUSE);
+        if (!mesh) {
+            error = "Could not load mesh " + file;
+            return false;
+        }
+        std::chrono::duration<double, std::milli> loadTime = std::chrono::high_resolution_clock::now() - loadStart;
+        std::cout << "Loaded " << file << ": " << mesh->triangleCount << " triangles in " << loadTime.count() << " ms" << std::endl;
+        scene.push_back(mesh);
+    }
+    if (!compiled) compiled = std::make_shared<const CompiledScene>(scene);
+    if (sceneName != "simple" && sceneName != "complex") {
+        std::chrono::duration<double, std::milli> loadTime = std::chrono::high_resolution_clock::now() - loadStart;
+        std::cout << "Loaded " << sceneName << ": " << compiled->primitives.size() << " primitives in " << loadTime.count() << " ms" << std::endl;
+    }
+    return true;
+}
 
+int main(int argc, const char *argv[]) {
     // Default values
     int w = 256, h = 256;
     unsigned int MAX_spp = 200;
     unsigned int MIN_spp = 30;
     bool adaptive_sampling = false;
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    int TILE_SIZE = 32;
+    uint64_t seed = 26;
+    uint32_t SAMPLER = SAMPLER_RANDOM;
+    bool BLUE_NOISE = false;
+    bool WAVEFRONT = false;
+    int RADIANCE_CACHE = 0;  // diffuse bounces before paths can end at the radiance cache; 0 for no cache
+    double RADIANCE_CACHE_ERROR = 0.05;
+    bool SAVE_PFM = false;
+    double TARGET_ERROR = 0.02;
+    std::string sceneName = "complex";
+    std::vector<std::string> meshFiles;
+    std::string checkpointFile;
+    bool RESUME = false;
+    unsigned int SHARD = 0, SHARDS = 1;
+    ShardSplit SPLIT = SPLIT_TILES;
+    std::string mergePrefix;
+    std::string statsFile, costMapPrefix;
+    std::string compareFile;
+    std::string serveSocket, submitSocket, submitTarget;
+    enum { DENOISE_NONE, DENOISE_FINAL, DENOISE_SNAPSHOTS } DENOISE = DENOISE_NONE;
+
+    // Split "--option value" pairs from the positional arguments
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            int n = std::stoi(argv[++i]);
+            if (n < 1) {
+                std::cout << "Expected --threads <n> with n >= 1" << std::endl;
+                return 1;
+            }
+            threads = n;
+        } else if (arg == "--tile" && i + 1 < argc) {
+            TILE_SIZE = std::stoi(argv[++i]);
+            if (TILE_SIZE < 1) {
+                std::cout << "Expected --tile <size> with size >= 1" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::stoull(argv[++i]);
+        } else if (arg == "--sampler" && i + 1 < argc) {
+            if (!parseSamplerType(argv[++i], SAMPLER)) {
+                std::cout << "Unknown sampler '" << argv[i] << "', expected random, sobol or halton" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--blue-noise") {
+            BLUE_NOISE = true;
+        } else if (arg == "--simd" && i + 1 < argc) {
+            if (!selectSimdKernels(argv[++i])) {
+                std::cout << "Intersection kernels '" << argv[i] << "' are not available on this CPU" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--target-error" && i + 1 < argc) {
+            TARGET_ERROR = std::stod(argv[++i]);
+        } else if (arg == "--pfm") {
+            SAVE_PFM = true;
+        } else if (arg == "--denoise" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode != "final" && mode != "snapshots") {
+                std::cout << "Unknown denoise mode '" << mode << "', expected final or snapshots" << std::endl;
+                return 1;
+            }
+            DENOISE = mode == "final" ? DENOISE_FINAL : DENOISE_SNAPSHOTS;
+        } else if (arg == "--wavefront") {
+            WAVEFRONT = true;
+        } else if (arg == "--radiance-cache" && i + 1 < argc) {
+            RADIANCE_CACHE = std::max(0, std::stoi(argv[++i]));
+        } else if (arg == "--radiance-cache-error" && i + 1 < argc) {
+            RADIANCE_CACHE_ERROR = std::stod(argv[++i]);
+        } else if (arg == "--scene" && i + 1 < argc) {
+            sceneName = argv[++i];
+        } else if (arg == "--compile-scene" && i + 2 < argc) {
+            // Parse a scene file once and store it, BVHs included, in the cache format that is mapped at load time
+            SceneCamera sceneCamera;
+            std::vector<Shape *> shapes;
+            std::string error;
+            if (!parseSceneFile(argv[i + 1], sceneCamera, shapes, error)) {
+                std::cout << error << std::endl;
+                return 1;
+            }
+            CompiledScene compiled(shapes);
+            if (!saveSceneCache(argv[i + 2], compiled, sceneCamera, error)) {
+                std::cout << "Could not compile " << argv[i + 1] << ": " << error << std::endl;
+                return 1;
+            }
+            std::cout << "Wrote " << compiled.primitives.size() << " primitives to " << argv[i + 2] << std::endl;
+            return 0;
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            checkpointFile = argv[++i];
+        } else if (arg == "--resume" && i + 1 < argc) {
+            checkpointFile = argv[++i];
+            RESUME = true;
+        } else if (arg == "--shard" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u/%u", &SHARD, &SHARDS) != 2 || SHARD >= SHARDS) {
+                std::cout << "Expected --shard <i>/<n> with i < n" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--split" && i + 1 < argc) {
+            std::string split = argv[++i];
+            if (split != "tiles" && split != "samples") {
+                std::cout << "Unknown split '" << split << "', expected tiles or samples" << std::endl;
+                return 1;
+            }
+            SPLIT = split == "tiles" ? SPLIT_TILES : SPLIT_SAMPLES;
+        } else if (arg == "--stats" && i + 1 < argc) {
+            statsFile = argv[++i];
+        } else if (arg == "--cost-map" && i + 1 < argc) {
+            costMapPrefix = argv[++i];
+        } else if (arg == "--compare" && i + 1 < argc) {
+            compareFile = argv[++i];
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveSocket = argv[++i];
+        } else if (arg == "--submit" && i + 2 < argc) {
+            submitSocket = argv[++i];
+            submitTarget = argv[++i];
+        } else if (arg == "--merge" && i + 1 < argc) {
+            mergePrefix = argv[++i];
+        } else if (arg == "--mesh" && i + 1 < argc) {
+            meshFiles.push_back(argv[++i]);
+        } else if (arg == "--convert-mesh" && i + 2 < argc) {
+            // Parse an OBJ file once and store it in the binary format that is mapped at load time
+            TriangleMesh *mesh = TriangleMesh::loadOBJ(argv[i + 1], Vector(), Vector(), DIFFUSE);
+            if (!mesh || !mesh->save(argv[i + 2])) {
+                delete mesh;
+                std::cout << "Could not convert " << argv[i + 1] << " to " << argv[i + 2] << std::endl;
+                return 1;
+            }
+            std::cout << "Wrote " << mesh->triangleCount << " triangles to " << argv[i + 2] << std::endl;
+            delete mesh;
+            return 0;
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    if (!serveSocket.empty()) {
+        RenderServer server(threads, [](const std::string &name, SceneCamera &camera, std::shared_ptr<const CompiledScene> &compiled,
+                                        std::string &error) { return loadScene(name, {}, camera, compiled, error); });
+        return server.serve(serveSocket);
+    }
+    if (!submitSocket.empty()) {
+        if (submitTarget == "status" || submitTarget == "shutdown") return submitToServer(submitSocket, submitTarget, "", {});
+        return submitToServer(submitSocket, "render", submitTarget, args);
+    }
+
+    if (!mergePrefix.empty()) {
+        if (args.empty()) {
+            std::cout << "Usage: " << argv[0] << " --merge <prefix> <shard>... [--pfm]" << std::endl;
+            return 1;
+        }
+        return mergeShards(mergePrefix, args, SAVE_PFM);
+    }
 
     // Check if command line arguments are provided
-    if (argc >= 4) {
-        w = std::stoi(argv[1]);
-        h = std::stoi(argv[2]);
-        adaptive_sampling = std::string(argv[3]) == "true";
-        if (argc == 6) {
-            MAX_spp = std::stoi(argv[4]);
-            MIN_spp = std::stoi(argv[5]);
-        }
-    } else if(argc > 6) {
-        std::cout << "Usage: " << argv[0] << " <width> <height> <adaptive_sampling> [<max_spp> <min_spp>]" << std::endl;
+    if (args.size() > 5 || (args.size() != 0 && args.size() != 3 && args.size() != 5)) {
+        std::cout << "Usage: " << argv[0] << " <width> <height> <adaptive_sampling> [<max_spp> <min_spp>]"
+                  << " [--threads <n>] [--tile <size>] [--seed <n>] [--sampler random|sobol|halton [--blue-noise]]"
+                  << " [--mesh <file>]... [--simd scalar|avx2] [--wavefront] [--radiance-cache <n> [--radiance-cache-error <e>]]"
+                  << " [--scene simple|complex|<file>] [--pfm] [--target-error <e>]"
+                  << " [--checkpoint <file>] [--shard <i>/<n> [--split tiles|samples]] [--stats <file.json>] [--cost-map <prefix>]"
+                  << " [--compare <reference.pfm>] [--denoise final|snapshots]"
+                  << "\n       " << argv[0] << " --resume <file> [--threads <n>] [--mesh <file>]... [--simd scalar|avx2] [--wavefront]"
+                  << " [--radiance-cache <n> [--radiance-cache-error <e>]] [--pfm] [--denoise final|snapshots]"
+                  << "\n       " << argv[0] << " --merge <prefix> <shard>... [--pfm]"
+                  << "\n       " << argv[0] << " --serve <socket> [--threads <n>] [--simd scalar|avx2]"
+                  << "\n       " << argv[0] << " --submit <socket> <prefix> [<key>=<value>]... | --submit <socket> status|shutdown"
+                  << "\n       " << argv[0] << " --convert-mesh <in.obj> <out.mesh>"
+                  << "\n       " << argv[0] << " --compile-scene <in.scene> <out.scenecache>" << std::endl;
+        return 1;
+    }
+    if (args.size() >= 3) {
+        w = std::stoi(args[0]);
+        h = std::stoi(args[1]);
+        adaptive_sampling = args[2] == "true";
+        if (args.size() == 5) {
+            MAX_spp = std::stoi(args[3]);
+            MIN_spp = std::stoi(args[4]);
+        }
+    }
+
+    // A resumed render continues with the settings it was started with
+    Checkpoint checkpoint;
+    if (RESUME) {
+        std::string error;
+        if (!checkpoint.open(checkpointFile, error, true)) {
+            std::cout << "Could not resume " << checkpointFile << ": " << error << std::endl;
+            return 1;
+        }
+        const CheckpointSettings &settings = checkpoint.settings();
+        w = settings.width;
+        h = settings.height;
+        adaptive_sampling = settings.adaptive;
+        MAX_spp = settings.maxSpp;
+        MIN_spp = settings.minSpp;
+        TILE_SIZE = settings.tileSize;
+        seed = settings.seed;
+        SAMPLER = settings.sampler & ~SAMPLER_BLUE_NOISE;
+        BLUE_NOISE = settings.sampler & SAMPLER_BLUE_NOISE;
+        TARGET_ERROR = settings.targetError;
+        sceneName.assign(settings.scene, strnlen(settings.scene, sizeof(settings.scene)));
+        SHARD = settings.shard;
+        SHARDS = settings.shards;
+        SPLIT = ShardSplit(settings.split);
+    }
+    if (!RENDER_STATS && (!statsFile.empty() || !costMapPrefix.empty())) {
+        std::cout << "This build has no render statistics; rebuild with -DRENDER_STATS=1 for --stats and --cost-map" << std::endl;
+        return 1;
+    }
+    if (BLUE_NOISE && SAMPLER == SAMPLER_RANDOM) {
+        std::cout << "--blue-noise spreads the error of the sobol and halton samplers; add --sampler sobol or halton" << std::endl;
+        return 1;
+    }
+    if (BLUE_NOISE) SAMPLER |= SAMPLER_BLUE_NOISE;
+    if (SHARDS > 1 && checkpointFile.empty()) {
+        std::cout << "A shard is written to its checkpoint file; add --checkpoint <file>" << std::endl;
+        return 1;
+    }
+    if (SHARDS > 1 && DENOISE != DENOISE_NONE) {
+        std::cout << "A shard has only part of the frame to denoise; render without --shard to use --denoise" << std::endl;
+        return 1;
+    }
+    if (SHARDS > 1 && adaptive_sampling && SPLIT == SPLIT_SAMPLES) {
+        std::cout << "Adaptive sampling needs every sample of a tile in one process; use --split tiles" << std::endl;
         return 1;
     }
 
     int SNAPSHOT_INTERVAL = 10;
+    bool EMITTER_SAMPLING = true;
     bool FOCUS_EFFECT = false;
     double FOCAL_LENGTH = 35;
     double APERTURE_FACTOR = 1;
     Image img(w, h);
-    auto &scene = complexScene;
-    double aperture = 0.5135 / APERTURE_FACTOR;
-    Vector cx = Vector((w * aperture) / h, 0, 0);
-    Vector dir_norm = Vector(0, -0.042612, -1).normalize();
-    double L = 140;
-    double L_new = APERTURE_FACTOR * L;
-    double L_diff = L - L_new;
-    Vector cam_shift = dir_norm * (L_diff);
-    if (L_diff < 0){
-        cam_shift = cam_shift * 1.5;
-    }
-    L = L_new;
-    Ray camera = Ray(Vector(50, 52, 295.6) + cam_shift, dir_norm);
-    Tracer tracer = Tracer(scene, camera.origin);
-    Vector cy = (cx.cross(camera.direction)).normalize() * aperture;
+
+    SceneCamera sceneCamera;
+    std::shared_ptr<const CompiledScene> compiled;
+    std::string loadError;
+    if (!loadScene(sceneName, meshFiles, sceneCamera, compiled, loadError)) {
+        std::cout << loadError << std::endl;
+        return 1;
+    }
+
+    CheckpointSettings settings = {uint32_t(w), uint32_t(h), MAX_spp, MIN_spp, adaptive_sampling, uint32_t(TILE_SIZE),
+                                   seed, TARGET_ERROR, {}, compiled->primitives.size(), 0, SHARD, SHARDS, SPLIT, SAMPLER};
+    strncpy(settings.scene, sceneName.c_str(), sizeof(settings.scene) - 1);
+    for (const TriangleMesh *mesh : compiled->meshes) settings.triangles += mesh->triangleCount;
+    std::vector<Tile> tiles = makeTiles(w, h, TILE_SIZE);
+    if (SHARDS > 1 && SPLIT == SPLIT_TILES) {
+        // Every n-th tile, so that each shard gets a share of the expensive parts of the frame
+        std::vector<Tile> shardTiles;
+        for (size_t t = SHARD; t < tiles.size(); t += SHARDS) shardTiles.push_back(tiles[t]);
+        tiles.swap(shardTiles);
+    }
+    uint64_t pixels = 0;
+    for (const Tile &tile : tiles) pixels += tile.pixels();
+    // The passes of this process; all of them unless the samples are split
+    unsigned int firstSample = 1, lastSample = MAX_spp;
+    if (SHARDS > 1 && SPLIT == SPLIT_SAMPLES) {
+        firstSample = uint64_t(MAX_spp) * SHARD / SHARDS + 1;
+        lastSample = uint64_t(MAX_spp) * (SHARD + 1) / SHARDS;
+    }
+    if (RESUME) {
+        if (settings.shapes != checkpoint.settings().shapes || settings.triangles != checkpoint.settings().triangles) {
+            std::cout << "Could not resume " << checkpointFile << ": its scene or --mesh files have changed" << std::endl;
+            return 1;
+        }
+    } else if (!checkpointFile.empty() && !checkpoint.create(checkpointFile, settings, tiles.size())) {
+        std::cout << "Could not create checkpoint " << checkpointFile << std::endl;
+        return 1;
+    }
+    if (checkpoint.isOpen()) checkpoint.attach(img);
+    Camera camera(sceneCamera, w, h, APERTURE_FACTOR);
+    camera.focusEffect = FOCUS_EFFECT;
+    camera.focalLength = FOCAL_LENGTH;
 
     auto start = std::chrono::high_resolution_clock::now();
 
-    // Define a constant for maximum acceptable variance
-    const double MAX_VARIANCE = 1e-3; // Adjust based on desired quality
-
-    for (int sample = 1; sample <= MAX_spp; ++sample) {
-        printProgressBar(sample, MAX_spp);
-        if (sample && sample % SNAPSHOT_INTERVAL == 0) {
-            std::ostringstream fn;
-            fn << std::setfill('0') << std::setw(5) << sample;
-            img.save("results_temp/render_" + fn.str());
-        }
-        for (int y = 0; y < h; ++y) {
-            for (int x = 0; x < w; ++x) {
-                unsigned int index = (h - y - 1) * w + x;
-                if (adaptive_sampling && img.samples[index] > MIN_spp && img.variance[index] < MAX_VARIANCE) {
-                    continue; // Skip sampling if variance is low enough
-                }
-                double Ux = 2 * drand48();
-                double Uy = 2 * drand48();
-                double dx;
-                if (Ux < 1) {
-                    dx = sqrt(Ux) - 1;
-                } else {
-                    dx = 1 - sqrt(2 - Ux);
-                }
-                double dy;
-                if (Uy < 1) {
-                    dy = sqrt(Uy) - 1;
-                } else {
-                    dy = 1 - sqrt(2 - Uy);
+    // One tracer and sampler per worker, and each tile is written by a single worker.
+    // Samples are keyed by (pixel, sample, dimension), so the image does not depend on the thread count.
+    ThreadPool pool(threads);
+    std::vector<Tracer> tracers(pool.size(), Tracer(compiled, camera.view.origin));
+    std::vector<std::unique_ptr<Sampler>> samplers;
+    for (unsigned int i = 0; i < pool.size(); ++i) samplers.push_back(makeSampler(SAMPLER, seed, w));
+    std::vector<WavefrontIntegrator> wavefronts(WAVEFRONT ? pool.size() : 0);
+    // Shared by all workers, so the image depends on the order they fill it in
+    std::unique_ptr<RadianceCache> radianceCache;
+    if (RADIANCE_CACHE > 0) {
+        radianceCache = std::make_unique<RadianceCache>(camera.view.origin);
+        radianceCache->lookupAfter = RADIANCE_CACHE;
+        radianceCache->maxError = RADIANCE_CACHE_ERROR;
+        for (Tracer &t : tracers) t.radianceCache = radianceCache.get();
+    }
+    // statsClock() ticks spent on each pixel, for --cost-map; a tile's pixels are only written by its worker
+    std::vector<float> pixelCost(RENDER_STATS && !costMapPrefix.empty() ? img.pixelCount() : 0);
+    // First-hit normals, albedo and depth for the denoiser
+    FeatureBuffer features = DENOISE != DENOISE_NONE ? FeatureBuffer(w, h) : FeatureBuffer();
+
+    // The tile loop is instantiated for each combination of the render modes,
+    // and the one this render uses is picked here, once: the loop itself has
+    // no mode branches, and the integrator is specialised along with it
+    auto renderTileWith = [&](auto policy, auto focusEffect, auto wavefront) -> ThreadPool::TileFunc {
+        typedef decltype(policy) Policy;
+        constexpr bool FOCUS = decltype(focusEffect)::value, WAVE = decltype(wavefront)::value;
+        return [&](const Tile &tile, unsigned int worker) {
+            Tracer &tracer = tracers[worker];
+            Sampler &sampler = *samplers[worker];
+            uint64_t tileStart = RENDER_STATS ? statsClock() : 0;
+            for (unsigned int pass = tile.firstPass; pass < tile.firstPass + tile.passes; ++pass) {
+                uint64_t passStart = RENDER_STATS ? statsClock() : 0;
+                if constexpr (WAVE) wavefronts[worker].clear();
+                for (int y = tile.y0; y < tile.y1; ++y) {
+                    for (int x = tile.x0; x < tile.x1; ++x) {
+                        unsigned int index = (h - y - 1) * w + x;
+                        if (img.samples(index) > pass - (firstSample - 1)) {  // taken before a resumed render stopped
+                            if (RENDER_STATS) tracer.stats.resumeSkips++;
+                            continue;
+                        }
+                        uint64_t sampleStart = RENDER_STATS && !pixelCost.empty() ? statsClock() : 0;
+                        sampler.startPixelSample(index, pass);
+                        Ray ray = camera.generateRay<FOCUS>(x, y, sampler);
+                        if constexpr (WAVE) {
+                            wavefronts[worker].addPath(index, ray, sampler);  // traced below, a tile at a time
+                            continue;
+                        }
+                        SurfaceFeatures surface;
+                        Vector rads = tracer.getRadiance<Policy>(ray, sampler, &surface);
+                        if constexpr (Policy::features) features.add(index, surface);
+                        rads.clamp();
+                        img.setPixel(x, y, rads);
+                        if (RENDER_STATS && !pixelCost.empty()) pixelCost[index] += statsClock() - sampleStart;
+                    }
                 }
-                Vector d = (cx * (((x + dx) / float(w)) - 0.5)) + (cy * (((y + dy) / float(h)) - 0.5)) + camera.direction;
-                Ray ray = Ray(camera.origin + d * 140, d.normalize());
-                if (FOCUS_EFFECT) {
-                    Vector fp = (camera.origin + d * L) + d.normalize() * FOCAL_LENGTH;
-                    Vector del_x = (cx * dx * L / float(w));
-                    Vector del_y = (cy * dy * L / float(h));
-                    Vector point = camera.origin + d * L;
-                    point = point + del_x + del_y;
-                    d = (fp - point).normalize();
-                    ray = Ray(camera.origin + d * L, d.normalize());
+                if constexpr (WAVE) {
+                    WavefrontIntegrator &wavefront = wavefronts[worker];
+                    wavefront.trace<Policy>(tracer, sampler, pass);
+                    for (const PathState &p : wavefront.paths) {
+                        if constexpr (Policy::features) features.add(p.pixel, p.features);
+                        Vector rads = p.radiance;
+                        rads.clamp();
+                        img.setPixel(p.pixel % w, h - 1 - p.pixel / w, rads);
+                    }
+                    if (RENDER_STATS && !pixelCost.empty()) {
+                        // The paths of a tile are traced together; share its time out by the rays each path traced
+                        double rays = 0;
+                        for (const PathState &p : wavefront.paths) rays += p.rays;
+                        double passTicks = statsClock() - passStart;
+                        for (const PathState &p : wavefront.paths) pixelCost[p.pixel] += passTicks * p.rays / rays;
+                    }
                 }
-                Vector rads = tracer.getRadiance(ray, 0);
-                rads.clamp();
-                img.setPixel(x, y, rads);
             }
+            if (RENDER_STATS) tracer.stats.renderTicks += statsClock() - tileStart;
+        };
+    };
+    ThreadPool::TileFunc renderTile = withTracePolicy(EMITTER_SAMPLING, compiled->materialSet(), DENOISE != DENOISE_NONE, RADIANCE_CACHE > 0, [&](auto policy) {
+        return withFlag(FOCUS_EFFECT, [&](auto focusEffect) {
+            return withFlag(WAVEFRONT, [&](auto wavefront) { return renderTileWith(policy, focusEffect, wavefront); });
+        });
+    });
+
+    // Snapshots are encoded and written on a background thread; the render
+    // loop only pays for copying the pixel estimates
+    ImageWriter writer;
+    std::chrono::duration<double, std::milli> snapshotTime(0), denoiseTime(0);
+    int snapshots = 0;
+    // Denoises the current image into `frame`, on the render pool
+    Denoiser denoiser;
+    auto denoise = [&](FrameBuffer &frame) {
+        auto denoiseStart = std::chrono::high_resolution_clock::now();
+        FrameBuffer raw;
+        img.snapshot(raw);
+        std::vector<float> variance(img.pixelCount());
+        for (size_t i = 0; i < variance.size(); ++i) variance[i] = img.samples(i) ? img.variance(i) / img.samples(i) : 0;
+        denoiser.run(raw, variance, features, frame, pool);
+        denoiseTime += std::chrono::high_resolution_clock::now() - denoiseStart;
+    };
+    auto snapshot = [&](unsigned int sample) {
+        if (SHARDS > 1) return;  // a shard's image is only part of the frame
+        auto snapshotStart = std::chrono::high_resolution_clock::now();
+        std::ostringstream fn;
+        fn << std::setfill('0') << std::setw(5) << sample;
+        if (DENOISE == DENOISE_SNAPSHOTS) {
+            denoise(writer.acquire());
+        } else {
+            img.snapshot(writer.acquire());
         }
-    }
+        writer.submit("results_temp/render_" + fn.str(), SAVE_PFM);
+        if (checkpoint.isOpen()) checkpoint.sync(false);
+        snapshotTime += std::chrono::high_resolution_clock::now() - snapshotStart;
+        snapshots++;
+    };
 
-    printProgressBar(MAX_spp, MAX_spp); // Ensure progress bar shows 100%
+    RenderStats stats;  // of the render thread; the workers' are added at the end
+    uint64_t adaptiveSkippedSamples = 0;
+    if (adaptive_sampling) {
+        // Whole tiles drop out once converged; snapshots are named by the average samples per pixel
+        AdaptiveScheduler scheduler(tiles, MIN_spp, MAX_spp, TARGET_ERROR);
+        std::vector<Tile> jobs;
+        bool resumed = RESUME && checkpoint.restoreRound(scheduler, jobs);
+        if (resumed) std::cout << "Resuming " << checkpointFile << " in round " << scheduler.rounds - 1 << std::endl;
+        while (resumed || scheduler.nextRound(img, jobs)) {
+            resumed = false;
+            if (checkpoint.isOpen()) checkpoint.saveRound(scheduler, jobs);
+            if (RENDER_STATS) stats.adaptiveSkips += tiles.size() - jobs.size();
+            printProgressBar(scheduler.spent / pixels, MAX_spp);
+            pool.run(jobs, renderTile);
+            if (scheduler.rounds > 1) snapshot(scheduler.spent / pixels);
+        }
+        printProgressBar(MAX_spp, MAX_spp);
+        adaptiveSkippedSamples = scheduler.budget - scheduler.spent;
+        std::cout << "\nAdaptive sampling: " << scheduler.rounds - 1 << " rounds, " << scheduler.finishedTiles() << "/"
+                  << tiles.size() << " tiles reached error " << TARGET_ERROR << ", "
+                  << double(scheduler.spent) / pixels << " samples per pixel on average";
+    } else {
+        unsigned int first = firstSample;
+        if (RESUME) {
+            first = std::max(first, checkpoint.pass() + 1);
+            std::cout << "Resuming " << checkpointFile << " at sample " << first << std::endl;
+        }
+        for (unsigned int sample = first; sample <= lastSample; ++sample) {
+            if (checkpoint.isOpen()) checkpoint.setPass(sample - 1);
+            printProgressBar(sample, MAX_spp);
+            if (sample && sample % SNAPSHOT_INTERVAL == 0) snapshot(sample);
+            for (Tile &tile : tiles) tile.firstPass = sample - 1;
+            pool.run(tiles, renderTile);
+        }
+        printProgressBar(MAX_spp, MAX_spp); // Ensure progress bar shows 100%
+    }
 
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end - start;
     std::cout << "\nRendering completed in " << elapsed.count() << " seconds." << std::endl;
+    std::cout << "Snapshots: " << snapshots << ", " << snapshotTime.count() << " ms on the render thread" << std::endl;
+
+    std::cout << "Intersection kernels: " << simdKernels().name << ", " << (sizeof(Scalar) == sizeof(float) ? "float" : "double")
+              << " precision" << std::endl;
+    const BVHBuildStats &bvhStats = tracers[0].scene->bvh.buildStats;
+    BVHTraversalStats traversal;
+    for (const Tracer &t : tracers) traversal += t.traversalStats;
+    std::cout << "BVH: " << bvhStats.primitives << " primitives (+" << tracers[0].scene->unboundedCount() << " unbounded), "
+              << bvhStats.nodes << " nodes, " << bvhStats.leaves << " leaves, depth " << bvhStats.maxDepth
+              << ", built in " << bvhStats.buildMs << " ms" << std::endl;
+    if (BVH_TRAVERSAL_STATS && traversal.rays) {
+        std::cout << "BVH traversal: " << double(traversal.nodeVisits) / traversal.rays << " nodes and "
+                  << double(traversal.primTests) / traversal.rays << " primitive tests per ray over "
+                  << traversal.rays << " rays" << std::endl;
+    }
+    if (radianceCache) std::cout << "Radiance cache: " << radianceCache->usedCells() << " cells" << std::endl;
+
+    auto saveStart = std::chrono::high_resolution_clock::now();
+    FrameBuffer denoised;
+    if (SHARDS > 1) {
+        std::cout << "Wrote shard " << SHARD << "/" << SHARDS << " to " << checkpointFile
+                  << "; combine the shards with --merge" << std::endl;
+    } else {
+        img.snapshot(writer.acquire());
+        writer.submit("results_final/render", SAVE_PFM);
+        if (DENOISE != DENOISE_NONE) {
+            denoise(denoised);
+            writer.acquire() = denoised;
+            writer.submit("results_final/render_denoised", SAVE_PFM);
+            if (SAVE_PFM) {
+                FrameBuffer normal, albedo, depth;
+                features.snapshot(normal, albedo, depth);
+                if (!writePFM("results_final/render_normal.pfm", normal) || !writePFM("results_final/render_albedo.pfm", albedo)
+                    || !writePFM("results_final/render_depth.pfm", depth)) {
+                    std::cout << "Could not write the denoiser's feature buffers" << std::endl;
+                }
+            }
+        }
+    }
+    writer.finish();
+    snapshotTime += std::chrono::high_resolution_clock::now() - saveStart;
 
-    img.save("results_final/render");
+    if (DENOISE != DENOISE_NONE) std::cout << "Denoising: " << denoiseTime.count() << " ms" << std::endl;
+
+    if (!compareFile.empty() && SHARDS == 1) {
+        FrameBuffer frame, reference;
+        img.snapshot(frame);
+        if (!readPFM(compareFile, reference)) {
+            std::cout << "Could not read " << compareFile << std::endl;
+        } else if (reference.width != frame.width || reference.height != frame.height) {
+            std::cout << compareFile << " is " << reference.width << "x" << reference.height << ", not " << w << "x" << h << std::endl;
+        } else {
+            std::cout << "Relative RMS error against " << compareFile << ": " << relativeRMSError(frame, reference) << std::endl;
+            if (DENOISE != DENOISE_NONE) {
+                std::cout << "Relative RMS error of the denoised image: " << relativeRMSError(denoised, reference) << std::endl;
+            }
+        }
+    }
+
+    if (RENDER_STATS && !statsFile.empty()) {
+        for (const Tracer &t : tracers) stats += t.stats;
+        stats.saveNs = snapshotTime.count() * 1e6;
+        if (stats.writeJSON(statsFile, elapsed.count(), pool.size(), WAVEFRONT, adaptiveSkippedSamples)) {
+            std::cout << "Wrote render statistics to " << statsFile << std::endl;
+        } else {
+            std::cout << "Could not write " << statsFile << std::endl;
+        }
+    }
+    if (RENDER_STATS && !pixelCost.empty()) {
+        // White at the 99th percentile of the cost, so that a pixel whose
+        // thread was preempted does not leave the rest of the map dark
+        FrameBuffer costs;
+        costs.width = w;
+        costs.height = h;
+        std::vector<float> sorted = pixelCost;
+        std::nth_element(sorted.begin(), sorted.begin() + sorted.size() * 99 / 100, sorted.end());
+        float white = sorted[sorted.size() * 99 / 100];
+        // Undoes the PPM's gamma, so that brightness is proportional to the cost
+        for (float c : pixelCost) costs.rgb.insert(costs.rgb.end(), 3, white > 0 ? pow(std::min(1.0f, c / white), 2.2f) : 0);
+        bool saved = writePPM(costMapPrefix + ".ppm", costs);
+        if (SAVE_PFM) {
+            // In nanoseconds
+            for (size_t i = 0; i < pixelCost.size(); ++i) {
+                costs.rgb[3 * i] = costs.rgb[3 * i + 1] = costs.rgb[3 * i + 2] = statsClockNs(pixelCost[i]);
+            }
+            saved = writePFM(costMapPrefix + ".pfm", costs) && saved;
+        }
+        std::cout << (saved ? "Wrote the cost map to " : "Could not write ") << costMapPrefix << std::endl;
+    }
+    if (checkpoint.isOpen()) {
+        checkpoint.finish();
+        checkpoint.sync(true);
+    }
     return 0;
 }
@@ -0,0 +1,64 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Memory mapping of a whole file, unmapped on destruction. open() maps it
+// read-only; openWritable() and create() map it shared and writable, so
+// stores land in the file through the page cache and outlive the process.
+struct MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+    bool writable = false;
+
+    MappedFile() {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &path) { return map(path, O_RDONLY, 0); }
+    bool openWritable(const std::string &path) { return map(path, O_RDWR, 0); }
+    // Creates `path`, or empties it, as `bytes` zero bytes
+    bool create(const std::string &path, size_t bytes) { return map(path, O_RDWR | O_CREAT | O_TRUNC, bytes); }
+
+    char *writableData() const { return writable ? const_cast<char *>(data) : nullptr; }
+
+    // Schedules the dirty pages for writing back; with `wait`, returns once they are on disk
+    bool sync(bool wait) const {
+        return writable && msync(const_cast<char *>(data), size, wait ? MS_SYNC : MS_ASYNC) == 0;
+    }
+
+    void close() {
+        if (data) munmap(const_cast<char *>(data), size);
+        data = nullptr;
+        size = 0;
+        writable = false;
+    }
+
+    ~MappedFile() { close(); }
+
+private:
+    bool map(const std::string &path, int flags, size_t bytes) {
+        close();
+        int fd = ::open(path.c_str(), flags, 0644);
+        if (fd < 0) return false;
+        bool rw = (flags & O_ACCMODE) == O_RDWR;
+        struct stat st;
+        if ((bytes == 0 || ftruncate(fd, bytes) == 0) && fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, rw ? PROT_READ | PROT_WRITE : PROT_READ, rw ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<const char *>(p);
+                size = st.st_size;
+                writable = rw;
+            }
+        }
+        ::close(fd);  // the mapping stays valid after the descriptor is closed
+        return data != nullptr;
+    }
+};
+
+#endif // MAPPEDFILE_H
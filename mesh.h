@@ -0,0 +1,332 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cctype>
+#include "vector.h"
+#include "ray.h"
+#include "shapes.h"
+#include "bvh.h"
+#include "mappedfile.h"
+
+// Triangle mesh with shared vertex and index buffers and its own BVH. The
+// buffers either live in the mesh or point straight into a mapped .mesh file.
+// Triangles are kept in BVH leaf order, so a leaf slot is a triangle index.
+struct TriangleMesh final : Shape {
+    const float *positions = nullptr;     // x, y, z per vertex
+    const uint32_t *triangles = nullptr;  // three vertex indices per triangle
+    const BVHNode *nodes = nullptr;
+    uint32_t vertexCount = 0, triangleCount = 0, nodeCount = 0;
+    BVHBuildStats buildStats;
+
+    TriangleMesh(std::vector<float> positions_, std::vector<uint32_t> triangles_,
+                 const Vector &color_, const Vector &emit_, Material material_)
+        : Shape(color_, emit_, material_), positionStore(std::move(positions_)), triangleStore(std::move(triangles_)) {
+        positions = positionStore.data();
+        std::vector<AABB> bounds(triangleStore.size() / 3);
+        for (size_t i = 0; i < bounds.size(); ++i) {
+            for (int k = 0; k < 3; ++k) bounds[i].grow(vertex(triangleStore[3 * i + k]));
+        }
+        BVH bvh;
+        bvh.build(bounds);
+        buildStats = bvh.buildStats;
+        // Reorder the triangles into leaf order so traversal needs no index indirection
+        std::vector<uint32_t> sorted(triangleStore.size());
+        for (size_t i = 0; i < bvh.indices.size(); ++i) {
+            memcpy(&sorted[3 * i], &triangleStore[3 * bvh.indices[i]], 3 * sizeof(uint32_t));
+        }
+        triangleStore.swap(sorted);
+        nodeStore.swap(bvh.nodes);
+        triangles = triangleStore.data();
+        nodes = nodeStore.data();
+        vertexCount = positionStore.size() / 3;
+        triangleCount = triangleStore.size() / 3;
+        nodeCount = nodeStore.size();
+    }
+
+    Vector vertex(uint32_t i) const { return Vector(positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]); }
+
+    Scalar intersects(const Ray &r) const override {
+        uint32_t prim;
+        return intersectsPrimitive(r, prim);
+    }
+
+    Scalar intersectsPrimitive(const Ray &r, uint32_t &prim) const override {
+        if (!nodeCount) return 0;
+        TrianglePrecompute pre(r);
+        Scalar closest = 1e20;
+        bool found = false;
+        BVHTraversalStats ignored;
+        traverseBVH(nodes, r, closest, [&](uint32_t first, uint32_t count, Scalar &tmax) {
+            for (uint32_t tri = first; tri < first + count; ++tri) {
+                Scalar t = intersectTriangle(pre, tri, tmax);
+                if (t > 0) {
+                    tmax = t;
+                    prim = tri;
+                    found = true;
+                }
+            }
+            return false;
+        }, ignored);
+        return found ? closest : 0;
+    }
+
+    Vector getNormal(const Vector &p) const override { return Vector(); }  // needs the triangle, see below
+
+    Vector getPrimitiveNormal(const Vector &p, uint32_t prim) const override {
+        const uint32_t *t = triangles + 3 * prim;
+        Vector v0 = vertex(t[0]);
+        return (vertex(t[1]) - v0).cross(vertex(t[2]) - v0).normalize();
+    }
+
+    Vector randomPoint(Sampler &sampler) const override {
+        uint32_t tri;
+        return randomPoint(sampler, tri);
+    }
+
+    // Uniform over triangles (not area), then uniform within the triangle,
+    // which is `tri`: the density is 1 / (triangleCount * triangleArea(tri)).
+    // The point in the triangle is drawn first, so it gets a 2D pair of
+    // sampling dimensions to itself.
+    Vector randomPoint(Sampler &sampler, uint32_t &tri) const {
+        Scalar su = std::sqrt(Scalar(sampler.get1D())), v = sampler.get1D();
+        tri = std::min<uint32_t>(triangleCount - 1, sampler.get1D() * triangleCount);
+        const uint32_t *t = triangles + 3 * tri;
+        return vertex(t[0]) * (1 - su) + vertex(t[1]) * (su * (1 - v)) + vertex(t[2]) * (su * v);
+    }
+
+    double triangleArea(uint32_t tri) const {
+        const uint32_t *t = triangles + 3 * tri;
+        Vector v0 = vertex(t[0]);
+        Vector n = (vertex(t[1]) - v0).cross(vertex(t[2]) - v0);
+        return std::sqrt(n.dot(n)) / 2;
+    }
+
+    double area() const {
+        double sum = 0;
+        for (uint32_t i = 0; i < triangleCount; ++i) sum += triangleArea(i);
+        return sum;
+    }
+
+    bool getBounds(AABB &box) const override {
+        if (!nodeCount) return false;
+        box = AABB(Vector(nodes[0].lo[0], nodes[0].lo[1], nodes[0].lo[2]),
+                   Vector(nodes[0].hi[0], nodes[0].hi[1], nodes[0].hi[2]));
+        return true;
+    }
+
+    // Native binary format: a header followed by the vertex, triangle and BVH
+    // node arrays, each 64-byte aligned, exactly as they are laid out in memory
+    struct FileHeader {
+        char magic[8];
+        uint32_t version, vertexCount, triangleCount, nodeCount;
+        uint64_t positionsOffset, trianglesOffset, nodesOffset;
+    };
+    static const uint32_t FILE_VERSION = 1;
+
+    bool save(const std::string &path) const {
+        FILE *f = fopen(path.c_str(), "wb");
+        if (!f) return false;
+        bool ok = write(f, 0);
+        return fclose(f) == 0 && ok;
+    }
+
+    // Writes the binary format into `f` starting at `base` (a multiple of 64),
+    // so other files can embed meshes; offsets are relative to `base`
+    bool write(FILE *f, uint64_t base) const {
+        FileHeader header = layout();
+        return writeAt(f, base, &header, sizeof(header))
+            && writeAt(f, base + header.positionsOffset, positions, 3 * sizeof(float) * uint64_t(vertexCount))
+            && writeAt(f, base + header.trianglesOffset, triangles, 3 * sizeof(uint32_t) * uint64_t(triangleCount))
+            && writeAt(f, base + header.nodesOffset, nodes, sizeof(BVHNode) * uint64_t(nodeCount));
+    }
+
+    // Bytes taken by write()
+    uint64_t fileSize() const { return layout().nodesOffset + sizeof(BVHNode) * uint64_t(nodeCount); }
+
+    // Maps a file written by save(); the mesh renders straight from the mapping
+    static TriangleMesh *loadBinary(const std::string &path, const Vector &color, const Vector &emit, Material material) {
+        std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+        if (!file->open(path)) return nullptr;
+        return fromMapping(file, 0, color, emit, material);
+    }
+
+    // A mesh written by write() at `base` of a mapped file; the mesh keeps the
+    // mapping alive. Null unless the file holds a whole, consistent mesh there:
+    // the arrays lie within the file, every vertex index is in range and the
+    // BVH passes validBVH(), so a damaged file cannot make a render read
+    // outside the mapping.
+    static TriangleMesh *fromMapping(const std::shared_ptr<MappedFile> &file, uint64_t base,
+                                     const Vector &color, const Vector &emit, Material material) {
+        if (base % 64 != 0 || base > file->size || file->size - base < sizeof(FileHeader)) return nullptr;
+        const char *data = file->data + base;
+        const FileHeader *header = reinterpret_cast<const FileHeader *>(data);
+        if (memcmp(header->magic, "MLMESH", 6) != 0 || header->version != FILE_VERSION) return nullptr;
+        uint64_t room = file->size - base;
+        if (!sectionFits(room, header->positionsOffset, 3 * sizeof(float), header->vertexCount)
+            || !sectionFits(room, header->trianglesOffset, 3 * sizeof(uint32_t), header->triangleCount)
+            || !sectionFits(room, header->nodesOffset, sizeof(BVHNode), header->nodeCount)) {
+            return nullptr;
+        }
+        const uint32_t *triangles = reinterpret_cast<const uint32_t *>(data + header->trianglesOffset);
+        for (uint64_t k = 0; k < 3 * uint64_t(header->triangleCount); ++k) {
+            if (triangles[k] >= header->vertexCount) return nullptr;
+        }
+        const BVHNode *nodes = reinterpret_cast<const BVHNode *>(data + header->nodesOffset);
+        if (!validBVH(nodes, header->nodeCount, header->triangleCount)) return nullptr;
+        TriangleMesh *mesh = new TriangleMesh(color, emit, material);
+        mesh->file = file;
+        mesh->positions = reinterpret_cast<const float *>(data + header->positionsOffset);
+        mesh->triangles = reinterpret_cast<const uint32_t *>(data + header->trianglesOffset);
+        mesh->nodes = reinterpret_cast<const BVHNode *>(data + header->nodesOffset);
+        mesh->vertexCount = header->vertexCount;
+        mesh->triangleCount = header->triangleCount;
+        mesh->nodeCount = header->nodeCount;
+        return mesh;
+    }
+
+    // Single pass over a mapped OBJ file. Only `v` and `f` records are used;
+    // polygons are split into fans and negative (relative) indices are resolved.
+    static TriangleMesh *loadOBJ(const std::string &path, const Vector &color, const Vector &emit, Material material) {
+        MappedFile file;
+        if (!file.open(path)) return nullptr;
+        std::vector<float> positions;
+        std::vector<uint32_t> triangles;
+        const char *p = file.data, *end = file.data + file.size;
+        while (p < end) {
+            if (p[0] == 'v' && p + 1 < end && (p[1] == ' ' || p[1] == '\t')) {
+                p += 2;
+                for (int k = 0; k < 3; ++k) positions.push_back(parseFloat(p, end));
+            } else if (p[0] == 'f' && p + 1 < end && (p[1] == ' ' || p[1] == '\t')) {
+                p += 2;
+                long first = 0, prev = 0;
+                int n = 0;
+                long vertices = positions.size() / 3;
+                while (true) {
+                    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+                    if (p >= end || *p == '\n' || *p == '\r' || *p == '#') break;
+                    long idx = parseInt(p, end);
+                    idx = idx < 0 ? vertices + idx : idx - 1;
+                    while (p < end && !isspace(*p)) ++p;  // skip /texture/normal indices
+                    if (idx < 0 || idx >= vertices) return nullptr;
+                    if (n == 0) first = idx;
+                    if (n >= 2) {
+                        triangles.push_back(first);
+                        triangles.push_back(prev);
+                        triangles.push_back(idx);
+                    }
+                    prev = idx;
+                    ++n;
+                }
+            }
+            while (p < end && *p != '\n') ++p;
+            ++p;
+        }
+        return new TriangleMesh(std::move(positions), std::move(triangles), color, emit, material);
+    }
+
+    // Picks the loader from the extension: .obj is parsed, anything else is mapped as a binary mesh
+    static TriangleMesh *load(const std::string &path, const Vector &color, const Vector &emit, Material material) {
+        if (path.size() > 4 && path.compare(path.size() - 4, 4, ".obj") == 0) return loadOBJ(path, color, emit, material);
+        return loadBinary(path, color, emit, material);
+    }
+
+private:
+    std::vector<float> positionStore;
+    std::vector<uint32_t> triangleStore;
+    std::vector<BVHNode> nodeStore;
+    std::shared_ptr<MappedFile> file;
+
+    TriangleMesh(const Vector &color_, const Vector &emit_, Material material_) : Shape(color_, emit_, material_) {}
+
+    // Per-ray setup of the watertight test (Woop, Benthin and Wald 2013): shear
+    // the ray to +z along its dominant axis, then test edge functions in 2D
+    struct TrianglePrecompute {
+        int kx, ky, kz;
+        Scalar Sx, Sy, Sz;
+        Scalar org[3];
+        TrianglePrecompute(const Ray &r) {
+            Scalar d[3] = {r.direction.x, r.direction.y, r.direction.z};
+            org[0] = r.origin.x; org[1] = r.origin.y; org[2] = r.origin.z;
+            kz = std::fabs(d[0]) > std::fabs(d[1]) ? (std::fabs(d[0]) > std::fabs(d[2]) ? 0 : 2) : (std::fabs(d[1]) > std::fabs(d[2]) ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            if (d[kz] < 0) std::swap(kx, ky);  // keep the winding
+            Sx = d[kx] / d[kz];
+            Sy = d[ky] / d[kz];
+            Sz = 1 / d[kz];
+        }
+    };
+
+    // Returns the hit distance in (EPSILON, tmax), or 0
+    Scalar intersectTriangle(const TrianglePrecompute &pre, uint32_t tri, Scalar tmax) const {
+        const float *a = positions + 3 * triangles[3 * tri];
+        const float *b = positions + 3 * triangles[3 * tri + 1];
+        const float *c = positions + 3 * triangles[3 * tri + 2];
+        Scalar Az = a[pre.kz] - pre.org[pre.kz], Bz = b[pre.kz] - pre.org[pre.kz], Cz = c[pre.kz] - pre.org[pre.kz];
+        Scalar Ax = a[pre.kx] - pre.org[pre.kx] - pre.Sx * Az, Ay = a[pre.ky] - pre.org[pre.ky] - pre.Sy * Az;
+        Scalar Bx = b[pre.kx] - pre.org[pre.kx] - pre.Sx * Bz, By = b[pre.ky] - pre.org[pre.ky] - pre.Sy * Bz;
+        Scalar Cx = c[pre.kx] - pre.org[pre.kx] - pre.Sx * Cz, Cy = c[pre.ky] - pre.org[pre.ky] - pre.Sy * Cz;
+        Scalar U = Cx * By - Cy * Bx;
+        Scalar V = Ax * Cy - Ay * Cx;
+        Scalar W = Bx * Ay - By * Ax;
+        if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return 0;
+        Scalar det = U + V + W;
+        if (det == 0) return 0;
+        Scalar t = (U * Az + V * Bz + W * Cz) * pre.Sz / det;
+        return (t > EPSILON && t < tmax) ? t : 0;
+    }
+
+    static uint64_t align(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+
+    // True when `count` elements of `size` bytes at `offset` fit in the `room`
+    // bytes after the header's base, 64-byte aligned as write() puts them
+    static bool sectionFits(uint64_t room, uint64_t offset, uint64_t size, uint32_t count) {
+        return offset % 64 == 0 && offset >= sizeof(FileHeader) && offset <= room && size * count <= room - offset;
+    }
+
+    FileHeader layout() const {
+        FileHeader header = {{'M', 'L', 'M', 'E', 'S', 'H', 0, 0}, FILE_VERSION, vertexCount, triangleCount, nodeCount, 0, 0, 0};
+        header.positionsOffset = align(sizeof(FileHeader));
+        header.trianglesOffset = align(header.positionsOffset + 3 * sizeof(float) * uint64_t(vertexCount));
+        header.nodesOffset = align(header.trianglesOffset + 3 * sizeof(uint32_t) * uint64_t(triangleCount));
+        return header;
+    }
+
+    static bool writeAt(FILE *f, uint64_t offset, const void *data, size_t bytes) {
+        return fseek(f, offset, SEEK_SET) == 0 && fwrite(data, 1, bytes, f) == bytes;
+    }
+
+    static long parseInt(const char *&p, const char *end) {
+        bool negative = p < end && *p == '-';
+        if (negative || (p < end && *p == '+')) ++p;
+        long v = 0;
+        while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+        return negative ? -v : v;
+    }
+
+    // Hand-rolled decimal parser: strtod is locale-aware and far slower on large files
+    static float parseFloat(const char *&p, const char *end) {
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        bool negative = p < end && *p == '-';
+        if (negative || (p < end && *p == '+')) ++p;
+        double v = 0;
+        while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+        if (p < end && *p == '.') {
+            double scale = 0.1;
+            for (++p; p < end && *p >= '0' && *p <= '9'; ++p, scale *= 0.1) v += (*p - '0') * scale;
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            ++p;
+            v *= pow(10.0, parseInt(p, end));
+        }
+        return negative ? -v : v;
+    }
+};
+
+#endif // MESH_H
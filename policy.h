@@ -0,0 +1,53 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <type_traits>
+#include <utility>
+
+// Render modes that stay fixed for a whole render. They are template
+// parameters of the integrators, the camera and the tile loop rather than
+// flags read per sample or per bounce, so every combination compiles to its
+// own loop with the branches of the other modes removed. main() picks the
+// combination once, before the first tile is rendered.
+
+// Which material branches the integrators keep. A scene that only has
+// diffuse surfaces (emitters aside) is rendered without the mirror and glass
+// code.
+enum MaterialSet {
+    ALL_MATERIALS,
+    DIFFUSE_ONLY
+};
+
+template <bool EmitterSampling, MaterialSet Materials, bool Features = false, bool Caching = false>
+struct TracePolicy {
+    static constexpr bool emitterSampling = EmitterSampling;  // next event estimation at diffuse hits
+    static constexpr MaterialSet materials = Materials;
+    static constexpr bool features = Features;  // record the first hit's SurfaceFeatures, for the denoiser
+    static constexpr bool caching = Caching;    // end paths at the tracer's RadianceCache, and fill it
+};
+
+typedef TracePolicy<true, ALL_MATERIALS> DefaultTracePolicy;
+
+// Calls f with std::true_type or std::false_type, turning a flag read once
+// into a constant of the code f instantiates
+template <typename F>
+decltype(auto) withFlag(bool flag, F &&f) {
+    if (flag) return std::forward<F>(f)(std::true_type());
+    return std::forward<F>(f)(std::false_type());
+}
+
+// Calls f with the TracePolicy of the given modes
+template <typename F>
+decltype(auto) withTracePolicy(bool emitterSampling, MaterialSet materials, bool features, bool caching, F &&f) {
+    return withFlag(emitterSampling, [&](auto sampling) -> decltype(auto) {
+        return withFlag(features, [&](auto recording) -> decltype(auto) {
+            return withFlag(caching, [&](auto cached) -> decltype(auto) {
+                constexpr bool S = decltype(sampling)::value, R = decltype(recording)::value, C = decltype(cached)::value;
+                if (materials == DIFFUSE_ONLY) return f(TracePolicy<S, DIFFUSE_ONLY, R, C>());
+                return f(TracePolicy<S, ALL_MATERIALS, R, C>());
+            });
+        });
+    });
+}
+
+#endif // POLICY_H
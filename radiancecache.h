@@ -0,0 +1,176 @@
+#ifndef RADIANCECACHE_H
+#define RADIANCECACHE_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <algorithm>
+#include "vector.h"
+#include "sampler.h"
+
+// Light reflected by diffuse surfaces, learned from the render's own paths
+// and shared by all render threads through a hash table. A cell holds the
+// mean of what paths leaving its surfaces gathered per unit of albedo (the
+// cosine-weighted mean of the incoming radiance), so surfaces of any colour
+// or texture share it. Cells are a grid keyed by position and normal, whose
+// size grows with the distance from the camera in powers of two, so a cell
+// covers about the same part of the image wherever it is.
+//
+// A path that reaches a diffuse surface after `lookupAfter` diffuse bounces
+// ends there with the cell's estimate, once that has `minSamples` samples and
+// the standard error of their luminance is at most `maxError` of its mean.
+// Until then the path goes on, and adds what it gathers to the cell.
+//
+// No locks: a cell is claimed by a compare-and-swap of its key, and samples
+// are added with atomic operations, so threads look up and fill cells at
+// once. A reader can see a sample's sums before its count, one sample off
+// in at least minSamples.
+//
+// The estimate is biased, as a cell blurs the light over its extent, and
+// the image depends on the order the paths filled the cache in, so it
+// changes with the thread count and the integrator.
+struct RadianceCache {
+    static const uint32_t NO_CELL = UINT32_MAX;
+    static const int MAX_PROBES = 16;  // cells tried after the one a key hashes to
+
+    int lookupAfter = 1;              // diffuse bounces before a path can end at a cell
+    uint32_t minSamples = 32;
+    double maxError = 0.05;           // standard error of a cell's mean luminance, over that mean
+    Scalar cellScale = Scalar(1) / 64;  // a cell is this fraction of its distance from the camera, rounded up to a power of two
+
+    RadianceCache(const Vector &camera_, unsigned int logCells = 18)
+        : camera(camera_), mask((uint32_t(1) << logCells) - 1), cells(new Cell[size_t(mask) + 1]) {}
+
+    // The cell of a diffuse hit at `p` with the facing normal `n`, claimed
+    // if it is new; NO_CELL when the table is full around its key
+    uint32_t cell(const Vector &p, const Vector &n) {
+        uint64_t key = cellKey(p, n);
+        uint64_t hash = mixBits(key);
+        for (int i = 0; i < MAX_PROBES; ++i) {
+            uint32_t index = uint32_t(hash + i) & mask;
+            uint64_t found = cells[index].key.load(std::memory_order_acquire);
+            if (found == 0 && cells[index].key.compare_exchange_strong(found, key, std::memory_order_acq_rel)) return index;
+            if (found == key) return index;  // also when another thread has just claimed it
+        }
+        return NO_CELL;
+    }
+
+    // The cell's mean, if it is good enough to use
+    bool lookup(uint32_t index, Vector &mean) const {
+        if (index == NO_CELL) return false;
+        const Cell &c = cells[index];
+        uint32_t n = c.samples.load(std::memory_order_acquire);
+        if (n < minSamples) return false;
+        double r = c.r.load(std::memory_order_relaxed) / n, g = c.g.load(std::memory_order_relaxed) / n,
+               b = c.b.load(std::memory_order_relaxed) / n;
+        double l = luminance(r, g, b);
+        double variance = c.luminanceSquares.load(std::memory_order_relaxed) / n - l * l;  // of one sample
+        if (variance > maxError * maxError * l * l * n) return false;
+        mean = Vector(Scalar(r), Scalar(g), Scalar(b));
+        return true;
+    }
+
+    void add(uint32_t index, const Vector &value) {
+        double l = luminance(value.x, value.y, value.z);
+        if (!std::isfinite(l)) return;
+        Cell &c = cells[index];
+        atomicAdd(c.r, value.x);
+        atomicAdd(c.g, value.y);
+        atomicAdd(c.b, value.z);
+        atomicAdd(c.luminanceSquares, l * l);
+        c.samples.fetch_add(1, std::memory_order_release);
+    }
+
+    size_t usedCells() const {
+        size_t used = 0;
+        for (size_t i = 0; i <= mask; ++i) used += cells[i].key.load(std::memory_order_relaxed) != 0;
+        return used;
+    }
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> key{0};  // 0 while the cell is free
+        std::atomic<uint32_t> samples{0};
+        std::atomic<double> r{0}, g{0}, b{0}, luminanceSquares{0};
+    };
+
+    Vector camera;
+    uint32_t mask;
+    std::unique_ptr<Cell[]> cells;
+
+    static double luminance(double r, double g, double b) { return 0.2126 * r + 0.7152 * g + 0.0722 * b; }
+
+    static void atomicAdd(std::atomic<double> &a, double v) {
+        double old = a.load(std::memory_order_relaxed);
+        while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) {}
+    }
+
+    // 17 bits for each grid coordinate, 6 for the cell size, 5 for the
+    // normal, and the top bit so that no key is 0
+    uint64_t cellKey(const Vector &p, const Vector &n) const {
+        Vector toCamera = p - camera;
+        int level;
+        std::frexp(std::max(1e-9, double(std::sqrt(toCamera.dot(toCamera)) * cellScale)), &level);
+        level = std::min(31, std::max(-32, level));
+        double scale = std::ldexp(1.0, -level);
+        // The grid is offset so that walls at round coordinates do not lie on cell boundaries
+        auto coordinate = [&](Scalar x) { return uint64_t(int64_t(std::floor(x * scale + 0.3183))) & 0x1FFFF; };
+        return coordinate(p.x) | coordinate(p.y) << 17 | coordinate(p.z) << 34 | uint64_t(level + 32) << 51
+               | uint64_t(normalBin(n)) << 57 | uint64_t(1) << 63;
+    }
+
+    // One of 5x5 bins of the octahedral map of the unit normal; the axis
+    // directions fall in the middle of a bin each
+    static uint32_t normalBin(const Vector &n) {
+        Scalar sum = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+        Scalar u = n.x / sum, v = n.y / sum;
+        if (n.z < 0) {
+            Scalar fu = (1 - std::fabs(v)) * (u >= 0 ? 1 : -1), fv = (1 - std::fabs(u)) * (v >= 0 ? 1 : -1);
+            u = fu;
+            v = fv;
+        }
+        auto bin = [](Scalar x) { return std::min(4, std::max(0, int((x + 1) * Scalar(2.5)))); };
+        return bin(u) * 5 + bin(v);
+    }
+};
+
+// The diffuse hits of one path whose cells it trains, each with what the
+// path has gathered since, per unit of that surface's albedo. The
+// integrators tell it about every colour the path's throughput is
+// multiplied by and every light the path adds, and add it to the cache
+// when the path ends.
+struct CachePath {
+    static const int MAX_RECORDS = 4;
+    struct Record {
+        uint32_t cell;
+        Vector weight;  // product of the colours met since the record's own surface
+        Vector sum;
+    };
+    Record records[MAX_RECORDS];
+    int count = 0;
+    int diffuseBounces = 0;
+    uint32_t cell = RadianceCache::NO_CELL;  // of the current diffuse hit
+
+    // `f` was added to the path's radiance in units of its current throughput
+    void add(const Vector &f) {
+        for (int i = 0; i < count; ++i) records[i].sum += records[i].weight * f;
+    }
+
+    // The throughput was multiplied by `color`
+    void bounce(const Vector &color) {
+        for (int i = 0; i < count; ++i) records[i].weight = records[i].weight * color;
+    }
+
+    // The path leaves the current diffuse hit; after its bounce(color)
+    void record() {
+        ++diffuseBounces;
+        if (cell != RadianceCache::NO_CELL && count < MAX_RECORDS) records[count++] = {cell, Vector(1, 1, 1), Vector()};
+    }
+
+    void commit(RadianceCache &cache) const {
+        for (int i = 0; i < count; ++i) cache.add(records[i].cell, records[i].sum);
+    }
+};
+
+#endif // RADIANCECACHE_H
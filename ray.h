@@ -3,9 +3,13 @@
 
 #include "vector.h"
 
-struct Ray {
-    Vector origin, direction;
-    Ray(const Vector &o_, const Vector &d_) : origin(o_), direction(d_) {}
+template <typename T>
+struct RayT {
+    VectorT<T> origin, direction;
+    RayT() {}
+    RayT(const VectorT<T> &o_, const VectorT<T> &d_) : origin(o_), direction(d_) {}
 };
 
+typedef RayT<Scalar> Ray;
+
 #endif // RAY_H
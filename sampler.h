@@ -0,0 +1,382 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+// Sampling dimensions have fixed places, so that a dimension means the same
+// thing in every path and the low-discrepancy samplers below can stratify it.
+// The camera ray takes the first CAMERA_DIMENSIONS. Every bounce then has a
+// block of BOUNCE_DIMENSIONS, with its 2D draws starting on even dimensions,
+// which is how the Sobol sampler pairs them.
+static const unsigned int CAMERA_DIMENSIONS = 2, BOUNCE_DIMENSIONS = 8;
+enum BounceDimension : unsigned int {
+    DIM_ROULETTE = 0,     // Russian roulette
+    DIM_CHOICE = 1,       // glass: reflect or refract; diffuse: which light
+    DIM_LIGHT_POINT = 2,  // up to four, for the point on the light
+    DIM_DIRECTION = 6     // two, for the diffuse bounce
+};
+
+// Source of the uniform numbers used by the camera, the tracer and the shapes.
+// A sampler is positioned on one (pixel, sample) pair with startPixelSample();
+// each call to get1D() then returns the value of the next sampling dimension.
+// Values only depend on (pixel, sample, dimension), never on which thread asks
+// or in which order the tiles are rendered.
+struct Sampler {
+    uint64_t seed;
+    unsigned int pixel = 0, sampleIndex = 0, dimension = 0;
+
+    Sampler(uint64_t seed_) : seed(seed_) {}
+    virtual ~Sampler() {}
+
+    virtual void startPixelSample(unsigned int pixel_, unsigned int sample_) {
+        pixel = pixel_;
+        sampleIndex = sample_;
+        dimension = 0;
+    }
+    virtual double get1D() = 0;
+
+    // Moves to the first dimension of bounce `depth`
+    void startBounce(int depth) { dimension = CAMERA_DIMENSIONS + depth * BOUNCE_DIMENSIONS; }
+    // Moves to dimension `offset` of the bounce whose block the sampler is in
+    void seekBounce(BounceDimension offset) {
+        dimension = CAMERA_DIMENSIONS + (dimension - CAMERA_DIMENSIONS) / BOUNCE_DIMENSIONS * BOUNCE_DIMENSIONS + offset;
+    }
+};
+
+// 64-bit finaliser from SplitMix64; a bijection with full avalanche, so
+// consecutive counters give unrelated outputs
+inline uint64_t mixBits(uint64_t v) {
+    v ^= v >> 30;
+    v *= 0xbf58476d1ce4e5b9ULL;
+    v ^= v >> 27;
+    v *= 0x94d049bb133111ebULL;
+    v ^= v >> 31;
+    return v;
+}
+
+// Counter-based generator: every value is a hash of (seed, pixel, sample,
+// dimension), so there is no state to share or lock between threads
+struct RandomSampler : Sampler {
+    RandomSampler(uint64_t seed_ = 26) : Sampler(seed_) {}
+
+    double get1D() override {
+        // The seed is hashed first; XORed in directly it would only permute the sample indices
+        uint64_t key = mixBits(mixBits(seed) ^ ((uint64_t(pixel) << 32) | sampleIndex));
+        uint64_t bits = mixBits(key + 0x9e3779b97f4a7c15ULL * (uint64_t(dimension++) + 1));
+        return (bits >> 11) * 0x1.0p-53;  // 53 random mantissa bits in [0, 1)
+    }
+};
+
+// A 64x64 tileable blue-noise mask of the values (i + 0.5) / 4096, as 32-bit
+// fractions (so that adding them modulo 1 is an integer addition), made by
+// Ulichney's void-and-cluster method on first use: neighbouring values are
+// as different as possible, and any threshold of the mask is evenly spread.
+struct BlueNoiseMask {
+    static const int SIZE = 64;
+    std::vector<uint32_t> values;
+
+    static const BlueNoiseMask &get() {
+        static const BlueNoiseMask mask;
+        return mask;
+    }
+
+    uint32_t at(int x, int y) const { return values[(y & (SIZE - 1)) * SIZE + (x & (SIZE - 1))]; }
+
+private:
+    BlueNoiseMask() {
+        const int n = SIZE * SIZE;
+        // Gaussian energy of a point at each toroidal offset
+        std::vector<float> kernel(n);
+        for (int dy = 0; dy < SIZE; ++dy) {
+            for (int dx = 0; dx < SIZE; ++dx) {
+                int ex = std::min(dx, SIZE - dx), ey = std::min(dy, SIZE - dy);
+                kernel[dy * SIZE + dx] = std::exp(-(ex * ex + ey * ey) / (2 * 1.9f * 1.9f));
+            }
+        }
+        std::vector<uint8_t> on(n, 0);
+        std::vector<float> energy(n, 0);
+        auto toggle = [&](int p, bool set) {
+            on[p] = set;
+            int px = p % SIZE, py = p / SIZE;
+            for (int y = 0; y < SIZE; ++y) {
+                for (int x = 0; x < SIZE; ++x) {
+                    float k = kernel[((y - py) & (SIZE - 1)) * SIZE + ((x - px) & (SIZE - 1))];
+                    energy[y * SIZE + x] += set ? k : -k;
+                }
+            }
+        };
+        // The point in the tightest cluster, or the centre of the largest void
+        auto find = [&](bool cluster) {
+            int best = -1;
+            for (int p = 0; p < n; ++p) {
+                if (on[p] != cluster) continue;
+                if (best < 0 || (cluster ? energy[p] > energy[best] : energy[p] < energy[best])) best = p;
+            }
+            return best;
+        };
+        // A random tenth of the pixels, relaxed until moving the tightest
+        // point to the largest void no longer changes anything
+        int initial = n / 10;
+        for (int i = 0, placed = 0; placed < initial; ++i) {
+            int p = mixBits(0x5eed + i) % n;
+            if (!on[p]) {
+                toggle(p, true);
+                placed++;
+            }
+        }
+        while (true) {
+            int cluster = find(true);
+            toggle(cluster, false);
+            int gap = find(false);
+            toggle(gap, true);
+            if (gap == cluster) break;
+        }
+        std::vector<uint8_t> prototype = on;
+        std::vector<float> prototypeEnergy = energy;
+        std::vector<int> rank(n);
+        // The initial points get the lowest ranks, removed tightest first ...
+        for (int r = initial - 1; r >= 0; --r) {
+            int p = find(true);
+            toggle(p, false);
+            rank[p] = r;
+        }
+        // ... and the rest go, in order, into the largest remaining void
+        on = prototype;
+        energy = prototypeEnergy;
+        for (int r = initial; r < n; ++r) {
+            int p = find(false);
+            toggle(p, true);
+            rank[p] = r;
+        }
+        values.resize(n);
+        for (int p = 0; p < n; ++p) values[p] = uint32_t((rank[p] + 0.5) / n * 0x1.0p32);
+    }
+};
+
+inline uint32_t reverseBits(uint32_t x) {
+    x = __builtin_bswap32(x);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Laine and Karras's hash, in which every bit of the result depends only on
+// `seed` and the bits of x at or below it
+inline uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling of the bits of x, most significant first, by hashing
+// (Burley, "Practical Hash-based Owen Scrambling", 2020): each bit is flipped
+// or not depending on `seed` and the bits above it
+inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+// Base of the samplers below: the scrambles are keyed by the seed and the
+// pixel, and with `blueNoise` by the seed alone, every pixel then moving its
+// values by its own offsets from the blue-noise mask instead, so the error
+// of neighbouring pixels differs as much as possible (Georgiev and Fajardo,
+// 2016). Each dimension reads the mask at its own toroidal shift.
+struct ScrambledSampler : Sampler {
+    bool blueNoise;
+    unsigned int width;  // of the image, to place pixels in the blue-noise mask
+
+    ScrambledSampler(uint64_t seed_, bool blueNoise_, unsigned int width_)
+        : Sampler(seed_), blueNoise(blueNoise_), width(std::max(1u, width_)),
+          mask(blueNoise_ ? &BlueNoiseMask::get() : nullptr) {}
+
+    void startPixelSample(unsigned int pixel_, unsigned int sample_) override {
+        Sampler::startPixelSample(pixel_, sample_);
+        pixelKey = mixBits(seed) ^ (uint64_t(blueNoise ? 0 : pixel) << 32);
+        maskX = pixel % width;
+        maskY = pixel / width;
+    }
+
+protected:
+    uint64_t pixelKey = 0;  // the hash of the seed and pixel that the dimensions' keys start from
+    const BlueNoiseMask *mask;
+    int maskX = 0, maskY = 0;
+
+    // The pixel's blue-noise offset of dimension `d`, as a 32-bit fraction:
+    // added to a value's bits, it wraps around 1 without a branch (which would
+    // be mispredicted half the time)
+    uint32_t offset(unsigned int d) const {
+        if (!blueNoise) return 0;
+        uint64_t shift = mixBits(d + 1);
+        return mask->at(maskX + int(shift & 63), maskY + int((shift >> 6) & 63));
+    }
+};
+
+// Owen-scrambled Sobol points, padded from 2D: the dimensions are taken in
+// pairs, each pair a 2D Sobol sequence (van der Corput and its partner) with
+// its own scramble and its own shuffle of the sample order. Any 2^k
+// consecutive samples of a pixel stratify every pair as finely as 2^k points
+// can, and the pairs are independent of each other. Both values of a pair
+// are made at once; the second is kept for the next call.
+struct SobolSampler : ScrambledSampler {
+    SobolSampler(uint64_t seed_, bool blueNoise_ = false, unsigned int width_ = 1)
+        : ScrambledSampler(seed_, blueNoise_, width_) {}
+
+    void startPixelSample(unsigned int pixel_, unsigned int sample_) override {
+        ScrambledSampler::startPixelSample(pixel_, sample_);
+        reversedIndex = reverseBits(sampleIndex);
+        keptDimension = UINT32_MAX;
+    }
+
+    double get1D() override {
+        unsigned int d = dimension++;
+        if (d == keptDimension) return kept;
+        uint64_t pairKey = mixBits(pixelKey ^ (d / 2));
+        uint32_t index = reverseBits(laineKarrasPermutation(reversedIndex, uint32_t(pairKey)));  // owenScramble(sampleIndex)
+        // The first dimension is van der Corput's, the index with its bits
+        // reversed, which the scramble would reverse back
+        double first = uint32_t(reverseBits(laineKarrasPermutation(index, uint32_t(pairKey >> 32))) + offset(d & ~1u)) * 0x1.0p-32;
+        double second = uint32_t(owenScramble(sobolSecond(index), uint32_t(pairKey >> 32) ^ 1) + offset(d | 1)) * 0x1.0p-32;
+        if (d % 2) return second;
+        keptDimension = d + 1;
+        kept = second;
+        return first;
+    }
+
+private:
+    uint32_t reversedIndex = 0;
+    unsigned int keptDimension = UINT32_MAX;
+    double kept = 0;
+
+    // Point `index` of the second Sobol dimension, as 32 fraction bits: the
+    // XOR of the direction numbers of its set bits, a byte at a time. The
+    // direction numbers follow from the polynomial x + 1.
+    static uint32_t sobolSecond(uint32_t index) {
+        static const std::vector<uint32_t> table = [] {
+            uint32_t direction[32];
+            direction[0] = 0x80000000u;
+            for (int i = 1; i < 32; ++i) direction[i] = direction[i - 1] ^ (direction[i - 1] >> 1);
+            std::vector<uint32_t> t(4 * 256, 0);
+            for (int k = 0; k < 4; ++k) {
+                for (int b = 0; b < 256; ++b) {
+                    for (int j = 0; j < 8; ++j) {
+                        if (b >> j & 1) t[k * 256 + b] ^= direction[8 * k + j];
+                    }
+                }
+            }
+            return t;
+        }();
+        return table[index & 0xff] ^ table[256 + (index >> 8 & 0xff)] ^ table[512 + (index >> 16 & 0xff)] ^ table[768 + (index >> 24)];
+    }
+};
+
+// Halton points, each dimension the radical inverse of the sample index in
+// the next prime base, Owen-scrambled: every node of a base's digit tree
+// permutes its digits with its own random permutation, chosen by a hash of
+// the seed, the pixel and the digits above it. The permutations are random
+// affine maps d -> a d + c modulo the prime base, which take any two digits
+// to a uniformly random pair of distinct digits, all that the variance of
+// Owen scrambling relies on. (A random shift alone would keep consecutive
+// samples in consecutive strata, which in the large bases correlates the
+// first samples of a pixel.) Dimensions past the table of primes fall back
+// to random values.
+struct HaltonSampler : ScrambledSampler {
+    HaltonSampler(uint64_t seed_, bool blueNoise_ = false, unsigned int width_ = 1)
+        : ScrambledSampler(seed_, blueNoise_, width_) {}
+
+    double get1D() override {
+        static const std::vector<uint32_t> primes = firstPrimes(128);
+        unsigned int d = dimension++;
+        uint64_t key = mixBits(pixelKey ^ d);
+        double u = d < primes.size() ? scrambledRadicalInverse(sampleIndex, primes[d], key) : (mixBits(key ^ sampleIndex) >> 11) * 0x1.0p-53;
+        if (!blueNoise) return u;
+        // The offset is added in 53-bit fixed point, where it wraps like the Sobol sampler's
+        uint64_t bits = uint64_t(u * 0x1.0p53) + (uint64_t(offset(d)) << 21);
+        return (bits & ((uint64_t(1) << 53) - 1)) * 0x1.0p-53;
+    }
+
+private:
+    // Samples of a pixel stay stratified in every base up to this many
+    static const uint32_t STRATIFIED_SAMPLES = 1 << 12;
+
+    static double scrambledRadicalInverse(uint32_t index, uint32_t base, uint64_t key) {
+        if (base == 2) return owenScramble(reverseBits(index), uint32_t(key)) * 0x1.0p-32;
+        double invBase = 1.0 / base, scale = 1;
+        uint64_t digits = 0;  // the scrambled digits so far, most significant first
+        double u = 0;
+        // Indices that end in zeros share the nodes of those zeros with longer
+        // indices, so the zeros are permuted too, as far as STRATIFIED_SAMPLES needs
+        int k = 0;
+        for (uint64_t reach = 1; index || reach < STRATIFIED_SAMPLES; ++k, reach *= base) {
+            uint32_t digit = index % base;
+            index /= base;
+            uint64_t node = mixBits(key ^ (digits * 0x9e3779b97f4a7c15ULL) ^ k);
+            uint32_t a = 1 + ((node & 0xffffffffu) * (base - 1) >> 32), c = (node >> 32) * base >> 32;
+            digit = (a * digit + c) % base;
+            digits = digits * base + digit;
+            scale *= invBase;
+            u += digit * scale;
+        }
+        // Past that the scrambled digits are uniformly random
+        u += scale * ((mixBits(key ^ (digits * 0x9e3779b97f4a7c15ULL) ^ k) >> 11) * 0x1.0p-53);
+        return std::min(u, 0x1.fffffffffffffp-1);
+    }
+
+    static std::vector<uint32_t> firstPrimes(size_t count) {
+        std::vector<uint32_t> primes;
+        for (uint32_t n = 2; primes.size() < count; ++n) {
+            bool prime = true;
+            for (uint32_t p : primes) {
+                if (p * p > n) break;
+                if (n % p == 0) {
+                    prime = false;
+                    break;
+                }
+            }
+            if (prime) primes.push_back(n);
+        }
+        return primes;
+    }
+};
+
+enum SamplerType : uint32_t {
+    SAMPLER_RANDOM,
+    SAMPLER_SOBOL,
+    SAMPLER_HALTON
+};
+static const uint32_t SAMPLER_BLUE_NOISE = 0x100;  // flag on the Sobol and Halton samplers
+
+// The sampler named by --sampler, or false if there is none of that name
+inline bool parseSamplerType(const std::string &name, uint32_t &type) {
+    if (name == "random") type = SAMPLER_RANDOM;
+    else if (name == "sobol") type = SAMPLER_SOBOL;
+    else if (name == "halton") type = SAMPLER_HALTON;
+    else return false;
+    return true;
+}
+
+inline const char *samplerName(uint32_t type) {
+    static const char *names[] = {"random", "sobol", "halton"};
+    return names[(type & 0xff) < 3 ? type & 0xff : 0];
+}
+
+inline std::unique_ptr<Sampler> makeSampler(uint32_t type, uint64_t seed, unsigned int width) {
+    bool blueNoise = type & SAMPLER_BLUE_NOISE;
+    switch (type & 0xff) {
+    case SAMPLER_SOBOL:
+        return std::unique_ptr<Sampler>(new SobolSampler(seed, blueNoise, width));
+    case SAMPLER_HALTON:
+        return std::unique_ptr<Sampler>(new HaltonSampler(seed, blueNoise, width));
+    default:
+        return std::unique_ptr<Sampler>(new RandomSampler(seed));
+    }
+}
+
+#endif // SAMPLER_H
@@ -0,0 +1,463 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include "vector.h"
+#include "ray.h"
+#include "shapes.h"
+#include "mesh.h"
+#include "sampler.h"
+#include "bvh.h"
+#include "simd.h"
+#include "lights.h"
+#include "policy.h"
+
+// The Shape classes describe a scene; CompiledScene is what the tracer reads
+// while rendering. It is built once from the shapes: geometry goes into one
+// contiguous array per shape type, colours and emission into indexed material
+// and texture records, and every primitive becomes a small record with a type
+// tag. The tracer switches on the tag instead of calling through a vtable.
+enum PrimitiveType : uint8_t {
+    PRIM_SPHERE,
+    PRIM_BOX,
+    PRIM_PLANE,
+    PRIM_MESH,
+    PRIM_OTHER  // a Shape subclass the scene does not know; reached through its virtual methods
+};
+
+enum TextureType : uint8_t {
+    TEXTURE_CHECKER,
+    TEXTURE_STRIPE
+};
+
+// A direction toward a point on a light, from CompiledScene::sampleLight
+struct LightSample {
+    Vector direction;  // unit
+    Scalar distance;   // to the point on the light
+    Scalar pdf;        // of the direction, per unit solid angle
+};
+
+static const uint32_t NO_TEXTURE = UINT32_MAX;
+static const uint32_t NO_PRIMITIVE = UINT32_MAX;
+
+// Two-colour pattern projected onto a plane (Checkerboard, Stripe)
+struct TextureRecord {
+    TextureType type;
+    Vector color1, color2;
+    Vector normal;
+    Scalar d, size;
+};
+
+struct MaterialRecord {
+    Material type;
+    Vector color, emit;  // base colour (also drives Russian roulette) and emission
+    uint32_t texture;    // NO_TEXTURE for a solid colour
+};
+
+struct PrimitiveRecord {
+    PrimitiveType type;
+    uint32_t index;     // into the array of its type: a pack slot, `meshes` or `others`
+    uint32_t material;  // into `materials`
+};
+
+struct CompiledScene {
+    // Primitive ids: the planes first, then the other unbounded shapes, then
+    // one per BVH slot starting at `boundedBase`
+    std::vector<PrimitiveRecord> primitives;
+    std::vector<MaterialRecord> materials;
+    std::vector<TextureRecord> textures;
+
+    PlanePack planes;   // unbounded planes, tested for every ray
+    std::vector<uint32_t> otherUnbounded;
+    BVH bvh;
+    uint32_t boundedBase = 0;
+    // Spheres and cubes are stored in BVH leaf order, so a leaf's slots can be
+    // handed to a SIMD kernel as one contiguous range
+    SpherePack spheres;
+    BoxPack boxes;
+    std::vector<PrimitiveType> slotTypes;  // BVH slot -> type, for the leaf loop
+    std::vector<TriangleMesh *> meshes;
+    std::vector<Shape *> others;
+
+    std::vector<uint32_t> emitters;  // emissive primitives, in scene order
+    LightTable lights;  // the emitters with a finite area, for next event estimation
+
+    std::vector<std::unique_ptr<TriangleMesh>> ownedMeshes;  // meshes made by loading a scene cache
+
+    // An empty scene, to be filled from a scene cache (loadSceneCache)
+    CompiledScene() {}
+
+    CompiledScene(const std::vector<Shape *> &scene) {
+        std::vector<uint32_t> idOfShape(scene.size(), NO_PRIMITIVE);
+        std::vector<uint32_t> boundedShapes;
+        std::vector<AABB> bounds;
+        for (uint32_t i = 0; i < scene.size(); ++i) {
+            AABB box;
+            if (scene[i]->getBounds(box)) {
+                boundedShapes.push_back(i);
+                bounds.push_back(box);
+            }
+        }
+        bvh.build(bounds, SIMD_WIDTH);
+
+        for (uint32_t i = 0; i < scene.size(); ++i) {
+            if (const Plane *plane = dynamic_cast<const Plane *>(scene[i])) {
+                idOfShape[i] = add(scene[i], PRIM_PLANE, planes.nx.size());
+                planes.add(plane);
+            }
+        }
+        planes.pad();
+        for (uint32_t i = 0; i < scene.size(); ++i) {
+            AABB box;
+            if (idOfShape[i] == NO_PRIMITIVE && !scene[i]->getBounds(box)) {
+                idOfShape[i] = add(scene[i], PRIM_OTHER, others.size());
+                otherUnbounded.push_back(idOfShape[i]);
+                others.push_back(scene[i]);
+            }
+        }
+
+        boundedBase = primitives.size();
+        for (uint32_t index : bvh.indices) {
+            uint32_t shape = boundedShapes[index];
+            Shape *obj = scene[shape];
+            const Sphere *sphere = dynamic_cast<const Sphere *>(obj);
+            const Cube *cube = dynamic_cast<const Cube *>(obj);
+            TriangleMesh *mesh = dynamic_cast<TriangleMesh *>(obj);
+            uint32_t slot = spheres.cx.size();
+            spheres.add(sphere);
+            boxes.add(cube);
+            if (sphere) {
+                idOfShape[shape] = add(obj, PRIM_SPHERE, slot);
+            } else if (cube) {
+                idOfShape[shape] = add(obj, PRIM_BOX, slot);
+            } else if (mesh) {
+                idOfShape[shape] = add(obj, PRIM_MESH, meshes.size());
+                meshes.push_back(mesh);
+            } else {
+                idOfShape[shape] = add(obj, PRIM_OTHER, others.size());
+                others.push_back(obj);
+            }
+            slotTypes.push_back(primitives.back().type);
+        }
+        spheres.pad();
+        boxes.pad();
+
+        for (uint32_t i = 0; i < scene.size(); ++i) {
+            if (scene[i]->emit.max() > 0) emitters.push_back(idOfShape[i]);
+        }
+        std::vector<double> power;
+        for (uint32_t id : emitters) {
+            const Vector &emit = material(id).emit;
+            power.push_back((emit.x + emit.y + emit.z) / 3 * area(id));
+        }
+        lights.build(emitters, power, primitives.size());
+    }
+
+    // Calls f on every array of the scene, always in the same order: what a
+    // scene cache stores besides the meshes and a few counts
+    template <typename F>
+    void forEachArray(F &&f) {
+        f(primitives);
+        f(materials);
+        f(textures);
+        f(planes.nx); f(planes.ny); f(planes.nz); f(planes.d);
+        f(bvh.nodes);
+        f(bvh.indices);
+        f(spheres.cx); f(spheres.cy); f(spheres.cz); f(spheres.r2); f(spheres.r);
+        for (std::vector<Scalar> *v : boxes.arrays()) f(*v);
+        f(slotTypes);
+        f(emitters);
+        f(lights.lights);
+        f(lights.select.prob); f(lights.select.alias); f(lights.select.pmf); f(lights.pmfOfPrimitive);
+    }
+
+    // True when the arrays of a scene read from a cache, which will have
+    // `meshCount` meshes, agree with each other: the sizes are those the
+    // constructor makes, and every index points into the array it indexes,
+    // so that a damaged cache cannot make a render read out of bounds.
+    // Caches hold no shapes of other types (see saveSceneCache).
+    bool consistent(size_t meshCount) const {
+        size_t slots = slotTypes.size(), lightCount = lights.lights.size();
+        if (boundedBase > primitives.size() || primitives.size() - boundedBase != slots || !otherUnbounded.empty()) return false;
+        for (const std::vector<Scalar> *v : {&planes.nx, &planes.ny, &planes.nz, &planes.d}) {
+            if (v->size() != boundedBase + SIMD_WIDTH - 1) return false;
+        }
+        for (const std::vector<Scalar> *v : {&spheres.cx, &spheres.cy, &spheres.cz, &spheres.r2, &spheres.r}) {
+            if (v->size() != slots + SIMD_WIDTH - 1) return false;
+        }
+        for (std::vector<Scalar> *v : const_cast<BoxPack &>(boxes).arrays()) {
+            if (v->size() != slots + SIMD_WIDTH - 1) return false;
+        }
+        for (uint32_t id = 0; id < primitives.size(); ++id) {
+            const PrimitiveRecord &prim = primitives[id];
+            if (prim.material >= materials.size()) return false;
+            if (id < boundedBase) {
+                if (prim.type != PRIM_PLANE || prim.index != id) return false;
+            } else if (prim.type != slotTypes[id - boundedBase]) {
+                return false;
+            } else if (prim.type == PRIM_MESH ? prim.index >= meshCount
+                                              : prim.type > PRIM_BOX || prim.index != id - boundedBase) {
+                return false;
+            }
+        }
+        for (const MaterialRecord &m : materials) {
+            if (unsigned(m.type) > GLASS || (m.texture != NO_TEXTURE && m.texture >= textures.size())) return false;
+        }
+        for (const TextureRecord &t : textures) {
+            if (t.type > TEXTURE_STRIPE) return false;
+        }
+        if (bvh.nodes.size() > UINT32_MAX || !validBVH(bvh.nodes.data(), bvh.nodes.size(), slots)) return false;
+        for (uint32_t index : bvh.indices) {
+            if (index >= slots) return false;
+        }
+        for (uint32_t id : emitters) {
+            if (id >= primitives.size()) return false;
+        }
+        for (uint32_t id : lights.lights) {
+            if (id >= primitives.size()) return false;
+        }
+        const AliasTable &select = lights.select;
+        if (select.prob.size() != lightCount || select.alias.size() != lightCount || select.pmf.size() != lightCount) return false;
+        for (uint32_t i : select.alias) {
+            if (i >= lightCount) return false;
+        }
+        return lights.pmfOfPrimitive.size() == primitives.size();
+    }
+
+    size_t unboundedCount() const { return boundedBase; }
+    size_t planeCount() const { return boundedBase - otherUnbounded.size(); }
+
+    const MaterialRecord &material(uint32_t id) const { return materials[primitives[id].material]; }
+
+    // The material branches a render of this scene needs; emitters end a
+    // path whatever their material, so only the other surfaces count
+    MaterialSet materialSet() const {
+        for (const MaterialRecord &m : materials) {
+            if (m.type != DIFFUSE && !(m.emit.max() > 0)) return ALL_MATERIALS;
+        }
+        return DIFFUSE_ONLY;
+    }
+
+    // Surface area; 0 when it is not known (planes, shapes of other types)
+    double area(uint32_t id) const {
+        const PrimitiveRecord &prim = primitives[id];
+        size_t i = prim.index;
+        switch (prim.type) {
+        case PRIM_SPHERE:
+            return 4 * M_PI * spheres.r[i] * spheres.r[i];
+        case PRIM_BOX: {
+            double x = boxes.maxx[i] - boxes.minx[i], y = boxes.maxy[i] - boxes.miny[i], z = boxes.maxz[i] - boxes.minz[i];
+            return 2 * (x * y + y * z + z * x);
+        }
+        case PRIM_MESH:
+            return meshes[i]->area();
+        default:
+            return 0;
+        }
+    }
+
+    // Shape::getColor
+    Vector color(const MaterialRecord &m, const Vector &p) const {
+        if (m.texture == NO_TEXTURE) return m.color;
+        const TextureRecord &tex = textures[m.texture];
+        Vector localP = p - tex.normal * (p.dot(tex.normal) + tex.d);  // Project p onto the plane
+        const Vector &n = tex.normal;
+        int x, y;
+        // Determine the dominant axis of the normal vector
+        if (std::fabs(n.x) > std::fabs(n.y) && std::fabs(n.x) > std::fabs(n.z)) {
+            x = floor(localP.y / tex.size);  // Plane is yz
+            y = floor(localP.z / tex.size);
+        } else if (std::fabs(n.y) > std::fabs(n.x) && std::fabs(n.y) > std::fabs(n.z)) {
+            x = floor(localP.x / tex.size);  // Plane is xz
+            y = floor(localP.z / tex.size);
+        } else {
+            x = floor(localP.x / tex.size);  // Plane is xy
+            y = floor(localP.y / tex.size);
+        }
+        int cell = tex.type == TEXTURE_CHECKER ? x + y : x;  // stripes only vary along the first axis
+        return cell % 2 == 0 ? tex.color1 : tex.color2;
+    }
+
+    // Shape::getPrimitiveNormal; `sub` is the triangle of a mesh hit
+    Vector normal(uint32_t id, const Vector &p, uint32_t sub) const {
+        const PrimitiveRecord &prim = primitives[id];
+        switch (prim.type) {
+        case PRIM_SPHERE:
+            return (p - spheres.center(prim.index)) / spheres.r[prim.index];
+        case PRIM_BOX: {
+            size_t i = prim.index;
+            Vector lo(boxes.minx[i], boxes.miny[i], boxes.minz[i]), hi(boxes.maxx[i], boxes.maxy[i], boxes.maxz[i]);
+            return boxes.unrotate(i, boxFaceNormal(boxes.rotatePoint(i, p), lo, hi));
+        }
+        case PRIM_PLANE:
+            return planes.normal(prim.index);
+        case PRIM_MESH:
+            return meshes[prim.index]->getPrimitiveNormal(p, sub);
+        default:
+            return others[prim.index]->getPrimitiveNormal(p, sub);
+        }
+    }
+
+    // A direction from `p` toward light `id` (see LightSample), drawn with
+    // the light's own sampling dimensions. Spheres are sampled uniformly in
+    // the cone they subtend, so every direction hits the sphere; boxes
+    // uniformly over the area of the faces that face `p`; meshes uniformly
+    // over their triangles and then within the triangle. Returns false when
+    // `p` is inside the light or the light is of a type that cannot be sampled.
+    bool sampleLight(uint32_t id, const Vector &p, Sampler &sampler, LightSample &s) const {
+        const PrimitiveRecord &prim = primitives[id];
+        size_t i = prim.index;
+        switch (prim.type) {
+        case PRIM_SPHERE: {
+            Scalar oneMinusCosMax;
+            Vector axis;
+            Scalar d;
+            if (!sphereCone(i, p, axis, d, oneMinusCosMax)) return false;
+            // cos theta = 1 - u (1 - cos theta_max); sin^2 theta from the same
+            // difference, which stays exact for the narrow cones of far lights
+            Scalar oneMinusCos = Scalar(sampler.get1D()) * oneMinusCosMax;
+            Scalar cosTheta = 1 - oneMinusCos, sin2Theta = oneMinusCos * (2 - oneMinusCos);
+            Scalar phi = 2 * M_PI * sampler.get1D(), sinTheta = std::sqrt(std::max<Scalar>(0, sin2Theta));
+            Vector u, v;
+            tangentFrame(axis, u, v);
+            s.direction = (u * (std::cos(phi) * sinTheta) + v * (std::sin(phi) * sinTheta) + axis * cosTheta).normalize();
+            // The near intersection with the sphere
+            Scalar r = spheres.r[i];
+            s.distance = d * cosTheta - std::sqrt(std::max<Scalar>(0, r * r - d * d * sin2Theta));
+            s.pdf = 1 / (2 * M_PI * oneMinusCosMax);
+            return true;
+        }
+        case PRIM_BOX: {
+            Scalar faceArea[6];
+            Scalar total = visibleBoxFaces(i, p, faceArea);
+            if (!(total > 0)) return false;
+            // The point on the face first, for a 2D pair of sampling dimensions, then the face
+            Scalar u = sampler.get1D(), v = sampler.get1D();
+            Scalar pick = sampler.get1D() * total;
+            int face = -1;
+            for (int f = 0; f < 6; ++f) {
+                if (!(faceArea[f] > 0)) continue;
+                face = f;
+                if (pick < faceArea[f]) break;
+                pick -= faceArea[f];
+            }
+            // The face in the box frame: axis face / 2, at its min or max side
+            Scalar lo[3] = {boxes.minx[i], boxes.miny[i], boxes.minz[i]}, hi[3] = {boxes.maxx[i], boxes.maxy[i], boxes.maxz[i]};
+            int a = face / 2, b = (a + 1) % 3, c = (a + 2) % 3;
+            Scalar local[3];
+            local[a] = face % 2 ? hi[a] : lo[a];
+            local[b] = lo[b] + u * (hi[b] - lo[b]);
+            local[c] = lo[c] + v * (hi[c] - lo[c]);
+            Vector n;
+            (a == 0 ? n.x : a == 1 ? n.y : n.z) = face % 2 ? 1 : -1;
+            Vector centre(boxes.cx[i], boxes.cy[i], boxes.cz[i]);
+            Vector q = boxes.unrotate(i, Vector(local[0], local[1], local[2]) - centre) + centre;
+            return toPoint(p, q, boxes.unrotate(i, n), 1 / total, s);
+        }
+        case PRIM_MESH: {
+            const TriangleMesh *mesh = meshes[i];
+            uint32_t tri;
+            Vector q = mesh->randomPoint(sampler, tri);
+            return toPoint(p, q, mesh->getPrimitiveNormal(q, tri), 1 / (mesh->triangleCount * mesh->triangleArea(tri)), s);
+        }
+        default:
+            return false;
+        }
+    }
+
+    // The density per unit solid angle with which sampleLight(id, p) draws
+    // `direction`, which hits the light at `distance` (on triangle `sub` of a mesh)
+    Scalar lightPdf(uint32_t id, const Vector &p, const Vector &direction, Scalar distance, uint32_t sub) const {
+        const PrimitiveRecord &prim = primitives[id];
+        size_t i = prim.index;
+        switch (prim.type) {
+        case PRIM_SPHERE: {
+            Scalar oneMinusCosMax, d;
+            Vector axis;
+            if (!sphereCone(i, p, axis, d, oneMinusCosMax)) return 0;
+            return 1 / (2 * M_PI * oneMinusCosMax);
+        }
+        case PRIM_BOX: {
+            Scalar faceArea[6];
+            Scalar total = visibleBoxFaces(i, p, faceArea);
+            if (!(total > 0)) return 0;
+            Vector q = p + direction * distance;
+            return areaToSolidAngle(1 / total, direction, distance, normal(id, q, sub));
+        }
+        case PRIM_MESH: {
+            const TriangleMesh *mesh = meshes[i];
+            Vector q = p + direction * distance;
+            return areaToSolidAngle(1 / (mesh->triangleCount * mesh->triangleArea(sub)), direction, distance,
+                                    mesh->getPrimitiveNormal(q, sub));
+        }
+        default:
+            return 0;
+        }
+    }
+
+private:
+    // The cone of directions from `p` that hit sphere slot `i`: its unit
+    // axis, the distance to the centre and 1 - cos of its half-angle.
+    // False when `p` is inside the sphere.
+    bool sphereCone(size_t i, const Vector &p, Vector &axis, Scalar &d, Scalar &oneMinusCosMax) const {
+        Vector toCentre = spheres.center(i) - p;
+        Scalar d2 = toCentre.dot(toCentre), r2 = spheres.r2[i];
+        if (!(d2 > r2)) return false;
+        d = std::sqrt(d2);
+        axis = toCentre / d;
+        Scalar sin2Max = r2 / d2, cosMax = std::sqrt(1 - sin2Max);
+        oneMinusCosMax = sin2Max / (1 + cosMax);  // without the cancellation of 1 - cosMax
+        return oneMinusCosMax > 0;
+    }
+
+    // The areas of box slot `i`'s faces that face `p`, 0 for the others, in
+    // the order -x, +x, -y, +y, -z, +z of the box frame; returns their sum
+    Scalar visibleBoxFaces(size_t i, const Vector &p, Scalar faceArea[6]) const {
+        Vector local = boxes.rotatePoint(i, p);
+        Scalar pc[3] = {local.x, local.y, local.z};
+        Scalar lo[3] = {boxes.minx[i], boxes.miny[i], boxes.minz[i]}, hi[3] = {boxes.maxx[i], boxes.maxy[i], boxes.maxz[i]};
+        Scalar total = 0;
+        for (int a = 0; a < 3; ++a) {
+            Scalar area = (hi[(a + 1) % 3] - lo[(a + 1) % 3]) * (hi[(a + 2) % 3] - lo[(a + 2) % 3]);
+            faceArea[2 * a] = pc[a] < lo[a] ? area : 0;
+            faceArea[2 * a + 1] = pc[a] > hi[a] ? area : 0;
+            total += faceArea[2 * a] + faceArea[2 * a + 1];
+        }
+        return total;
+    }
+
+    // An area density at a point `distance` along `direction`, whose surface has normal `n`, per unit solid angle
+    static Scalar areaToSolidAngle(Scalar areaPdf, const Vector &direction, Scalar distance, const Vector &n) {
+        Scalar cosine = std::fabs(direction.dot(n));
+        return cosine > 0 ? areaPdf * distance * distance / cosine : 0;
+    }
+
+    // Fills `s` for the point `q` on a light, drawn with density `areaPdf` per unit area
+    static bool toPoint(const Vector &p, const Vector &q, const Vector &n, Scalar areaPdf, LightSample &s) {
+        Vector toLight = q - p;
+        s.distance = std::sqrt(toLight.dot(toLight));
+        if (!(s.distance > 0)) return false;
+        s.direction = toLight / s.distance;
+        s.pdf = areaToSolidAngle(areaPdf, s.direction, s.distance, n);
+        return s.pdf > 0;
+    }
+
+    uint32_t add(const Shape *obj, PrimitiveType type, uint32_t index) {
+        MaterialRecord m = {obj->material, obj->color, obj->emit, NO_TEXTURE};
+        if (const Checkerboard *c = dynamic_cast<const Checkerboard *>(obj)) {
+            m.texture = textures.size();
+            textures.push_back({TEXTURE_CHECKER, c->color1, c->color2, c->normal, c->d, c->size});
+        } else if (const Stripe *s = dynamic_cast<const Stripe *>(obj)) {
+            m.texture = textures.size();
+            textures.push_back({TEXTURE_STRIPE, s->color1, s->color2, s->normal, s->d, s->size});
+        }
+        primitives.push_back({type, index, uint32_t(materials.size())});
+        materials.push_back(m);
+        return primitives.size() - 1;
+    }
+};
+
+#endif // SCENE_H
@@ -0,0 +1,345 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <type_traits>
+#include "vector.h"
+#include "shapes.h"
+#include "mesh.h"
+#include "transform.h"
+#include "scene.h"
+#include "camera.h"
+#include "mappedfile.h"
+
+// Text scene description, one statement per line, `#` starts a comment:
+//
+//   camera <x y z> <direction x y z> <aperture>
+//   material <name> diffuse|mirror|glass <r g b> [emit <r g b>]
+//   material <name> diffuse|mirror|glass checker|stripe <r g b> <r g b> <size> [emit <r g b>]
+//   sphere <center x y z> <radius> <material>
+//   cube <min x y z> <max x y z> <material> [rotate <degrees about y>]
+//   plane <normal x y z> <d> <material>
+//   mesh <file> <material>
+//   object <name> sphere <center x y z> <radius>
+//   object <name> cube <min x y z> <max x y z>
+//   object <name> mesh <file>
+//   instance <object> <material> [translate <x y z> | rotate <axis x y z> <degrees> | scale <x y z>]...
+//
+// Materials and objects are defined before they are used; patterned
+// materials only go on planes. An object is geometry without a place in
+// the scene: each instance of it adds a copy, transformed by the steps
+// given in order, that shares the object's geometry. Mesh paths are
+// relative to the scene file.
+inline bool parseSceneFile(const std::string &path, SceneCamera &camera, std::vector<Shape *> &shapes, std::string &error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+    struct SceneMaterial {
+        Material type;
+        Vector color, emit;
+        int pattern;  // -1 for a solid colour, else 0 for checker and 1 for stripe
+        Vector color1, color2;
+        double size;
+    };
+    std::map<std::string, SceneMaterial> materials;
+    std::map<std::string, std::shared_ptr<const Shape>> objects;
+    std::string directory = path.find('/') == std::string::npos ? "" : path.substr(0, path.rfind('/') + 1);
+
+    std::string text;
+    int lineNumber = 0;
+    auto fail = [&](const std::string &message) {
+        error = path + ":" + std::to_string(lineNumber) + ": " + message;
+        return false;
+    };
+    auto readVector = [](std::istream &s, Vector &v) { return bool(s >> v.x >> v.y >> v.z); };
+    while (std::getline(in, text)) {
+        ++lineNumber;
+        std::istringstream line(text.substr(0, text.find('#')));
+        std::string keyword, name;
+        if (!(line >> keyword)) continue;
+
+        const SceneMaterial *material = nullptr;
+        auto readMaterial = [&]() {
+            if (!(line >> name)) return fail("expected a material after the " + keyword);
+            auto it = materials.find(name);
+            if (it == materials.end()) return fail("unknown material '" + name + "'");
+            material = &it->second;
+            return true;
+        };
+        if (keyword == "camera") {
+            if (!readVector(line, camera.position) || !readVector(line, camera.direction) || !(line >> camera.aperture)) {
+                return fail("expected camera <x y z> <direction x y z> <aperture>");
+            }
+            if (!(camera.direction.dot(camera.direction) > 0)) return fail("the camera direction must not be zero");
+        } else if (keyword == "material") {
+            SceneMaterial m = {DIFFUSE, Vector(), Vector(), -1, Vector(), Vector(), 0};
+            std::string type, word;
+            if (!(line >> name >> type)) return fail("expected material <name> <type> ...");
+            if (type == "diffuse") m.type = DIFFUSE;
+            else if (type == "mirror") m.type = MIRROR;
+            else if (type == "glass") m.type = GLASS;
+            else return fail("unknown material type '" + type + "', expected diffuse, mirror or glass");
+            std::streampos colorStart = line.tellg();
+            if (line >> word && (word == "checker" || word == "stripe")) {
+                m.pattern = word == "checker" ? 0 : 1;
+                if (!readVector(line, m.color1) || !readVector(line, m.color2) || !(line >> m.size)) {
+                    return fail("expected " + word + " <r g b> <r g b> <size>");
+                }
+            } else {
+                line.clear();
+                line.seekg(colorStart);
+                if (!readVector(line, m.color)) return fail("expected the colour <r g b> of " + name);
+            }
+            if (line >> word) {
+                if (word != "emit" || !readVector(line, m.emit)) return fail("expected emit <r g b> after the colour");
+            }
+            materials[name] = m;
+        } else if (keyword == "sphere") {
+            Vector center;
+            double radius;
+            if (!readVector(line, center) || !(line >> radius)) return fail("expected sphere <x y z> <radius> <material>");
+            if (!readMaterial()) return false;
+            if (material->pattern >= 0) return fail("patterned materials only go on planes");
+            shapes.push_back(new Sphere(center, radius, material->color, material->emit, material->type));
+        } else if (keyword == "cube") {
+            Vector lo, hi;
+            if (!readVector(line, lo) || !readVector(line, hi)) return fail("expected cube <min x y z> <max x y z> <material>");
+            if (!readMaterial()) return false;
+            if (material->pattern >= 0) return fail("patterned materials only go on planes");
+            std::string word;
+            double degrees = 0;
+            if (line >> word && (word != "rotate" || !(line >> degrees))) return fail("expected rotate <degrees>");
+            shapes.push_back(new Cube(lo, hi, material->color, material->emit, material->type, degrees * M_PI / 180));
+        } else if (keyword == "plane") {
+            Vector normal;
+            double d;
+            if (!readVector(line, normal) || !(line >> d)) return fail("expected plane <normal x y z> <d> <material>");
+            if (!readMaterial()) return false;
+            const SceneMaterial &m = *material;
+            if (m.pattern == 0) {
+                shapes.push_back(new Checkerboard(normal, d, m.color1, m.color2, m.size, m.emit, m.type));
+            } else if (m.pattern == 1) {
+                shapes.push_back(new Stripe(normal, d, m.color1, m.color2, m.size, m.emit, m.type));
+            } else {
+                shapes.push_back(new Plane(normal, d, m.color, m.emit, m.type));
+            }
+        } else if (keyword == "mesh") {
+            std::string file;
+            if (!(line >> file)) return fail("expected mesh <file> <material>");
+            if (!readMaterial()) return false;
+            if (material->pattern >= 0) return fail("patterned materials only go on planes");
+            if (file[0] != '/') file = directory + file;
+            TriangleMesh *mesh = TriangleMesh::load(file, material->color, material->emit, material->type);
+            if (!mesh) return fail("could not load mesh " + file);
+            shapes.push_back(mesh);
+        } else if (keyword == "object") {
+            std::string type;
+            if (!(line >> name >> type)) return fail("expected object <name> sphere|cube|mesh ...");
+            if (type == "sphere") {
+                Vector center;
+                double radius;
+                if (!readVector(line, center) || !(line >> radius)) return fail("expected object <name> sphere <x y z> <radius>");
+                objects[name] = std::make_shared<Sphere>(center, radius, Vector(), Vector(), DIFFUSE);
+            } else if (type == "cube") {
+                Vector lo, hi;
+                if (!readVector(line, lo) || !readVector(line, hi)) return fail("expected object <name> cube <min x y z> <max x y z>");
+                objects[name] = std::make_shared<Cube>(lo, hi, Vector(), Vector(), DIFFUSE, 0);
+            } else if (type == "mesh") {
+                std::string file;
+                if (!(line >> file)) return fail("expected object <name> mesh <file>");
+                if (file[0] != '/') file = directory + file;
+                TriangleMesh *mesh = TriangleMesh::load(file, Vector(), Vector(), DIFFUSE);
+                if (!mesh) return fail("could not load mesh " + file);
+                objects[name] = std::shared_ptr<const Shape>(mesh);
+            } else {
+                return fail("unknown object type '" + type + "', expected sphere, cube or mesh");
+            }
+        } else if (keyword == "instance") {
+            std::string object;
+            if (!(line >> object)) return fail("expected instance <object> <material> ...");
+            auto it = objects.find(object);
+            if (it == objects.end()) return fail("unknown object '" + object + "'");
+            if (!readMaterial()) return false;
+            if (material->pattern >= 0) return fail("patterned materials only go on planes");
+            Transform transform;
+            std::string step;
+            while (line >> step) {
+                Vector v;
+                double degrees;
+                if (step == "translate" && readVector(line, v)) {
+                    transform = transform.then(Transform::translate(v));
+                } else if (step == "rotate" && readVector(line, v) && line >> degrees && v.dot(v) > 0) {
+                    transform = transform.then(Transform::rotate(v, degrees * M_PI / 180));
+                } else if (step == "scale" && readVector(line, v) && v.x != 0 && v.y != 0 && v.z != 0) {
+                    transform = transform.then(Transform::scale(v));
+                } else {
+                    return fail("expected translate <x y z>, rotate <axis x y z> <degrees> or scale <x y z> with no zero factor");
+                }
+            }
+            shapes.push_back(new Instance(it->second, transform, material->color, material->emit, material->type));
+        } else {
+            return fail("unknown statement '" + keyword + "'");
+        }
+        std::string rest;
+        if (line >> rest) return fail("unexpected '" + rest + "'");
+    }
+    return true;
+}
+
+// Compiled scene cache: the flattened scene (CompiledScene::forEachArray),
+// its BVH and light table, and every mesh in the binary mesh format, so a
+// repeat render skips parsing and all BVH builds. The arrays are copied out
+// of the mapping, which is cheap next to building them; the meshes, which
+// hold the bulk of a large scene, render straight from it.
+struct SceneCacheHeader {
+    char magic[8];
+    uint32_t version, arrays, meshes, boundedBase;
+    uint32_t scalarSize;  // sizeof(Scalar) of the build that wrote it; the packs are stored in that precision
+    SceneCamera camera;
+    BVHBuildStats bvhStats;
+    uint64_t tableOffset;  // `arrays` entries, then `meshes` entries
+};
+
+struct SceneCacheEntry {
+    uint64_t offset, count, elementSize;  // a mesh is one element of its file size
+};
+
+static const uint32_t SCENE_CACHE_VERSION = 3;
+
+inline bool isSceneCache(const std::string &path) {
+    char magic[8] = {};
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, "MLSCENE", 8) == 0;
+    fclose(f);
+    return ok;
+}
+
+inline bool saveSceneCache(const std::string &path, CompiledScene &scene, const SceneCamera &camera, std::string &error) {
+    if (!scene.others.empty()) {
+        error = "the scene has shapes that a cache cannot hold";
+        return false;
+    }
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        error = "cannot write " + path;
+        return false;
+    }
+    auto align = [](uint64_t offset) { return (offset + 63) & ~uint64_t(63); };
+    auto writeAt = [&](uint64_t offset, const void *data, size_t bytes) {
+        return fseek(f, offset, SEEK_SET) == 0 && fwrite(data, 1, bytes, f) == bytes;
+    };
+    std::vector<SceneCacheEntry> table;
+    scene.forEachArray([&](const auto &v) { table.push_back({0, v.size(), sizeof(v[0])}); });
+    size_t arrays = table.size();
+    for (const TriangleMesh *mesh : scene.meshes) table.push_back({0, 1, mesh->fileSize()});
+
+    SceneCacheHeader header = {{'M', 'L', 'S', 'C', 'E', 'N', 'E', 0}, SCENE_CACHE_VERSION, uint32_t(arrays),
+                               uint32_t(scene.meshes.size()), scene.boundedBase, uint32_t(sizeof(Scalar)), camera,
+                               scene.bvh.buildStats, sizeof(SceneCacheHeader)};
+    uint64_t end = header.tableOffset + table.size() * sizeof(SceneCacheEntry);
+    for (SceneCacheEntry &entry : table) {
+        entry.offset = align(end);
+        end = entry.offset + entry.count * entry.elementSize;
+    }
+    bool ok = writeAt(0, &header, sizeof(header)) && writeAt(header.tableOffset, table.data(), table.size() * sizeof(SceneCacheEntry));
+    size_t i = 0;
+    scene.forEachArray([&](const auto &v) {
+        ok = ok && writeAt(table[i].offset, v.data(), v.size() * sizeof(v[0]));
+        ++i;
+    });
+    for (const TriangleMesh *mesh : scene.meshes) ok = ok && mesh->write(f, table[i++].offset);
+    ok = fclose(f) == 0 && ok;
+    if (!ok) error = "cannot write " + path;
+    return ok;
+}
+
+// Maps a cache written by saveSceneCache(); null (and `error`) if it is not one
+inline std::shared_ptr<CompiledScene> loadSceneCache(const std::string &path, SceneCamera &camera, std::string &error) {
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    const SceneCacheHeader *header = nullptr;
+    if (!file->open(path)) {
+        error = "cannot open " + path;
+        return nullptr;
+    }
+    if (file->size >= sizeof(SceneCacheHeader)) header = reinterpret_cast<const SceneCacheHeader *>(file->data);
+    if (!header || memcmp(header->magic, "MLSCENE", 8) != 0 || header->version != SCENE_CACHE_VERSION) {
+        error = path + " is not a scene cache of this version";
+        return nullptr;
+    }
+    if (header->scalarSize != sizeof(Scalar)) {
+        error = path + " was compiled by a build of another RENDER_PRECISION";
+        return nullptr;
+    }
+    uint64_t entries = uint64_t(header->arrays) + header->meshes;
+    if (header->tableOffset % alignof(SceneCacheEntry) != 0 || header->tableOffset > file->size
+        || entries > (file->size - header->tableOffset) / sizeof(SceneCacheEntry)) {
+        error = path + " is damaged";
+        return nullptr;
+    }
+    const SceneCacheEntry *table = reinterpret_cast<const SceneCacheEntry *>(file->data + header->tableOffset);
+    // An entry lies within the file, in whole elements of `size` bytes, 64-byte aligned as saveSceneCache() puts it
+    auto fits = [&](const SceneCacheEntry &entry, uint64_t size) {
+        return entry.elementSize == size && entry.offset % 64 == 0 && entry.offset <= file->size
+            && entry.count <= (file->size - entry.offset) / size;
+    };
+
+    std::shared_ptr<CompiledScene> scene = std::make_shared<CompiledScene>();
+    size_t i = 0;
+    bool ok = true;
+    scene->forEachArray([&](auto &v) {
+        typedef typename std::decay<decltype(v[0])>::type T;
+        ok = ok && i < header->arrays && fits(table[i], sizeof(T));
+        if (ok) {
+            const T *data = reinterpret_cast<const T *>(file->data + table[i].offset);
+            v.assign(data, data + table[i].count);
+        }
+        ++i;
+    });
+    ok = ok && i == header->arrays;
+    scene->boundedBase = header->boundedBase;
+    scene->bvh.buildStats = header->bvhStats;
+    scene->bvh.buildStats.buildMs = 0;  // nothing was built
+    // The arrays are indexed as they are while rendering, so check them all now
+    ok = ok && scene->consistent(header->meshes);
+
+    // A mesh takes the material of the primitive that refers to it
+    std::vector<uint32_t> meshMaterial(header->meshes, NO_PRIMITIVE);
+    for (const PrimitiveRecord &prim : scene->primitives) {
+        if (prim.type == PRIM_MESH && prim.index < meshMaterial.size()) meshMaterial[prim.index] = prim.material;
+    }
+    for (uint32_t m = 0; ok && m < header->meshes; ++m) {
+        const SceneCacheEntry &entry = table[header->arrays + m];
+        ok = entry.count == 1 && meshMaterial[m] < scene->materials.size();
+        if (!ok) break;
+        const MaterialRecord &material = scene->materials[meshMaterial[m]];
+        TriangleMesh *mesh = TriangleMesh::fromMapping(file, entry.offset, material.color, material.emit, material.type);
+        ok = mesh != nullptr;
+        if (ok) {
+            scene->ownedMeshes.emplace_back(mesh);
+            scene->meshes.push_back(mesh);
+        }
+    }
+    for (uint32_t id : scene->lights.lights) {
+        const PrimitiveRecord &prim = scene->primitives[id];
+        ok = ok && (prim.type != PRIM_MESH || scene->meshes[prim.index]->triangleCount > 0);  // sampleLight picks a triangle
+    }
+    if (!ok) {
+        error = path + " is damaged";
+        return nullptr;
+    }
+    camera = header->camera;
+    return scene;
+}
+
+#endif // SCENEFILE_H
@@ -0,0 +1,111 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include "image.h"
+#include "threadpool.h"
+
+// Adaptive sampling by tile. The first round takes `minSpp` samples in every
+// pixel. After that, every round estimates the relative error of each
+// unfinished tile, drops the tiles that have met the target, and spends up
+// to as many samples again as have been taken so far on the rest. Samples
+// go to tiles in proportion to their per-sample deviation (error times the
+// square root of the sample count), which minimises the summed squared
+// error; a tile never gets more than it needs to reach the target, nor more
+// than doubles its count in one round. Finished tiles cost nothing any
+// more. Rendering stops once every tile meets the target or the budget
+// (maxSpp samples per pixel on average) is spent.
+struct AdaptiveScheduler {
+    std::vector<Tile> tiles;
+    std::vector<unsigned int> spp;  // samples per pixel taken in each tile
+    std::vector<double> error;      // latest relative error of each tile
+    std::vector<uint32_t> active;   // tiles still above the target
+    double targetError;
+    unsigned int minSpp;
+    uint64_t budget, spent = 0;     // in pixel samples
+    unsigned int rounds = 0;
+
+    AdaptiveScheduler(const std::vector<Tile> &tiles_, unsigned int minSpp_, unsigned int maxSpp, double targetError_)
+        : tiles(tiles_), spp(tiles_.size(), 0), error(tiles_.size(), INFINITY), targetError(targetError_),
+          minSpp(std::max(1u, minSpp_)), budget(0) {
+        for (uint32_t t = 0; t < tiles.size(); ++t) {
+            active.push_back(t);
+            budget += uint64_t(tiles[t].pixels()) * std::max(maxSpp, minSpp);
+        }
+    }
+
+    // Root mean square over the tile of each pixel's standard error divided
+    // by its brightness; the small offset keeps dark pixels from dominating
+    static double tileError(const Image &img, const Tile &tile) {
+        double sum = 0;
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                size_t i = img.index(x, y);
+                unsigned int n = img.samples(i);
+                if (n < 2) return INFINITY;
+                Vector mean = img.mean(i);
+                double e = sqrt(img.variance(i) / n) / (sqrt(mean.dot(mean)) + 0.01);
+                sum += e * e;
+            }
+        }
+        return sqrt(sum / tile.pixels());
+    }
+
+    // Puts the next round of work in `jobs`; returns false when there is none left
+    bool nextRound(const Image &img, std::vector<Tile> &jobs) {
+        jobs.clear();
+        if (rounds++ == 0) {
+            for (uint32_t t : active) schedule(t, minSpp, jobs);
+            return true;
+        }
+
+        std::vector<uint32_t> unfinished;
+        for (uint32_t t : active) {
+            error[t] = tileError(img, tiles[t]);
+            if (error[t] > targetError) unfinished.push_back(t);
+        }
+        active.swap(unfinished);
+        std::sort(active.begin(), active.end(), [&](uint32_t a, uint32_t b) { return error[a] > error[b]; });
+
+        double taken = 0, weights = 0;
+        for (uint32_t t : active) {
+            taken += double(spp[t]) * tiles[t].pixels();
+            weights += deviation(t) * tiles[t].pixels();
+        }
+        double round = std::min<double>(budget - spent, spent);
+        for (uint32_t t : active) {
+            double share = (taken + round) * deviation(t) / weights - spp[t];
+            // The error falls with the square root of the sample count
+            double ratio = error[t] / targetError;
+            double needed = spp[t] * (ratio * ratio - 1);
+            double passes = ceil(std::min({share, needed, double(spp[t])}));
+            // Edge tiles are smaller, so one that cannot be afforded says nothing about the rest
+            uint64_t affordable = (budget - spent) / tiles[t].pixels();
+            if (affordable == 0) continue;
+            if (passes >= 1) schedule(t, std::min<uint64_t>(passes, affordable), jobs);
+        }
+        // Rounding can leave every share below one pass; the worst tile still gets one
+        if (jobs.empty() && !active.empty() && (budget - spent) >= tiles[active[0]].pixels()) schedule(active[0], 1, jobs);
+        return !jobs.empty();
+    }
+
+    size_t finishedTiles() const { return tiles.size() - active.size(); }
+
+private:
+    // Relative standard deviation of a single sample in the tile
+    double deviation(uint32_t t) const { return std::isfinite(error[t]) ? error[t] * sqrt(double(spp[t])) : 1; }
+
+    void schedule(uint32_t t, unsigned int passes, std::vector<Tile> &jobs) {
+        Tile job = tiles[t];
+        job.firstPass = spp[t];
+        job.passes = passes;
+        jobs.push_back(job);
+        spp[t] += passes;
+        spent += uint64_t(passes) * tiles[t].pixels();
+    }
+};
+
+#endif // SCHEDULER_H
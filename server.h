@@ -0,0 +1,539 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "vector.h"
+#include "image.h"
+#include "camera.h"
+#include "scene.h"
+#include "tracer.h"
+#include "sampler.h"
+#include "threadpool.h"
+#include "policy.h"
+
+// Render server. A long-running process listens on a Unix socket, keeps
+// every scene it has loaded (compiled, with its BVHs) resident, and renders
+// queued jobs one at a time on its thread pool, highest priority first. A
+// job costs no process start, scene parsing or BVH build after the first
+// one that uses its scene. Progressive results are streamed back while it
+// renders.
+//
+// The protocol is line-based. A client sends
+//   render [scene=<name>] [width=<w>] [height=<h>] [spp=<n>] [seed=<n>] [priority=<n>]
+//          [sampler=random|sobol|halton] [every=<n>] [position=<x,y,z>] [direction=<x,y,z>] [aperture=<a>]
+//   status
+//   shutdown
+// and the server answers a job with
+//   queued <job>
+//   image <job> <samples> <width> <height> <final>   followed by width * height * 3
+//                                                    little-endian floats, top row first
+//   done <job> <seconds waited> <seconds rendering>
+// or `error <job> <message>`; `status` with one `status ...` line and
+// `shutdown` with `ok`. A client may queue several jobs on one connection.
+// Its queued and running jobs are dropped when it disconnects, or when it
+// has taken nothing of a reply for ServerConnection::SEND_STALL_MS.
+//
+// The image of a job is the one `render <width> <height> false <spp>` gives
+// for the same scene, seed and sampler.
+
+// Socket reader with line and byte-count reads, for both ends
+struct SocketReader {
+    int fd;
+    std::string buffer;
+
+    explicit SocketReader(int fd_) : fd(fd_) {}
+
+    bool readLine(std::string &line) {
+        size_t end;
+        while ((end = buffer.find('\n')) == std::string::npos) {
+            if (!fill()) return false;
+        }
+        line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+        return true;
+    }
+
+    bool readBytes(void *out, size_t bytes) {
+        while (buffer.size() < bytes) {
+            if (!fill()) return false;
+        }
+        memcpy(out, buffer.data(), bytes);
+        buffer.erase(0, bytes);
+        return true;
+    }
+
+private:
+    bool fill() {
+        char chunk[65536];
+        ssize_t n;
+        do {
+            n = ::read(fd, chunk, sizeof(chunk));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
+        return true;
+    }
+};
+
+// Sends all of `data`; with a `stallMs` of 0 or more, fails once the
+// socket has taken nothing for that long
+inline bool sendAll(int fd, const void *data, size_t bytes, int stallMs = -1) {
+    const char *p = static_cast<const char *>(data);
+    while (bytes > 0) {
+        if (stallMs >= 0) {
+            pollfd writable = {fd, POLLOUT, 0};
+            int ready = poll(&writable, 1, stallMs);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return false;
+        }
+        ssize_t n = ::send(fd, p, bytes, MSG_NOSIGNAL | (stallMs >= 0 ? MSG_DONTWAIT : 0));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (n <= 0) return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+inline bool unixSocketAddress(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// A client of the server. Replies go out under `writeLock`, from the
+// connection's own thread and from the render thread; neither sends while
+// holding the server's lock, so a client that stops reading only holds up
+// its own replies, and the connection is closed once it has taken nothing
+// for SEND_STALL_MS.
+struct ServerConnection {
+    static const int SEND_STALL_MS = 30000;
+
+    int fd;
+    std::mutex writeLock;
+    std::atomic<bool> closed{false};
+
+    explicit ServerConnection(int fd_) : fd(fd_) {}
+    ~ServerConnection() { ::close(fd); }
+
+    bool send(const std::string &line, const void *data = nullptr, size_t bytes = 0) {
+        std::lock_guard<std::mutex> guard(writeLock);
+        return sendLocked(line, data, bytes);
+    }
+
+    // Sends `queued <job>` for a job the reader has just queued; the job's
+    // other replies wait for it in waitAnnounced()
+    void announce(uint64_t job) {
+        std::lock_guard<std::mutex> guard(writeLock);
+        sendLocked("queued " + std::to_string(job));
+        announced = job;
+        announcedChanged.notify_all();
+    }
+
+    // Returns once `queued <job>` has gone out, or the connection failed
+    // trying; job ids of a connection are announced in increasing order
+    void waitAnnounced(uint64_t job) {
+        std::unique_lock<std::mutex> guard(writeLock);
+        announcedChanged.wait(guard, [&] { return announced >= job; });
+    }
+
+private:
+    uint64_t announced = 0;  // under writeLock
+    std::condition_variable announcedChanged;
+
+    bool sendLocked(const std::string &line, const void *data = nullptr, size_t bytes = 0) {
+        if (closed) return false;
+        std::string text = line + "\n";
+        if (!sendAll(fd, text.data(), text.size(), SEND_STALL_MS) || (bytes && !sendAll(fd, data, bytes, SEND_STALL_MS))) {
+            closed = true;
+        }
+        return !closed;
+    }
+};
+
+struct RenderJob {
+    uint64_t id = 0;
+    std::string scene = "complex";
+    int width = 64, height = 64;
+    unsigned int spp = 16;
+    uint64_t seed = 26;
+    uint32_t sampler = SAMPLER_RANDOM;  // SamplerType
+    int priority = 0;
+    unsigned int every = 0;  // send the image every this many samples; 0 for the final image only
+    bool setPosition = false, setDirection = false, setAperture = false;
+    Vector position, direction;
+    double aperture = 0;
+    std::shared_ptr<ServerConnection> client;
+    std::chrono::steady_clock::time_point queuedAt;
+
+    // Reads the key=value words of a `render` request
+    bool parse(const std::vector<std::string> &words, std::string &error) {
+        for (const std::string &word : words) {
+            size_t eq = word.find('=');
+            std::string key = word.substr(0, eq), value = eq == std::string::npos ? "" : word.substr(eq + 1);
+            double x, y, z;
+            bool ok = true;
+            try {
+                if (key == "scene") {
+                    scene = value;
+                } else if (key == "width") {
+                    width = std::stoi(value);
+                } else if (key == "height") {
+                    height = std::stoi(value);
+                } else if (key == "spp") {
+                    spp = std::stoul(value);
+                } else if (key == "seed") {
+                    seed = std::stoull(value);
+                } else if (key == "sampler") {
+                    ok = parseSamplerType(value, sampler);
+                } else if (key == "priority") {
+                    priority = std::stoi(value);
+                } else if (key == "every") {
+                    every = std::stoul(value);
+                } else if (key == "aperture") {
+                    aperture = std::stod(value);
+                    setAperture = true;
+                } else if ((key == "position" || key == "direction") && sscanf(value.c_str(), "%lf,%lf,%lf", &x, &y, &z) == 3) {
+                    (key == "position" ? position : direction) = Vector(x, y, z);
+                    (key == "position" ? setPosition : setDirection) = true;
+                } else {
+                    ok = false;
+                }
+            } catch (const std::exception &) {
+                ok = false;
+            }
+            if (!ok) {
+                error = "bad argument '" + word + "'";
+                return false;
+            }
+        }
+        if (width < 1 || height < 1 || width > 16384 || height > 16384 || spp < 1) {
+            error = "width and height must be from 1 to 16384, and spp positive";
+            return false;
+        }
+        if (setDirection && !(direction.dot(direction) > 0)) {
+            error = "direction must not be zero";
+            return false;
+        }
+        return true;
+    }
+};
+
+struct RenderServer {
+    // Loads a scene by name, as --scene does: a built-in scene, a scene file or a scene cache
+    typedef std::function<bool(const std::string &, SceneCamera &, std::shared_ptr<const CompiledScene> &, std::string &)> SceneLoader;
+
+    RenderServer(unsigned int threads, const SceneLoader &loader_) : pool(threads), loader(loader_) {}
+
+    // Serves until a client sends `shutdown`; returns the exit code
+    int serve(const std::string &socketPath) {
+        sockaddr_un addr;
+        if (!unixSocketAddress(socketPath, addr)) {
+            std::cout << "Socket path " << socketPath << " is too long" << std::endl;
+            return 1;
+        }
+        // A socket left behind by a server that was killed; anything else at the path is kept
+        struct stat st;
+        if (lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socketPath.c_str());
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0 || bind(listenFd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 64) != 0) {
+            std::cout << "Could not listen on " << socketPath << ": " << strerror(errno) << std::endl;
+            if (listenFd >= 0) close(listenFd);
+            return 1;
+        }
+        std::cout << "Serving on " << socketPath << " with " << pool.size() << " threads" << std::endl;
+
+        std::thread renderer(&RenderServer::renderLoop, this);
+        // A connection lives as long as its reader or one of its jobs, so the
+        // list only holds it weakly; it is pruned as clients come and go
+        std::vector<std::weak_ptr<ServerConnection>> connections;
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                break;  // shut down by a `shutdown` request
+            }
+            auto connection = std::make_shared<ServerConnection>(fd);
+            connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                             [](const std::weak_ptr<ServerConnection> &c) { return c.expired(); }),
+                              connections.end());
+            connections.push_back(connection);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                readers++;
+            }
+            std::thread(&RenderServer::readLoop, this, connection).detach();
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+        wake.notify_all();
+        guard.unlock();
+        renderer.join();
+        // Wake the readers still waiting for a request, and wait for them to finish
+        for (auto &c : connections) {
+            if (auto connection = c.lock()) ::shutdown(connection->fd, SHUT_RDWR);
+        }
+        guard.lock();
+        wake.wait(guard, [&] { return readers == 0; });
+        guard.unlock();
+        close(listenFd);
+        unlink(socketPath.c_str());
+        std::cout << "Rendered " << jobsDone << " jobs" << std::endl;
+        return 0;
+    }
+
+private:
+    struct Resident {
+        SceneCamera camera;
+        std::shared_ptr<const CompiledScene> compiled;
+    };
+    // Highest priority first, then in the order queued
+    struct Later {
+        bool operator()(const RenderJob &a, const RenderJob &b) const {
+            return a.priority != b.priority ? a.priority < b.priority : a.id > b.id;
+        }
+    };
+
+    ThreadPool pool;
+    SceneLoader loader;
+    std::map<std::string, Resident> scenes;  // only touched by the render thread
+    int listenFd = -1;
+
+    std::mutex lock;  // guards the members below
+    std::condition_variable wake;
+    std::priority_queue<RenderJob, std::vector<RenderJob>, Later> queue;
+    uint64_t nextId = 1, running = 0, jobsDone = 0;
+    unsigned int readers = 0;  // connection threads still running
+    bool stopping = false;
+
+    void readLoop(std::shared_ptr<ServerConnection> client) {
+        SocketReader reader(client->fd);
+        std::string line;
+        while (reader.readLine(line)) {
+            std::istringstream in(line);
+            std::string command, word;
+            std::vector<std::string> words;
+            in >> command;
+            while (in >> word) words.push_back(word);
+            if (command == "render") {
+                RenderJob job;
+                std::string error;
+                if (!job.parse(words, error)) {
+                    client->send("error - " + error);
+                    continue;
+                }
+                job.client = client;
+                job.queuedAt = std::chrono::steady_clock::now();
+                uint64_t id;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    id = job.id = nextId++;
+                    queue.push(job);
+                }
+                wake.notify_one();
+                // The render thread holds the job's replies back until this has gone out
+                client->announce(id);
+            } else if (command == "status") {
+                std::string status;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    status = "status queued " + std::to_string(queue.size()) + " running " +
+                             (running ? std::to_string(running) : std::string("-")) + " done " + std::to_string(jobsDone);
+                }
+                client->send(status);
+            } else if (command == "shutdown") {
+                client->send("ok");
+                ::shutdown(listenFd, SHUT_RDWR);  // ends the accept loop
+            } else if (!command.empty()) {
+                client->send("error - unknown request '" + command + "'");
+            }
+        }
+        client->closed = true;
+        std::lock_guard<std::mutex> guard(lock);
+        if (--readers == 0) wake.notify_all();
+    }
+
+    void renderLoop() {
+        while (true) {
+            RenderJob job;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&] { return stopping || !queue.empty(); });
+                if (stopping) {
+                    // Jobs still queued are turned away, once the lock is released
+                    std::vector<RenderJob> left;
+                    for (; !queue.empty(); queue.pop()) left.push_back(queue.top());
+                    guard.unlock();
+                    for (const RenderJob &j : left) {
+                        j.client->waitAnnounced(j.id);
+                        j.client->send("error " + std::to_string(j.id) + " server shutting down");
+                    }
+                    return;
+                }
+                job = queue.top();
+                queue.pop();
+                if (job.client->closed) {
+                    std::cout << "Job " << job.id << " dropped: its client disconnected" << std::endl;
+                    continue;
+                }
+                running = job.id;
+            }
+            render(job);
+            std::lock_guard<std::mutex> guard(lock);
+            running = 0;
+            jobsDone++;
+        }
+    }
+
+    const Resident *scene(const std::string &name, std::string &error) {
+        auto found = scenes.find(name);
+        if (found != scenes.end()) return &found->second;
+        Resident r;
+        if (!loader(name, r.camera, r.compiled, error)) return nullptr;
+        return &(scenes[name] = r);
+    }
+
+    void sendImage(const RenderJob &job, const Image &img, unsigned int samples, bool final) {
+        FrameBuffer frame;
+        img.snapshot(frame);
+        std::ostringstream header;
+        header << "image " << job.id << " " << samples << " " << frame.width << " " << frame.height << " " << int(final);
+        job.client->send(header.str(), frame.rgb.data(), frame.rgb.size() * sizeof(float));
+    }
+
+    void render(const RenderJob &job) {
+        job.client->waitAnnounced(job.id);
+        auto start = std::chrono::steady_clock::now();
+        std::string error;
+        const Resident *resident = scene(job.scene, error);
+        if (!resident) {
+            job.client->send("error " + std::to_string(job.id) + " " + error);
+            return;
+        }
+        SceneCamera sceneCamera = resident->camera;
+        if (job.setPosition) sceneCamera.position = job.position;
+        if (job.setDirection) sceneCamera.direction = job.direction;
+        if (job.setAperture) sceneCamera.aperture = job.aperture;
+        int w = job.width, h = job.height;
+        Camera camera(sceneCamera, w, h);
+        Image img(w, h);
+        std::vector<Tracer> tracers(pool.size(), Tracer(resident->compiled, camera.view.origin));
+        std::vector<std::unique_ptr<Sampler>> samplers;
+        for (unsigned int i = 0; i < pool.size(); ++i) samplers.push_back(makeSampler(job.sampler, job.seed, w));
+        std::vector<Tile> tiles = makeTiles(w, h, 32);
+
+        ThreadPool::TileFunc renderTile = withTracePolicy(true, resident->compiled->materialSet(), false, false, [&](auto policy) {
+            typedef decltype(policy) Policy;
+            return ThreadPool::TileFunc([&](const Tile &tile, unsigned int worker) {
+                Tracer &tracer = tracers[worker];
+                Sampler &sampler = *samplers[worker];
+                for (int y = tile.y0; y < tile.y1; ++y) {
+                    for (int x = tile.x0; x < tile.x1; ++x) {
+                        sampler.startPixelSample((h - y - 1) * w + x, tile.firstPass);
+                        Vector rads = tracer.getRadiance<Policy>(camera.generateRay<false>(x, y, sampler), sampler);
+                        rads.clamp();
+                        img.setPixel(x, y, rads);
+                    }
+                }
+            });
+        });
+
+        for (unsigned int sample = 1; sample <= job.spp; ++sample) {
+            if (job.client->closed) {
+                std::cout << "Job " << job.id << " dropped: its client disconnected" << std::endl;
+                return;
+            }
+            for (Tile &tile : tiles) tile.firstPass = sample - 1;
+            pool.run(tiles, renderTile);
+            if (job.every && sample % job.every == 0 && sample < job.spp) sendImage(job, img, sample, false);
+        }
+        sendImage(job, img, job.spp, true);
+
+        auto end = std::chrono::steady_clock::now();
+        double waited = std::chrono::duration<double>(start - job.queuedAt).count();
+        double rendered = std::chrono::duration<double>(end - start).count();
+        job.client->send("done " + std::to_string(job.id) + " " + std::to_string(waited) + " " + std::to_string(rendered));
+        std::cout << "Job " << job.id << ": " << job.scene << " " << w << "x" << h << " " << job.spp << " spp, priority "
+                  << job.priority << ", waited " << waited << " s, rendered in " << rendered << " s" << std::endl;
+    }
+};
+
+// Client stub: sends one request and handles the replies. For a `render`
+// request (`words` holds its key=value arguments) the progressive images
+// are written as <prefix>_<samples>.pfm and the final one as <prefix>.ppm and
+// <prefix>.pfm.
+inline int submitToServer(const std::string &socketPath, const std::string &command, const std::string &prefix,
+                          const std::vector<std::string> &words) {
+    sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (!unixSocketAddress(socketPath, addr) || fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        std::cout << "Could not connect to " << socketPath << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    std::string request = command;
+    for (const std::string &word : words) request += " " + word;
+    request += "\n";
+    auto start = std::chrono::steady_clock::now();
+    SocketReader reader(fd);
+    std::string line;
+    int result = 1;
+    bool ok = sendAll(fd, request.data(), request.size());
+    while (ok && reader.readLine(line)) {
+        std::istringstream in(line);
+        std::string reply;
+        in >> reply;
+        if (reply == "image") {
+            uint64_t job;
+            unsigned int samples;
+            int final;
+            FrameBuffer frame;
+            in >> job >> samples >> frame.width >> frame.height >> final;
+            frame.rgb.resize(size_t(frame.width) * frame.height * 3);
+            if (!reader.readBytes(frame.rgb.data(), frame.rgb.size() * sizeof(float))) break;
+            char name[32];
+            snprintf(name, sizeof(name), "_%05u", samples);
+            std::string file = final ? prefix : prefix + name;
+            if (!writePFM(file + ".pfm", frame) || (final && !writePPM(file + ".ppm", frame))) {
+                std::cout << "Could not write " << file << std::endl;
+                break;
+            }
+            std::cout << "Job " << job << ": " << samples << " samples in " << file << ".pfm" << std::endl;
+            continue;
+        }
+        std::cout << line << std::endl;
+        if (reply == "queued") continue;
+        result = reply == "error" ? 1 : 0;
+        break;  // `done`, `status`, `ok` or an error end the request
+    }
+    close(fd);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (command == "render") std::cout << "Round trip: " << elapsed.count() << " s" << std::endl;
+    return result;
+}
+
+#endif // SERVER_H
@@ -3,11 +3,40 @@
 
 #include <cmath>
 #include <algorithm> // Include this for std::swap
+#include <limits>
 #include "vector.h"
 #include "ray.h"
+#include "sampler.h"
+#include "bvh.h"
 
 #define EPSILON 0.001f
 
+// How far a computed hit point can lie off the true surface: some units in
+// the last place of its largest coordinate. Far below EPSILON in a double
+// build; in a float build it outgrows EPSILON past about 130 units from the
+// origin, where a fixed tolerance alone lets rays hit their own surface.
+static const int SELF_HIT_ULPS = 64;
+
+template <typename T>
+inline T selfHitOffset(const VectorT<T> &p) {
+    T scale = std::max({std::fabs(p.x), std::fabs(p.y), std::fabs(p.z), T(1)});
+    return scale * SELF_HIT_ULPS * std::numeric_limits<T>::epsilon();
+}
+
+// Origin of a ray leaving the surface at `p` on the side `n` points to
+template <typename T>
+inline VectorT<T> offsetOrigin(const VectorT<T> &p, const VectorT<T> &n) {
+    return p + n * selfHitOffset(p);
+}
+
+// Unit vectors u and v that make an orthonormal frame with the unit vector n
+template <typename T>
+inline void tangentFrame(const VectorT<T> &n, VectorT<T> &u, VectorT<T> &v) {
+    u = std::fabs(n.x) > T(0.1) ? VectorT<T>(0, 1, 0) : VectorT<T>(1, 0, 0);
+    u = u.cross(n).normalize();
+    v = n.cross(u);
+}
+
 enum Material {
     DIFFUSE,
     MIRROR,
@@ -20,91 +49,130 @@ struct Shape {
 
     Shape(const Vector &color_, const Vector &emit_, Material material_) 
         : color(color_), emit(emit_), material(material_) {}
+    virtual ~Shape() {}
 
-    virtual double intersects(const Ray &r) const { return 0; }
-    virtual Vector randomPoint() const { return Vector(); }
+    virtual Scalar intersects(const Ray &r) const { return 0; }
+    virtual Vector randomPoint(Sampler &sampler) const { return Vector(); }
     virtual Vector getNormal(const Vector &p) const { return Vector(); }
+    // Shapes made of many primitives (meshes) also report which one was hit
+    virtual Scalar intersectsPrimitive(const Ray &r, uint32_t &prim) const { prim = 0; return intersects(r); }
+    virtual Vector getPrimitiveNormal(const Vector &p, uint32_t prim) const { return getNormal(p); }
     virtual Vector getColor(const Vector &p) const { return color; }
     virtual Vector getEmission() const { return emit; }
+    // Bounding box of the shape; returns false for unbounded shapes such as planes
+    virtual bool getBounds(AABB &box) const { return false; }
 };
 
 struct Sphere : Shape {
     Vector center;
-    double radius;
+    Scalar radius;
 
-    Sphere(const Vector &center_, double radius_, const Vector &color_, const Vector &emit_, Material material_)
+    Sphere(const Vector &center_, Scalar radius_, const Vector &color_, const Vector &emit_, Material material_)
         : Shape(color_, emit_, material_), center(center_), radius(radius_) {}
 
-    double intersects(const Ray &r) const override {
+    // For a unit direction. The discriminant comes from how close the ray
+    // passes to the centre rather than from b^2 - 4ac, whose two terms cancel
+    // to nothing in single precision when the sphere is small and far away.
+    Scalar intersects(const Ray &r) const override {
         Vector offset = r.origin - center;
-        double a = r.direction.dot(r.direction);
-        double b = 2 * offset.dot(r.direction);
-        double c = offset.dot(offset) - radius * radius;
-        double disc = b * b - 4 * a * c;
+        Scalar h = offset.dot(r.direction);
+        Vector closest = offset - r.direction * h;
+        Scalar disc = radius * radius - closest.dot(closest);
         if (disc < 0) {
             return 0;
         }
-        disc = sqrt(disc);
-        double t = -b - disc;
+        disc = std::sqrt(disc);
+        Scalar t = -h - disc;
         if (t > EPSILON) {
-            return t / 2;
+            return t;
         }
-        t = -b + disc;
+        t = -h + disc;
         if (t > EPSILON) {
-            return t / 2;
+            return t;
         }
         return 0;
     }
 
-    Vector randomPoint() const override {
-        double theta = drand48() * M_PI;
-        double phi = drand48() * 2 * M_PI;
-        double dxr = radius * sin(theta) * cos(phi);
-        double dyr = radius * sin(theta) * sin(phi);
-        double dzr = radius * cos(theta);
-        return Vector(center.x + dxr, center.y + dyr, center.z + dzr);
+    // Uniform over the surface
+    Vector randomPoint(Sampler &sampler) const override {
+        Scalar z = 1 - 2 * Scalar(sampler.get1D());
+        Scalar phi = sampler.get1D() * 2 * M_PI;
+        Scalar r = std::sqrt(std::max<Scalar>(0, 1 - z * z));
+        return center + Vector(r * std::cos(phi), r * std::sin(phi), z) * radius;
     }
 
     Vector getNormal(const Vector &p) const override {
         return (p - center) / radius;
     }
+
+    bool getBounds(AABB &box) const override {
+        box = AABB(center - Vector(radius, radius, radius), center + Vector(radius, radius, radius));
+        return true;
+    }
 };
 
+// Outward normal of the face of the box [min, max] that `p` lies on; the
+// nearest face when rounding has put `p` further than EPSILON from all of them
+inline Vector boxFaceNormal(const Vector &p, const Vector &min, const Vector &max) {
+    Scalar dist[6] = {std::fabs(p.x - min.x), std::fabs(p.x - max.x), std::fabs(p.y - min.y),
+                      std::fabs(p.y - max.y), std::fabs(p.z - min.z), std::fabs(p.z - max.z)};
+    int face = 0;
+    for (int i = 0; i < 6; ++i) {
+        if (dist[i] < EPSILON) {
+            face = i;
+            break;
+        }
+        if (dist[i] < dist[face]) face = i;
+    }
+    Vector n;
+    (face < 2 ? n.x : face < 4 ? n.y : n.z) = face % 2 ? 1 : -1;
+    return n;
+}
+
 struct Cube : Shape {
     Vector min, max, center;
-    double angle;  // Rotation angle in radians
+    Scalar angle;  // Rotation angle in radians, about the y axis through the centre
+    Scalar sinAngle, cosAngle;  // of `angle`, computed once; other rotations go through an Instance
 
-    Cube(const Vector &min_, const Vector &max_, const Vector &color_, const Vector &emit_, Material material_, double angle_)
-        : Shape(color_, emit_, material_), min(min_), max(max_), center((min_ + max_) / 2), angle(angle_) {}
+    Cube(const Vector &min_, const Vector &max_, const Vector &color_, const Vector &emit_, Material material_, Scalar angle_)
+        : Shape(color_, emit_, material_), min(min_), max(max_), center((min_ + max_) / 2), angle(angle_),
+          sinAngle(sin(angle_)), cosAngle(cos(angle_)) {}
 
     Vector rotatePoint(const Vector &p) const {
         Vector translated = p - center;
-        double sinAngle = sin(angle);
-        double cosAngle = cos(angle);
-
-        double x = translated.x * cosAngle - translated.z * sinAngle;
-        double z = translated.x * sinAngle + translated.z * cosAngle;
+        Scalar x = translated.x * cosAngle - translated.z * sinAngle;
+        Scalar z = translated.x * sinAngle + translated.z * cosAngle;
 
         return Vector(x, translated.y, z) + center;
     }
 
-    double intersects(const Ray &r) const override {
-        Ray rotatedRay(rotatePoint(r.origin), rotatePoint(r.direction + r.origin) - rotatePoint(r.origin));
+    // rotatePoint for a direction
+    Vector rotate(const Vector &v) const {
+        return Vector(v.x * cosAngle - v.z * sinAngle, v.y, v.x * sinAngle + v.z * cosAngle);
+    }
+
+    // Direction in the box frame back in world space, undoing rotatePoint
+    Vector unrotate(const Vector &v) const {
+        return Vector(v.x * cosAngle + v.z * sinAngle, v.y, -v.x * sinAngle + v.z * cosAngle);
+    }
+
+    Scalar intersects(const Ray &r) const override {
+        Ray rotatedRay(rotatePoint(r.origin), rotate(r.direction));
 
-        double tmin = (min.x - rotatedRay.origin.x) / rotatedRay.direction.x;
-        double tmax = (max.x - rotatedRay.origin.x) / rotatedRay.direction.x;
+        Scalar tmin = (min.x - rotatedRay.origin.x) / rotatedRay.direction.x;
+        Scalar tmax = (max.x - rotatedRay.origin.x) / rotatedRay.direction.x;
         if (tmin > tmax) std::swap(tmin, tmax);
 
-        double tymin = (min.y - rotatedRay.origin.y) / rotatedRay.direction.y;
-        double tymax = (max.y - rotatedRay.origin.y) / rotatedRay.direction.y;
+        Scalar tymin = (min.y - rotatedRay.origin.y) / rotatedRay.direction.y;
+        Scalar tymax = (max.y - rotatedRay.origin.y) / rotatedRay.direction.y;
         if (tymin > tymax) std::swap(tymin, tymax);
 
         if ((tmin > tymax + EPSILON) || (tymin > tmax + EPSILON)) return 0;
         if (tymin > tmin) tmin = tymin;
         if (tymax < tmax) tmax = tymax;
 
-        double tzmin = (min.z - rotatedRay.origin.z) / rotatedRay.direction.z;
-        double tzmax = (max.z - rotatedRay.origin.z) / rotatedRay.direction.z;
+        Scalar tzmin = (min.z - rotatedRay.origin.z) / rotatedRay.direction.z;
+        Scalar tzmax = (max.z - rotatedRay.origin.z) / rotatedRay.direction.z;
         if (tzmin > tzmax) std::swap(tzmin, tzmax);
 
         if ((tmin > tzmax + EPSILON) || (tzmin > tmax + EPSILON)) return 0;
@@ -115,35 +183,38 @@ struct Cube : Shape {
     }
 
     Vector getNormal(const Vector &p) const override {
-        Vector rotatedP = rotatePoint(p);
-        if (fabs(rotatedP.x - min.x) < EPSILON) return Vector(-1, 0, 0);
-        if (fabs(rotatedP.x - max.x) < EPSILON) return Vector(1, 0, 0);
-        if (fabs(rotatedP.y - min.y) < EPSILON) return Vector(0, -1, 0);
-        if (fabs(rotatedP.y - max.y) < EPSILON) return Vector(0, 1, 0);
-        if (fabs(rotatedP.z - min.z) < EPSILON) return Vector(0, 0, -1);
-        if (fabs(rotatedP.z - max.z) < EPSILON) return Vector(0, 0, 1);
-        return Vector();
-    }
-
-    Vector randomPoint() const override {
-        double x = min.x + drand48() * (max.x - min.x);
-        double y = min.y + drand48() * (max.y - min.y);
-        double z = min.z + drand48() * (max.z - min.z);
+        return unrotate(boxFaceNormal(rotatePoint(p), min, max));
+    }
+
+    Vector randomPoint(Sampler &sampler) const override {
+        Scalar x = min.x + sampler.get1D() * (max.x - min.x);
+        Scalar y = min.y + sampler.get1D() * (max.y - min.y);
+        Scalar z = min.z + sampler.get1D() * (max.z - min.z);
         return rotatePoint(Vector(x, y, z));
     }
+
+    bool getBounds(AABB &box) const override {
+        // rotatePoint maps world space into the box frame, so rotate the corners back the other way
+        box = AABB();
+        for (int i = 0; i < 8; ++i) {
+            Vector c = Vector(i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z) - center;
+            box.grow(Vector(c.x * cosAngle + c.z * sinAngle, c.y, -c.x * sinAngle + c.z * cosAngle) + center);
+        }
+        return true;
+    }
 };
 
 struct Plane : Shape {
     Vector normal;
-    double d;
+    Scalar d;
 
-    Plane(const Vector &normal_, double d_, const Vector &color_, const Vector &emit_, Material material_)
+    Plane(const Vector &normal_, Scalar d_, const Vector &color_, const Vector &emit_, Material material_)
         : Shape(color_, emit_, material_), normal(normal_), d(d_) {}
 
-    double intersects(const Ray &r) const override {
-        double denom = normal.dot(r.direction);
-        if (fabs(denom) < EPSILON) return 0;
-        double t = -(r.origin.dot(normal) + d) / denom;
+    Scalar intersects(const Ray &r) const override {
+        Scalar denom = normal.dot(r.direction);
+        if (std::fabs(denom) < EPSILON) return 0;
+        Scalar t = -(r.origin.dot(normal) + d) / denom;
         return (t > EPSILON) ? t : 0;
     }
 
@@ -151,16 +222,16 @@ struct Plane : Shape {
         return normal;
     }
 
-    Vector randomPoint() const override {
+    Vector randomPoint(Sampler &sampler) const override {
         return Vector();  // Not used for planes
     }
 };
 
 struct Checkerboard : Plane {
     Vector color1, color2;
-    double size;
+    Scalar size;
 
-    Checkerboard(const Vector &normal_, double d_, const Vector &color1_, const Vector &color2_, double size_, const Vector &emit_, Material material_)
+    Checkerboard(const Vector &normal_, Scalar d_, const Vector &color1_, const Vector &color2_, Scalar size_, const Vector &emit_, Material material_)
         : Plane(normal_, d_, Vector(), emit_, material_), color1(color1_), color2(color2_), size(size_) {}
 
     Vector getColor(const Vector &p) const override {
@@ -168,11 +239,11 @@ struct Checkerboard : Plane {
         int x, y;
 
         // Determine the dominant axis of the normal vector
-        if (fabs(normal.x) > fabs(normal.y) && fabs(normal.x) > fabs(normal.z)) {
+        if (std::fabs(normal.x) > std::fabs(normal.y) && std::fabs(normal.x) > std::fabs(normal.z)) {
             // Plane is yz
             x = floor(localP.y / size);
             y = floor(localP.z / size);
-        } else if (fabs(normal.y) > fabs(normal.x) && fabs(normal.y) > fabs(normal.z)) {
+        } else if (std::fabs(normal.y) > std::fabs(normal.x) && std::fabs(normal.y) > std::fabs(normal.z)) {
             // Plane is xz
             x = floor(localP.x / size);
             y = floor(localP.z / size);
@@ -192,9 +263,9 @@ struct Checkerboard : Plane {
 
 struct Stripe : Plane {
     Vector color1, color2;
-    double size;
+    Scalar size;
 
-    Stripe(const Vector &normal_, double d_, const Vector &color1_, const Vector &color2_, double size_, const Vector &emit_, Material material_)
+    Stripe(const Vector &normal_, Scalar d_, const Vector &color1_, const Vector &color2_, Scalar size_, const Vector &emit_, Material material_)
         : Plane(normal_, d_, Vector(), emit_, material_), color1(color1_), color2(color2_), size(size_) {}
 
     Vector getColor(const Vector &p) const override {
@@ -202,10 +273,10 @@ struct Stripe : Plane {
         int stripe;
 
         // Determine the dominant axis of the normal vector
-        if (fabs(normal.x) > fabs(normal.y) && fabs(normal.x) > fabs(normal.z)) {
+        if (std::fabs(normal.x) > std::fabs(normal.y) && std::fabs(normal.x) > std::fabs(normal.z)) {
             // Plane is yz
             stripe = floor(localP.y / size);
-        } else if (fabs(normal.y) > fabs(normal.x) && fabs(normal.y) > fabs(normal.z)) {
+        } else if (std::fabs(normal.y) > std::fabs(normal.x) && std::fabs(normal.y) > std::fabs(normal.z)) {
             // Plane is xz
             stripe = floor(localP.x / size);
         } else {
@@ -0,0 +1,470 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstddef>
+#include "vector.h"
+#include "ray.h"
+#include "shapes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+// Structure-of-arrays copies of the analytic shapes, so one ray can be tested
+// against a register's worth of them at once (or as many rays against one):
+// four in a double build, eight in a float build. Slots that hold another
+// kind of shape, and the padding at the end, are filled with NaN, which
+// makes every comparison in the kernels fail: such slots never hit.
+static const int SIMD_WIDTH = 32 / sizeof(Scalar);
+
+struct SpherePack {
+    std::vector<Scalar> cx, cy, cz, r2, r;
+    void add(const Sphere *s) {
+        if (!s) { push(NAN, NAN, NAN, NAN); return; }
+        push(s->center.x, s->center.y, s->center.z, s->radius);
+    }
+    void pad() { for (int i = 1; i < SIMD_WIDTH; ++i) add(nullptr); }
+    Vector center(size_t i) const { return Vector(cx[i], cy[i], cz[i]); }
+private:
+    void push(Scalar x, Scalar y, Scalar z, Scalar rad) {
+        cx.push_back(x); cy.push_back(y); cz.push_back(z); r2.push_back(rad * rad); r.push_back(rad);
+    }
+};
+
+struct PlanePack {
+    std::vector<Scalar> nx, ny, nz, d;
+    void add(const Plane *p) {
+        if (!p) { push(NAN, NAN, NAN, NAN); return; }
+        push(p->normal.x, p->normal.y, p->normal.z, p->d);
+    }
+    void pad() { for (int i = 1; i < SIMD_WIDTH; ++i) add(nullptr); }
+    Vector normal(size_t i) const { return Vector(nx[i], ny[i], nz[i]); }
+private:
+    void push(Scalar x, Scalar y, Scalar z, Scalar dd) { nx.push_back(x); ny.push_back(y); nz.push_back(z); d.push_back(dd); }
+};
+
+struct BoxPack {
+    std::vector<Scalar> minx, miny, minz, maxx, maxy, maxz, cx, cy, cz, sinA, cosA;
+    void add(const Cube *c) {
+        if (!c) {
+            for (auto *v : arrays()) v->push_back(NAN);
+            return;
+        }
+        minx.push_back(c->min.x); miny.push_back(c->min.y); minz.push_back(c->min.z);
+        maxx.push_back(c->max.x); maxy.push_back(c->max.y); maxz.push_back(c->max.z);
+        cx.push_back(c->center.x); cy.push_back(c->center.y); cz.push_back(c->center.z);
+        sinA.push_back(c->sinAngle); cosA.push_back(c->cosAngle);
+    }
+    void pad() { for (int i = 1; i < SIMD_WIDTH; ++i) add(nullptr); }
+    std::vector<std::vector<Scalar> *> arrays() { return {&minx, &miny, &minz, &maxx, &maxy, &maxz, &cx, &cy, &cz, &sinA, &cosA}; }
+    // Cube::rotatePoint
+    Vector rotatePoint(size_t i, const Vector &p) const {
+        Vector translated = p - Vector(cx[i], cy[i], cz[i]);
+        Scalar x = translated.x * cosA[i] - translated.z * sinA[i];
+        Scalar z = translated.x * sinA[i] + translated.z * cosA[i];
+        return Vector(x, translated.y, z) + Vector(cx[i], cy[i], cz[i]);
+    }
+    // Cube::unrotate
+    Vector unrotate(size_t i, const Vector &v) const {
+        return Vector(v.x * cosA[i] + v.z * sinA[i], v.y, -v.x * sinA[i] + v.z * cosA[i]);
+    }
+};
+
+// Up to SIMD_WIDTH coherent rays in SoA form, with the closest hit per lane.
+// Lanes past `count` carry NaN rays and never hit.
+struct RayPacket {
+    Scalar ox[SIMD_WIDTH], oy[SIMD_WIDTH], oz[SIMD_WIDTH];
+    Scalar dx[SIMD_WIDTH], dy[SIMD_WIDTH], dz[SIMD_WIDTH];
+    Scalar tmax[SIMD_WIDTH];
+    int hit[SIMD_WIDTH];  // slot of the closest hit found so far, or -1
+    int count;
+
+    RayPacket(const Ray *rays, int n) : count(n) {
+        for (int k = 0; k < SIMD_WIDTH; ++k) {
+            bool used = k < n;
+            ox[k] = used ? rays[k].origin.x : NAN; oy[k] = used ? rays[k].origin.y : NAN; oz[k] = used ? rays[k].origin.z : NAN;
+            dx[k] = used ? rays[k].direction.x : NAN; dy[k] = used ? rays[k].direction.y : NAN; dz[k] = used ? rays[k].direction.z : NAN;
+            tmax[k] = 1e20f;
+            hit[k] = -1;
+        }
+    }
+    Ray ray(int k) const { return Ray(Vector(ox[k], oy[k], oz[k]), Vector(dx[k], dy[k], dz[k])); }
+};
+
+// Scalar versions of the tests. They repeat the arithmetic of Sphere, Plane and
+// Cube::intersects operation for operation, so every kernel gives bit-identical distances.
+inline Scalar sphereHit(Scalar ox, Scalar oy, Scalar oz, Scalar dx, Scalar dy, Scalar dz,
+                        Scalar cx, Scalar cy, Scalar cz, Scalar r2) {
+    Scalar offx = ox - cx, offy = oy - cy, offz = oz - cz;
+    Scalar h = offx * dx + offy * dy + offz * dz;
+    Scalar px = offx - dx * h, py = offy - dy * h, pz = offz - dz * h;
+    Scalar disc = r2 - (px * px + py * py + pz * pz);
+    if (!(disc >= 0)) return 0;
+    disc = std::sqrt(disc);
+    Scalar t = -h - disc;
+    if (t > EPSILON) return t;
+    t = -h + disc;
+    if (t > EPSILON) return t;
+    return 0;
+}
+
+inline Scalar planeHit(Scalar ox, Scalar oy, Scalar oz, Scalar dx, Scalar dy, Scalar dz,
+                       Scalar nx, Scalar ny, Scalar nz, Scalar d) {
+    Scalar denom = nx * dx + ny * dy + nz * dz;
+    if (!(std::fabs(denom) >= EPSILON)) return 0;
+    Scalar t = -((ox * nx + oy * ny + oz * nz) + d) / denom;
+    return (t > EPSILON) ? t : 0;
+}
+
+inline Scalar boxHit(const BoxPack &b, size_t i, Scalar ox, Scalar oy, Scalar oz, Scalar dx, Scalar dy, Scalar dz) {
+    auto rotX = [&](Scalar x, Scalar z) { return (x - b.cx[i]) * b.cosA[i] - (z - b.cz[i]) * b.sinA[i] + b.cx[i]; };
+    auto rotZ = [&](Scalar x, Scalar z) { return (x - b.cx[i]) * b.sinA[i] + (z - b.cz[i]) * b.cosA[i] + b.cz[i]; };
+    Scalar rox = rotX(ox, oz), roy = (oy - b.cy[i]) + b.cy[i], roz = rotZ(ox, oz);
+    Scalar rdx = dx * b.cosA[i] - dz * b.sinA[i], rdy = dy, rdz = dx * b.sinA[i] + dz * b.cosA[i];
+
+    Scalar tmin = (b.minx[i] - rox) / rdx, tmax = (b.maxx[i] - rox) / rdx;
+    if (tmin > tmax) std::swap(tmin, tmax);
+    Scalar tymin = (b.miny[i] - roy) / rdy, tymax = (b.maxy[i] - roy) / rdy;
+    if (tymin > tymax) std::swap(tymin, tymax);
+    if ((tmin > tymax + EPSILON) || (tymin > tmax + EPSILON)) return 0;
+    if (tymin > tmin) tmin = tymin;
+    if (tymax < tmax) tmax = tymax;
+    Scalar tzmin = (b.minz[i] - roz) / rdz, tzmax = (b.maxz[i] - roz) / rdz;
+    if (tzmin > tzmax) std::swap(tzmin, tzmax);
+    if ((tmin > tzmax + EPSILON) || (tzmin > tmax + EPSILON)) return 0;
+    if (tzmin > tmin) tmin = tzmin;
+    if (tzmax < tmax) tmax = tzmax;
+    return tmin > EPSILON ? tmin : (tmax > EPSILON ? tmax : 0);
+}
+
+// Keeps the closest of `n` candidate distances in (0, tmax), scanning in slot
+// order with a strict compare so ties resolve like the scalar loop
+inline int closestLane(const Scalar *t, int n, int base, Scalar &tmax, int best) {
+    for (int k = 0; k < n; ++k) {
+        if (t[k] > 0 && t[k] < tmax) {
+            tmax = t[k];
+            best = base + k;
+        }
+    }
+    return best;
+}
+
+// One ray against slots [first, first + count): returns the closest slot, or -1, and shrinks tmax
+inline int spheresScalar(const SpherePack &s, size_t first, size_t count, const Ray &r, Scalar &tmax) {
+    Scalar t[1];
+    int best = -1;
+    for (size_t i = first; i < first + count; ++i) {
+        t[0] = sphereHit(r.origin.x, r.origin.y, r.origin.z, r.direction.x, r.direction.y, r.direction.z,
+                         s.cx[i], s.cy[i], s.cz[i], s.r2[i]);
+        best = closestLane(t, 1, i, tmax, best);
+    }
+    return best;
+}
+
+inline int planesScalar(const PlanePack &p, size_t first, size_t count, const Ray &r, Scalar &tmax) {
+    Scalar t[1];
+    int best = -1;
+    for (size_t i = first; i < first + count; ++i) {
+        t[0] = planeHit(r.origin.x, r.origin.y, r.origin.z, r.direction.x, r.direction.y, r.direction.z,
+                        p.nx[i], p.ny[i], p.nz[i], p.d[i]);
+        best = closestLane(t, 1, i, tmax, best);
+    }
+    return best;
+}
+
+inline int boxesScalar(const BoxPack &b, size_t first, size_t count, const Ray &r, Scalar &tmax) {
+    Scalar t[1];
+    int best = -1;
+    for (size_t i = first; i < first + count; ++i) {
+        t[0] = boxHit(b, i, r.origin.x, r.origin.y, r.origin.z, r.direction.x, r.direction.y, r.direction.z);
+        best = closestLane(t, 1, i, tmax, best);
+    }
+    return best;
+}
+
+// Packet of rays against the single primitive in `slot`
+inline void spherePacketScalar(const SpherePack &s, size_t slot, RayPacket &p) {
+    for (int k = 0; k < p.count; ++k) {
+        Scalar t = sphereHit(p.ox[k], p.oy[k], p.oz[k], p.dx[k], p.dy[k], p.dz[k], s.cx[slot], s.cy[slot], s.cz[slot], s.r2[slot]);
+        if (t > 0 && t < p.tmax[k]) { p.tmax[k] = t; p.hit[k] = slot; }
+    }
+}
+
+inline void planePacketScalar(const PlanePack &pl, size_t slot, RayPacket &p) {
+    for (int k = 0; k < p.count; ++k) {
+        Scalar t = planeHit(p.ox[k], p.oy[k], p.oz[k], p.dx[k], p.dy[k], p.dz[k], pl.nx[slot], pl.ny[slot], pl.nz[slot], pl.d[slot]);
+        if (t > 0 && t < p.tmax[k]) { p.tmax[k] = t; p.hit[k] = slot; }
+    }
+}
+
+inline void boxPacketScalar(const BoxPack &b, size_t slot, RayPacket &p) {
+    for (int k = 0; k < p.count; ++k) {
+        Scalar t = boxHit(b, slot, p.ox[k], p.oy[k], p.oz[k], p.dx[k], p.dy[k], p.dz[k]);
+        if (t > 0 && t < p.tmax[k]) { p.tmax[k] = t; p.hit[k] = slot; }
+    }
+}
+
+#ifdef SIMD_X86
+// AVX2 kernels, one register of the render precision at a time: four doubles
+// or eight floats. They are written once against the lane helpers below,
+// which pick the _pd or _ps intrinsic by overloading on the register type.
+// The kernels take the ray and the primitive as registers, so the same code
+// serves one ray against SIMD_WIDTH primitives (ray broadcast) and SIMD_WIDTH
+// rays against one primitive (primitive broadcast). No FMA is enabled, which
+// keeps the results equal to the scalar path.
+#define SIMD_AVX2 __attribute__((target("avx2")))
+
+template <typename T> struct AVXRegister;
+template <> struct AVXRegister<double> { typedef __m256d type; };
+template <> struct AVXRegister<float> { typedef __m256 type; };
+typedef AVXRegister<Scalar>::type Lanes;
+
+SIMD_AVX2 inline __m256d broadcast(double v, __m256d) { return _mm256_set1_pd(v); }
+SIMD_AVX2 inline __m256 broadcast(float v, __m256) { return _mm256_set1_ps(v); }
+SIMD_AVX2 inline Lanes lanes(Scalar v) { return broadcast(v, Lanes()); }
+SIMD_AVX2 inline __m256d load(const double *p) { return _mm256_loadu_pd(p); }
+SIMD_AVX2 inline __m256 load(const float *p) { return _mm256_loadu_ps(p); }
+SIMD_AVX2 inline void store(double *p, __m256d v) { _mm256_storeu_pd(p, v); }
+SIMD_AVX2 inline void store(float *p, __m256 v) { _mm256_storeu_ps(p, v); }
+SIMD_AVX2 inline __m256d add(__m256d a, __m256d b) { return _mm256_add_pd(a, b); }
+SIMD_AVX2 inline __m256 add(__m256 a, __m256 b) { return _mm256_add_ps(a, b); }
+SIMD_AVX2 inline __m256d sub(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); }
+SIMD_AVX2 inline __m256 sub(__m256 a, __m256 b) { return _mm256_sub_ps(a, b); }
+SIMD_AVX2 inline __m256d mul(__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+SIMD_AVX2 inline __m256 mul(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+SIMD_AVX2 inline __m256d div(__m256d a, __m256d b) { return _mm256_div_pd(a, b); }
+SIMD_AVX2 inline __m256 div(__m256 a, __m256 b) { return _mm256_div_ps(a, b); }
+SIMD_AVX2 inline __m256d sqrt(__m256d v) { return _mm256_sqrt_pd(v); }
+SIMD_AVX2 inline __m256 sqrt(__m256 v) { return _mm256_sqrt_ps(v); }
+SIMD_AVX2 inline __m256d min(__m256d a, __m256d b) { return _mm256_min_pd(a, b); }
+SIMD_AVX2 inline __m256 min(__m256 a, __m256 b) { return _mm256_min_ps(a, b); }
+SIMD_AVX2 inline __m256d bitAnd(__m256d a, __m256d b) { return _mm256_and_pd(a, b); }
+SIMD_AVX2 inline __m256 bitAnd(__m256 a, __m256 b) { return _mm256_and_ps(a, b); }
+SIMD_AVX2 inline __m256d bitOr(__m256d a, __m256d b) { return _mm256_or_pd(a, b); }
+SIMD_AVX2 inline __m256 bitOr(__m256 a, __m256 b) { return _mm256_or_ps(a, b); }
+SIMD_AVX2 inline __m256d bitXor(__m256d a, __m256d b) { return _mm256_xor_pd(a, b); }
+SIMD_AVX2 inline __m256 bitXor(__m256 a, __m256 b) { return _mm256_xor_ps(a, b); }
+SIMD_AVX2 inline __m256d andNot(__m256d a, __m256d b) { return _mm256_andnot_pd(a, b); }  // b without the bits of a
+SIMD_AVX2 inline __m256 andNot(__m256 a, __m256 b) { return _mm256_andnot_ps(a, b); }
+SIMD_AVX2 inline __m256d greater(__m256d a, __m256d b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+SIMD_AVX2 inline __m256 greater(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+SIMD_AVX2 inline __m256d less(__m256d a, __m256d b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+SIMD_AVX2 inline __m256 less(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+SIMD_AVX2 inline __m256d greaterEqual(__m256d a, __m256d b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+SIMD_AVX2 inline __m256 greaterEqual(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+SIMD_AVX2 inline __m256d equal(__m256d a, __m256d b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+SIMD_AVX2 inline __m256 equal(__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+SIMD_AVX2 inline __m256d select(__m256d mask, __m256d a, __m256d b) { return _mm256_blendv_pd(b, a, mask); }
+SIMD_AVX2 inline __m256 select(__m256 mask, __m256 a, __m256 b) { return _mm256_blendv_ps(b, a, mask); }
+SIMD_AVX2 inline int laneBits(__m256d mask) { return _mm256_movemask_pd(mask); }
+SIMD_AVX2 inline int laneBits(__m256 mask) { return _mm256_movemask_ps(mask); }
+SIMD_AVX2 inline __m256d laneIndex(__m256d) { return _mm256_set_pd(3, 2, 1, 0); }
+SIMD_AVX2 inline __m256 laneIndex(__m256) { return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0); }
+// The smallest lane, in every lane
+SIMD_AVX2 inline __m256d minAcross(__m256d v) {
+    __m256d m = _mm256_min_pd(v, _mm256_permute_pd(v, 0x5));
+    return _mm256_min_pd(m, _mm256_permute2f128_pd(m, m, 1));
+}
+SIMD_AVX2 inline __m256 minAcross(__m256 v) {
+    __m256 m = _mm256_min_ps(v, _mm256_permute_ps(v, 0xb1));
+    m = _mm256_min_ps(m, _mm256_permute_ps(m, 0x4e));
+    return _mm256_min_ps(m, _mm256_permute2f128_ps(m, m, 1));
+}
+SIMD_AVX2 inline double firstLane(__m256d v) { return _mm256_cvtsd_f64(v); }
+SIMD_AVX2 inline float firstLane(__m256 v) { return _mm256_cvtss_f32(v); }
+SIMD_AVX2 inline Lanes negate(Lanes v) { return bitXor(v, lanes(-0.0)); }
+
+// closestLane on a register: picks the first lane holding the smallest distance
+// in (0, tmax) among the first n lanes, without going through memory
+SIMD_AVX2 inline int closestLaneAVX2(Lanes t, int n, int base, Scalar &tmax, int best) {
+    Lanes ok = bitAnd(greater(t, lanes(0)), less(t, lanes(tmax)));
+    ok = bitAnd(ok, less(laneIndex(t), lanes(n)));
+    if (!laneBits(ok)) return best;
+    Lanes candidates = select(ok, t, lanes(INFINITY));
+    Lanes m = minAcross(candidates);
+    tmax = firstLane(m);
+    return base + __builtin_ctz(laneBits(equal(candidates, m)));
+}
+
+SIMD_AVX2 inline Lanes sphereLanes(Lanes ox, Lanes oy, Lanes oz, Lanes dx, Lanes dy, Lanes dz,
+                                   Lanes cx, Lanes cy, Lanes cz, Lanes r2) {
+    Lanes eps = lanes(EPSILON), zero = lanes(0);
+    Lanes offx = sub(ox, cx), offy = sub(oy, cy), offz = sub(oz, cz);
+    Lanes h = add(add(mul(offx, dx), mul(offy, dy)), mul(offz, dz));
+    Lanes px = sub(offx, mul(dx, h)), py = sub(offy, mul(dy, h)), pz = sub(offz, mul(dz, h));
+    Lanes disc = sub(r2, add(add(mul(px, px), mul(py, py)), mul(pz, pz)));
+    Lanes root = sqrt(disc);  // NaN where disc < 0, and NaN never passes the compares below
+    Lanes t1 = sub(negate(h), root), t2 = add(negate(h), root);
+    return select(greater(t1, eps), t1, select(greater(t2, eps), t2, zero));
+}
+
+SIMD_AVX2 inline Lanes planeLanes(Lanes ox, Lanes oy, Lanes oz, Lanes dx, Lanes dy, Lanes dz,
+                                  Lanes nx, Lanes ny, Lanes nz, Lanes d) {
+    Lanes eps = lanes(EPSILON);
+    Lanes denom = add(add(mul(nx, dx), mul(ny, dy)), mul(nz, dz));
+    Lanes on = add(add(mul(ox, nx), mul(oy, ny)), mul(oz, nz));
+    Lanes t = div(negate(add(on, d)), denom);
+    Lanes absDenom = andNot(lanes(-0.0), denom);
+    Lanes valid = bitAnd(greaterEqual(absDenom, eps), greater(t, eps));
+    return bitAnd(valid, t);
+}
+
+// Cube::rotatePoint on the x and z lanes
+SIMD_AVX2 inline void rotateLanes(Lanes x, Lanes z, const Lanes *box, Lanes &rx, Lanes &rz) {
+    Lanes cx = box[6], cz = box[8], sinA = box[9], cosA = box[10];
+    Lanes tx = sub(x, cx), tz = sub(z, cz);
+    rx = add(sub(mul(tx, cosA), mul(tz, sinA)), cx);
+    rz = add(add(mul(tx, sinA), mul(tz, cosA)), cz);
+}
+
+SIMD_AVX2 inline Lanes boxLanes(Lanes ox, Lanes oy, Lanes oz, Lanes dx, Lanes dy, Lanes dz,
+                                const Lanes *box) {  // minx, miny, minz, maxx, maxy, maxz, cx, cy, cz, sin, cos
+    Lanes eps = lanes(EPSILON), zero = lanes(0);
+    Lanes cy = box[7], sinA = box[9], cosA = box[10];
+    Lanes rox, roz;
+    rotateLanes(ox, oz, box, rox, roz);
+    Lanes roy = add(sub(oy, cy), cy);
+    Lanes rdx = sub(mul(dx, cosA), mul(dz, sinA));
+    Lanes rdy = dy;
+    Lanes rdz = add(mul(dx, sinA), mul(dz, cosA));
+
+    Lanes ro[3] = {rox, roy, roz}, rd[3] = {rdx, rdy, rdz};
+    Lanes tmin, tmax, miss = zero;
+    for (int a = 0; a < 3; ++a) {
+        Lanes lo = div(sub(box[a], ro[a]), rd[a]);
+        Lanes hi = div(sub(box[a + 3], ro[a]), rd[a]);
+        Lanes swap = greater(lo, hi);
+        Lanes near = select(swap, hi, lo), far = select(swap, lo, hi);
+        if (a == 0) {
+            tmin = near;
+            tmax = far;
+            continue;
+        }
+        miss = bitOr(miss, bitOr(greater(tmin, add(far, eps)), greater(near, add(tmax, eps))));
+        tmin = select(greater(near, tmin), near, tmin);
+        tmax = select(less(far, tmax), far, tmax);
+    }
+    Lanes t = select(greater(tmin, eps), tmin, select(greater(tmax, eps), tmax, zero));
+    return andNot(miss, t);
+}
+
+SIMD_AVX2 inline int spheresAVX2(const SpherePack &s, size_t first, size_t count, const Ray &r, Scalar &tmax) {
+    Lanes ox = lanes(r.origin.x), oy = lanes(r.origin.y), oz = lanes(r.origin.z);
+    Lanes dx = lanes(r.direction.x), dy = lanes(r.direction.y), dz = lanes(r.direction.z);
+    int best = -1;
+    for (size_t i = first; i < first + count; i += SIMD_WIDTH) {
+        Lanes t = sphereLanes(ox, oy, oz, dx, dy, dz, load(&s.cx[i]), load(&s.cy[i]), load(&s.cz[i]), load(&s.r2[i]));
+        best = closestLaneAVX2(t, std::min<size_t>(SIMD_WIDTH, first + count - i), i, tmax, best);
+    }
+    return best;
+}
+
+SIMD_AVX2 inline int planesAVX2(const PlanePack &p, size_t first, size_t count, const Ray &r, Scalar &tmax) {
+    Lanes ox = lanes(r.origin.x), oy = lanes(r.origin.y), oz = lanes(r.origin.z);
+    Lanes dx = lanes(r.direction.x), dy = lanes(r.direction.y), dz = lanes(r.direction.z);
+    int best = -1;
+    for (size_t i = first; i < first + count; i += SIMD_WIDTH) {
+        Lanes t = planeLanes(ox, oy, oz, dx, dy, dz, load(&p.nx[i]), load(&p.ny[i]), load(&p.nz[i]), load(&p.d[i]));
+        best = closestLaneAVX2(t, std::min<size_t>(SIMD_WIDTH, first + count - i), i, tmax, best);
+    }
+    return best;
+}
+
+SIMD_AVX2 inline int boxesAVX2(const BoxPack &b, size_t first, size_t count, const Ray &r, Scalar &tmax) {
+    Lanes ox = lanes(r.origin.x), oy = lanes(r.origin.y), oz = lanes(r.origin.z);
+    Lanes dx = lanes(r.direction.x), dy = lanes(r.direction.y), dz = lanes(r.direction.z);
+    const std::vector<Scalar> *arrays[11] = {&b.minx, &b.miny, &b.minz, &b.maxx, &b.maxy, &b.maxz, &b.cx, &b.cy, &b.cz, &b.sinA, &b.cosA};
+    int best = -1;
+    for (size_t i = first; i < first + count; i += SIMD_WIDTH) {
+        Lanes box[11];
+        for (int k = 0; k < 11; ++k) box[k] = load(&(*arrays[k])[i]);
+        Lanes t = boxLanes(ox, oy, oz, dx, dy, dz, box);
+        best = closestLaneAVX2(t, std::min<size_t>(SIMD_WIDTH, first + count - i), i, tmax, best);
+    }
+    return best;
+}
+
+// Keeps, per ray lane, the hit in `t` when it beats the packet's current closest
+SIMD_AVX2 inline void mergePacket(RayPacket &p, Lanes t, size_t slot) {
+    Lanes tmax = load(p.tmax);
+    Lanes closer = bitAnd(greater(t, lanes(0)), less(t, tmax));
+    int bits = laneBits(closer);
+    if (!bits) return;
+    store(p.tmax, select(closer, t, tmax));
+    for (int k = 0; k < SIMD_WIDTH; ++k) {
+        if (bits & (1 << k)) p.hit[k] = slot;
+    }
+}
+
+SIMD_AVX2 inline void spherePacketAVX2(const SpherePack &s, size_t slot, RayPacket &p) {
+    mergePacket(p, sphereLanes(load(p.ox), load(p.oy), load(p.oz), load(p.dx), load(p.dy), load(p.dz),
+                               lanes(s.cx[slot]), lanes(s.cy[slot]), lanes(s.cz[slot]), lanes(s.r2[slot])), slot);
+}
+
+SIMD_AVX2 inline void planePacketAVX2(const PlanePack &pl, size_t slot, RayPacket &p) {
+    mergePacket(p, planeLanes(load(p.ox), load(p.oy), load(p.oz), load(p.dx), load(p.dy), load(p.dz),
+                              lanes(pl.nx[slot]), lanes(pl.ny[slot]), lanes(pl.nz[slot]), lanes(pl.d[slot])), slot);
+}
+
+SIMD_AVX2 inline void boxPacketAVX2(const BoxPack &b, size_t slot, RayPacket &p) {
+    const std::vector<Scalar> *arrays[11] = {&b.minx, &b.miny, &b.minz, &b.maxx, &b.maxy, &b.maxz, &b.cx, &b.cy, &b.cz, &b.sinA, &b.cosA};
+    Lanes box[11];
+    for (int k = 0; k < 11; ++k) box[k] = lanes((*arrays[k])[slot]);
+    mergePacket(p, boxLanes(load(p.ox), load(p.oy), load(p.oz), load(p.dx), load(p.dy), load(p.dz), box), slot);
+}
+#endif // SIMD_X86
+
+// Kernel table, picked once from the CPU features
+struct SimdKernels {
+    std::string name;
+    int (*spheres)(const SpherePack &, size_t, size_t, const Ray &, Scalar &);
+    int (*planes)(const PlanePack &, size_t, size_t, const Ray &, Scalar &);
+    int (*boxes)(const BoxPack &, size_t, size_t, const Ray &, Scalar &);
+    void (*spherePacket)(const SpherePack &, size_t, RayPacket &);
+    void (*planePacket)(const PlanePack &, size_t, RayPacket &);
+    void (*boxPacket)(const BoxPack &, size_t, RayPacket &);
+};
+
+inline SimdKernels scalarKernels() {
+    return {"scalar", spheresScalar, planesScalar, boxesScalar, spherePacketScalar, planePacketScalar, boxPacketScalar};
+}
+
+inline bool cpuHasAVX2() {
+#ifdef SIMD_X86
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+inline SimdKernels &simdKernels() {
+#ifdef SIMD_X86
+    static SimdKernels kernels = cpuHasAVX2()
+        ? SimdKernels{"avx2", spheresAVX2, planesAVX2, boxesAVX2, spherePacketAVX2, planePacketAVX2, boxPacketAVX2}
+        : scalarKernels();
+#else
+    static SimdKernels kernels = scalarKernels();
+#endif
+    return kernels;
+}
+
+// Forces a kernel set ("scalar" or "avx2"); returns false if the CPU cannot run it
+inline bool selectSimdKernels(const std::string &name) {
+    if (name == "scalar") {
+        simdKernels() = scalarKernels();
+        return true;
+    }
+#ifdef SIMD_X86
+    if (name == "avx2" && cpuHasAVX2()) {
+        simdKernels() = SimdKernels{"avx2", spheresAVX2, planesAVX2, boxesAVX2, spherePacketAVX2, planePacketAVX2, boxPacketAVX2};
+        return true;
+    }
+#endif
+    return false;
+}
+
+#endif // SIMD_H
@@ -0,0 +1,129 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include "scene.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Render statistics; build with -DRENDER_STATS=1 to compile them in. Every
+// update is behind `if (RENDER_STATS)`, so in a normal build the counters
+// and clock reads are compiled away and the hot paths are unchanged.
+#ifndef RENDER_STATS
+#define RENDER_STATS 0
+#endif
+
+static const int STATS_PRIM_TYPES = PRIM_OTHER + 1;
+static const int STATS_DEPTHS = 16;  // path depth histogram; the last bin holds the deeper paths
+// getRadiance reads the clock around the ray queries of every 16th path only
+// and counts them 16 times over; two reads per query would cost more than
+// the counters do
+static const int STATS_TIMING_PERIOD = 16;
+
+inline uint64_t steadyClockNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Timestamps for the time split, read around every ray query. On x86 this is
+// the time stamp counter, a few cycles where the steady clock takes tens of
+// nanoseconds; statsClockNs() converts its ticks.
+inline uint64_t statsClock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return steadyClockNs();
+#endif
+}
+
+// Nanoseconds in `ticks` of statsClock(), calibrated against the steady clock once
+inline double statsClockNs(uint64_t ticks) {
+    static const double ticksPerNs = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t start = steadyClockNs(), startTicks = statsClock(), now;
+        while ((now = steadyClockNs()) - start < 20000000) {}
+        return double(statsClock() - startTicks) / (now - start);
+#else
+        return 1.0;
+#endif
+    }();
+    return ticks / ticksPerNs;
+}
+
+// Counters of one worker, kept in its tracer so that no two threads share
+// one; the render adds them up at the end
+struct RenderStats {
+    uint64_t cameraRays = 0, secondaryRays = 0, shadowRays = 0;
+    uint64_t shapeTests[STATS_PRIM_TYPES] = {};  // by PrimitiveType; a mesh counts once per ray that reaches it
+    uint64_t pathDepth[STATS_DEPTHS] = {};       // paths by the bounce they ended at
+    uint64_t rouletteKills = 0;                  // paths ended by Russian roulette, or the depth limit
+    uint64_t glassReflections = 0, glassRefractions = 0;
+    uint64_t cacheHits = 0;                      // paths ended by the radiance cache
+    uint64_t resumeSkips = 0;                    // pixel samples a resumed render already had
+    uint64_t adaptiveSkips = 0;                  // tiles left out of adaptive rounds, summed over the rounds
+    uint64_t traceTicks = 0, renderTicks = 0;    // statsClock() ticks summed over the workers; shading is the difference
+    uint64_t saveNs = 0;                         // snapshots and the final image, on the render thread
+
+    RenderStats &operator+=(const RenderStats &o) {
+        cameraRays += o.cameraRays; secondaryRays += o.secondaryRays; shadowRays += o.shadowRays;
+        for (int i = 0; i < STATS_PRIM_TYPES; ++i) shapeTests[i] += o.shapeTests[i];
+        for (int i = 0; i < STATS_DEPTHS; ++i) pathDepth[i] += o.pathDepth[i];
+        rouletteKills += o.rouletteKills;
+        glassReflections += o.glassReflections; glassRefractions += o.glassRefractions;
+        cacheHits += o.cacheHits;
+        resumeSkips += o.resumeSkips; adaptiveSkips += o.adaptiveSkips;
+        traceTicks += o.traceTicks; renderTicks += o.renderTicks; saveNs += o.saveNs;
+        return *this;
+    }
+
+    void countDepth(int depth) { pathDepth[std::min(depth, STATS_DEPTHS - 1)]++; }
+
+    // Whether getRadiance times the queries of the path it starts
+    bool timesPath() const { return cameraRays % STATS_TIMING_PERIOD == 0; }
+
+    // Runs `f`, a ray query of a timed path, and adds its time to the tracing time
+    template <typename F>
+    auto traced(bool timed, F &&f) -> decltype(f()) {
+        if (!RENDER_STATS || !timed) return f();
+        uint64_t start = statsClock();
+        auto result = f();
+        traceTicks += (statsClock() - start) * STATS_TIMING_PERIOD;
+        return result;
+    }
+
+    // JSON report of a render that took `seconds`; the adaptive fields are
+    // only meaningful for an adaptive render
+    bool writeJSON(const std::string &path, double seconds, unsigned int threads, bool wavefront,
+                   uint64_t adaptiveSkippedSamples) const {
+        FILE *f = fopen(path.c_str(), "w");
+        if (!f) return false;
+        uint64_t rays = cameraRays + secondaryRays + shadowRays;
+        auto ms = [](uint64_t ticks) { return statsClockNs(ticks) * 1e-6; };
+        fprintf(f, "{\n  \"seconds\": %g,\n  \"threads\": %u,\n  \"integrator\": \"%s\",\n", seconds, threads,
+                wavefront ? "wavefront" : "iterative");
+        fprintf(f, "  \"rays\": {\"camera\": %llu, \"secondary\": %llu, \"shadow\": %llu, \"total\": %llu, \"per_second\": %g},\n",
+                (unsigned long long)cameraRays, (unsigned long long)secondaryRays, (unsigned long long)shadowRays,
+                (unsigned long long)rays, seconds > 0 ? rays / seconds : 0);
+        fprintf(f, "  \"intersection_tests\": {\"sphere\": %llu, \"box\": %llu, \"plane\": %llu, \"mesh\": %llu, \"other\": %llu},\n",
+                (unsigned long long)shapeTests[PRIM_SPHERE], (unsigned long long)shapeTests[PRIM_BOX],
+                (unsigned long long)shapeTests[PRIM_PLANE], (unsigned long long)shapeTests[PRIM_MESH],
+                (unsigned long long)shapeTests[PRIM_OTHER]);
+        fprintf(f, "  \"path_depth\": [");
+        for (int i = 0; i < STATS_DEPTHS; ++i) fprintf(f, i ? ", %llu" : "%llu", (unsigned long long)pathDepth[i]);
+        fprintf(f, "],\n  \"russian_roulette_terminations\": %llu,\n", (unsigned long long)rouletteKills);
+        fprintf(f, "  \"glass\": {\"reflected\": %llu, \"refracted\": %llu},\n", (unsigned long long)glassReflections,
+                (unsigned long long)glassRefractions);
+        fprintf(f, "  \"radiance_cache_hits\": %llu,\n", (unsigned long long)cacheHits);
+        fprintf(f, "  \"skips\": {\"resumed_samples\": %llu, \"adaptive_tile_rounds\": %llu, \"adaptive_samples\": %llu},\n",
+                (unsigned long long)resumeSkips, (unsigned long long)adaptiveSkips, (unsigned long long)adaptiveSkippedSamples);
+        fprintf(f, "  \"time_ms\": {\"trace\": %g, \"shade\": %g, \"save\": %g}\n}\n", ms(traceTicks),
+                ms(renderTicks > traceTicks ? renderTicks - traceTicks : 0), saveNs * 1e-6);
+        return fclose(f) == 0;
+    }
+};
+
+#endif // STATS_H
@@ -0,0 +1,136 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// A rectangular block of pixels, [x0, x1) x [y0, y1) in image coordinates,
+// and the samples to take in it: `passes` of them per pixel, starting at
+// sample index `firstPass`
+struct Tile {
+    int x0, y0, x1, y1;
+    unsigned int firstPass = 0, passes = 1;
+
+    unsigned int pixels() const { return (x1 - x0) * (y1 - y0); }
+};
+
+inline std::vector<Tile> makeTiles(int w, int h, int tileSize) {
+    std::vector<Tile> tiles;
+    for (int y = 0; y < h; y += tileSize) {
+        for (int x = 0; x < w; x += tileSize) {
+            tiles.push_back({x, y, std::min(x + tileSize, w), std::min(y + tileSize, h)});
+        }
+    }
+    return tiles;
+}
+
+// Fixed set of worker threads that render a list of tiles per call to run().
+// Every worker owns a deque of tile indices: it pops from the back of its own
+// deque and, once that runs dry, steals from the front of the other workers'.
+// Tiles never overlap, so workers can write their pixels without locking.
+struct ThreadPool {
+    typedef std::function<void(const Tile &, unsigned int)> TileFunc;
+
+    ThreadPool(unsigned int threads) : queues(std::max(1u, threads)) {
+        for (unsigned int i = 0; i < queues.size(); ++i) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : workers) t.join();
+    }
+
+    unsigned int size() const { return queues.size(); }
+
+    // Render all tiles with f(tile, workerIndex) and block until every tile is done
+    void run(const std::vector<Tile> &tiles_, const TileFunc &f) {
+        unsigned int n = queues.size();
+        for (unsigned int i = 0; i < n; ++i) {
+            // Hand out contiguous runs of tiles so neighbouring tiles stay on one core
+            std::lock_guard<std::mutex> guard(queues[i].lock);
+            for (size_t t = tiles_.size() * i / n; t < tiles_.size() * (i + 1) / n; ++t) {
+                queues[i].items.push_back(t);
+            }
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        tiles = &tiles_;
+        job = &f;
+        active = n;
+        ++generation;
+        wake.notify_all();
+        done.wait(guard, [this] { return active == 0; });
+        tiles = nullptr;
+        job = nullptr;
+    }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<size_t> items;
+    };
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake, done;
+    const std::vector<Tile> *tiles = nullptr;
+    const TileFunc *job = nullptr;
+    unsigned int active = 0;
+    unsigned long generation = 0;
+    bool stopping = false;
+
+    bool pop(unsigned int id, size_t &t) {
+        std::lock_guard<std::mutex> guard(queues[id].lock);
+        if (queues[id].items.empty()) return false;
+        t = queues[id].items.back();
+        queues[id].items.pop_back();
+        return true;
+    }
+
+    bool steal(unsigned int id, size_t &t) {
+        for (unsigned int k = 1; k < queues.size(); ++k) {
+            Queue &victim = queues[(id + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (victim.items.empty()) continue;
+            t = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned int id) {
+        unsigned long seen = 0;
+        while (true) {
+            const std::vector<Tile> *myTiles;
+            const TileFunc *myJob;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                myTiles = tiles;
+                myJob = job;
+            }
+            size_t t;
+            while (pop(id, t) || steal(id, t)) {
+                (*myJob)((*myTiles)[t], id);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if (--active == 0) done.notify_all();
+        }
+    }
+};
+
+#endif // THREADPOOL_H
@@ -2,159 +2,469 @@
 #define TRACER_H
 #include <vector>
 #include <cmath>
+#include <memory>
 #include "shapes.h"
 #include "ray.h"
 #include "vector.h"
+#include "sampler.h"
+#include "bvh.h"
+#include "simd.h"
+#include "scene.h"
+#include "stats.h"
+#include "policy.h"
+#include "radiancecache.h"
 
-extern bool EMITTER_SAMPLING;
+// Closest hit along a ray: the primitive id in the compiled scene, the
+// distance, and the triangle within a mesh
+struct Hit {
+    uint32_t prim;
+    Scalar t;
+    uint32_t sub;
+};
+
+// Shadow ray towards a point on a light, and what the light adds if nothing blocks it
+struct ShadowQuery {
+    Ray ray;
+    Scalar distance = 0;  // to the point on the light
+    uint32_t light = NO_PRIMITIVE;
+    Vector contribution;
+};
+
+// What a camera ray sees at its first hit, for the denoiser: the facing
+// normal, the surface colour (the emission, up to 1, on a light) and the
+// distance. All zero when the ray leaves the scene.
+struct SurfaceFeatures {
+    Vector normal, albedo;
+    Scalar depth = 0;
+};
 
 struct Tracer {
-    std::vector<Shape *> scene;
+    std::shared_ptr<const CompiledScene> scene;  // shared by the copies of this tracer on the other threads
     Vector cameraPos;  // Add this line
-    Tracer(const std::vector<Shape *> &scene_, const Vector &cameraPos_) 
-        : scene(scene_), cameraPos(cameraPos_) {}
+    const SimdKernels *kernels;
+    mutable BVHTraversalStats traversalStats;
+    mutable RenderStats stats;  // all zero unless built with RENDER_STATS
+    RadianceCache *radianceCache = nullptr;  // shared by the tracers of all threads; used with Policy::caching
+
+    Tracer(const std::shared_ptr<const CompiledScene> &scene_, const Vector &cameraPos_)
+        : scene(scene_), cameraPos(cameraPos_), kernels(&simdKernels()) {}
     // Tracer(const std::vector<Shape *> &scene_) : scene(scene_) {}
-    std::pair<Shape *, double> getIntersection(const Ray &r) const {
-        Shape *hitObj = nullptr;
-        double closest = 1e20f;
-        for (Shape *obj : scene) {
-            double distToHit = obj->intersects(r);
-            if (distToHit > 0 && distToHit < closest) {
-                hitObj = obj;
-                closest = distToHit;
+
+    // Intersection with a primitive that has no SIMD kernel
+    Scalar intersectOther(uint32_t id, const Ray &r, uint32_t &sub) const {
+        const PrimitiveRecord &prim = scene->primitives[id];
+        if (prim.type == PRIM_MESH) return scene->meshes[prim.index]->intersectsPrimitive(r, sub);
+        return scene->others[prim.index]->intersectsPrimitive(r, sub);
+    }
+
+    Hit getIntersection(const Ray &r) const {
+        const CompiledScene &s = *scene;
+        Hit hit = {NO_PRIMITIVE, 1e20f, 0};
+        int slot = kernels->planes(s.planes, 0, s.planeCount(), r, hit.t);
+        if (slot >= 0) hit.prim = slot;
+        if (RENDER_STATS) stats.shapeTests[PRIM_PLANE] += s.planeCount();
+        for (uint32_t id : s.otherUnbounded) {
+            if (RENDER_STATS) stats.shapeTests[s.primitives[id].type]++;
+            uint32_t sub;
+            Scalar distToHit = intersectOther(id, r, sub);
+            if (distToHit > 0 && distToHit < hit.t) {
+                hit = {id, distToHit, sub};
+            }
+        }
+        if (s.bvh.nodes.empty()) return hit;
+        traverseBVH(s.bvh.nodes.data(), r, hit.t, [&](uint32_t first, uint32_t count, Scalar &tmax) {
+            bool spheres = false, boxes = false;
+            for (uint32_t i = first; i < first + count; ++i) {
+                if (RENDER_STATS) stats.shapeTests[s.slotTypes[i]]++;
+                if (s.slotTypes[i] == PRIM_SPHERE) {
+                    spheres = true;
+                } else if (s.slotTypes[i] == PRIM_BOX) {
+                    boxes = true;
+                } else {
+                    uint32_t sub;
+                    Scalar distToHit = intersectOther(s.boundedBase + i, r, sub);
+                    if (distToHit > 0 && distToHit < tmax) {
+                        tmax = distToHit;
+                        hit = {s.boundedBase + i, distToHit, sub};
+                    }
+                }
+            }
+            // Slots of the other types are NaN in each pack, so whole leaves go to the kernels
+            if (spheres && (slot = kernels->spheres(s.spheres, first, count, r, tmax)) >= 0) hit = {s.boundedBase + slot, tmax, 0};
+            if (boxes && (slot = kernels->boxes(s.boxes, first, count, r, tmax)) >= 0) hit = {s.boundedBase + slot, tmax, 0};
+            return false;
+        }, traversalStats);
+        return hit;
+    }
+
+    // Any-hit query for shadow rays: does anything other than the light itself
+    // lie in front of the point on the light? Stops at the first blocker found.
+    bool occluded(const ShadowQuery &q) const {
+        const CompiledScene &s = *scene;
+        const Ray &r = q.ray;
+        Scalar tmax = q.distance;
+        if (RENDER_STATS) stats.shapeTests[PRIM_PLANE] += s.planeCount();
+        if (kernels->planes(s.planes, 0, s.planeCount(), r, tmax) >= 0) return true;
+        for (uint32_t id : s.otherUnbounded) {
+            if (RENDER_STATS) stats.shapeTests[s.primitives[id].type]++;
+            uint32_t sub;
+            Scalar distToHit = intersectOther(id, r, sub);
+            if (id != q.light && distToHit > 0 && distToHit < tmax) return true;
+        }
+        if (s.bvh.nodes.empty()) return false;
+        // BVH slot of the light, or past the end when it is unbounded
+        uint32_t lightSlot = q.light >= s.boundedBase ? q.light - s.boundedBase : UINT32_MAX;
+        bool blocked = false;
+        traverseBVH(s.bvh.nodes.data(), r, tmax, [&](uint32_t first, uint32_t count, Scalar &t) {
+            bool spheres = false, boxes = false;
+            bool light = lightSlot >= first && lightSlot < first + count;
+            for (uint32_t i = first; i < first + count && !blocked; ++i) {
+                if (RENDER_STATS && i != lightSlot) stats.shapeTests[s.slotTypes[i]]++;
+                Scalar distToHit = 0;
+                if (i == lightSlot) {
+                    continue;
+                } else if (s.slotTypes[i] == PRIM_SPHERE) {
+                    if (!light) { spheres = true; continue; }
+                    distToHit = sphereHit(r.origin.x, r.origin.y, r.origin.z, r.direction.x, r.direction.y, r.direction.z,
+                                          s.spheres.cx[i], s.spheres.cy[i], s.spheres.cz[i], s.spheres.r2[i]);
+                } else if (s.slotTypes[i] == PRIM_BOX) {
+                    if (!light) { boxes = true; continue; }
+                    distToHit = boxHit(s.boxes, i, r.origin.x, r.origin.y, r.origin.z, r.direction.x, r.direction.y, r.direction.z);
+                } else {
+                    uint32_t sub;
+                    distToHit = intersectOther(s.boundedBase + i, r, sub);
+                }
+                blocked = distToHit > 0 && distToHit < t;
+            }
+            // Leaves without the light go to the kernels whole; any hit short of the light blocks it
+            Scalar tk = t;
+            if (!blocked && spheres) blocked = kernels->spheres(s.spheres, first, count, r, tk) >= 0;
+            if (!blocked && boxes) blocked = kernels->boxes(s.boxes, first, count, r, tk) >= 0;
+            return blocked;
+        }, traversalStats);
+        return blocked;
+    }
+
+    // Closest hits of up to SIMD_WIDTH coherent rays (neighbouring camera rays,
+    // say). The packet walks the BVH together, entering every node that any of
+    // its rays enters, and each primitive is tested against all rays at once.
+    void getIntersectionPacket(const Ray *rays, int n, Hit *hits) const {
+        const CompiledScene &s = *scene;
+        RayPacket packet(rays, n);
+        // Copies the packet's new closest hits into `hits`, then clears the slot markers
+        auto collect = [&](uint32_t base) {
+            for (int k = 0; k < n; ++k) {
+                if (packet.hit[k] >= 0) hits[k] = {base + packet.hit[k], packet.tmax[k], 0};
+                packet.hit[k] = -1;
+            }
+        };
+        auto testOther = [&](uint32_t id) {
+            for (int k = 0; k < n; ++k) {
+                uint32_t sub;
+                Scalar distToHit = intersectOther(id, rays[k], sub);
+                if (distToHit > 0 && distToHit < packet.tmax[k]) {
+                    packet.tmax[k] = distToHit;
+                    hits[k] = {id, distToHit, sub};
+                }
+            }
+        };
+
+        for (int k = 0; k < n; ++k) hits[k] = {NO_PRIMITIVE, packet.tmax[k], 0};
+        if (RENDER_STATS) stats.shapeTests[PRIM_PLANE] += n * s.planeCount();
+        for (uint32_t id : s.otherUnbounded) {
+            if (RENDER_STATS) stats.shapeTests[s.primitives[id].type] += n;
+        }
+        for (size_t slot = 0; slot < s.planeCount(); ++slot) kernels->planePacket(s.planes, slot, packet);
+        collect(0);
+        for (uint32_t id : s.otherUnbounded) testOther(id);
+        if (s.bvh.nodes.empty()) return;
+
+        Scalar org[SIMD_WIDTH][3], inv[SIMD_WIDTH][3];
+        for (int k = 0; k < n; ++k) {
+            org[k][0] = rays[k].origin.x; org[k][1] = rays[k].origin.y; org[k][2] = rays[k].origin.z;
+            inv[k][0] = 1 / rays[k].direction.x; inv[k][1] = 1 / rays[k].direction.y; inv[k][2] = 1 / rays[k].direction.z;
+        }
+        uint32_t stack[BVH_MAX_DEPTH];
+        int sp = 0;
+        uint32_t cur = 0;
+        while (true) {
+            const BVHNode &node = s.bvh.nodes[cur];
+            bool entered = false;
+            for (int k = 0; k < n && !entered; ++k) entered = hitsBox(node, org[k], inv[k], packet.tmax[k]);
+            if (entered) {
+                if (node.count > 0) {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                        if (RENDER_STATS) stats.shapeTests[s.slotTypes[i]] += n;
+                        if (s.slotTypes[i] == PRIM_SPHERE) {
+                            kernels->spherePacket(s.spheres, i, packet);
+                        } else if (s.slotTypes[i] == PRIM_BOX) {
+                            kernels->boxPacket(s.boxes, i, packet);
+                        } else {
+                            testOther(s.boundedBase + i);
+                        }
+                        collect(s.boundedBase);
+                    }
+                } else {
+                    // Order the children by the first ray; the rays of a packet point roughly the same way
+                    if (inv[0][node.axis] < 0) {
+                        stack[sp++] = cur + 1;
+                        cur = node.offset;
+                    } else {
+                        stack[sp++] = node.offset;
+                        cur = cur + 1;
+                    }
+                    continue;
+                }
             }
+            if (sp == 0) break;
+            cur = stack[--sp];
         }
-        return std::make_pair(hitObj, closest);
     }
 
-    Vector refract(const Vector &I, const Vector &N, const float &ior) const { 
-        float cosi = std::max(-1.0, std::min(1.0, I.dot(N)));
-        float etai = 1, etat = ior;
+    Vector refract(const Vector &I, const Vector &N, Scalar ior) const {
+        Scalar cosi = std::max<Scalar>(-1, std::min<Scalar>(1, I.dot(N)));
+        Scalar etai = 1, etat = ior;
         Vector n = N;
         if (cosi < 0) { cosi = -cosi; } else { std::swap(etai, etat); n = -N; }
-        float eta = etai / etat;
-        float k = 1 - eta * eta * (1 - cosi * cosi);
-        return k < 0 ? 0 : I * eta + n * (eta * cosi - sqrtf(k));
+        Scalar eta = etai / etat;
+        Scalar k = 1 - eta * eta * (1 - cosi * cosi);
+        return k < 0 ? Vector() : I * eta + n * (eta * cosi - std::sqrt(k));
     }
 
     Vector reflect (const Vector &I, const Vector &N) {
         return I - N * 2 * I.dot(N);
     }
 
-    float fresnel(const Vector &I, const Vector &N, const float &ior)
+    Scalar fresnel(const Vector &I, const Vector &N, Scalar ior)
     {
-        float cosi = std::max(-1.0, std::min(1.0, I.dot(N)));
-        float etai = 1, etat = ior;
+        Scalar cosi = std::max<Scalar>(-1, std::min<Scalar>(1, I.dot(N)));
+        Scalar etai = 1, etat = ior;
         if (cosi > 0) {  std::swap(etai, etat); }
         // Compute sini using Snell's law
-        float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
+        Scalar sint = etai / etat * std::sqrt(std::max<Scalar>(0, 1 - cosi * cosi));
         // Total internal reflection
         if (sint >= 1) {
             return 1;
         }
         else {
-            float cost = sqrtf(std::max(0.f, 1 - sint * sint));
-            cosi = fabsf(cosi);
-            float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
-            float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+            Scalar cost = std::sqrt(std::max<Scalar>(0, 1 - sint * sint));
+            cosi = std::fabs(cosi);
+            Scalar Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+            Scalar Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
             return (Rs * Rs + Rp * Rp) / 2;
         }
         // As a consequence of the conservation of energy, transmittance is given by:
         // kt = 1 - kr;
     }
 
-    Vector getRadiance(const Ray &r, int depth) {
-        auto result = getIntersection(r);
-        Shape *hitObj = result.first;
-        if (!hitObj) return Vector();  // Return black if no intersection
-        if (hitObj->emit.max() > 0) return hitObj->emit;  // Return the emission of the object if it is an emitter
+    // The steps of one bounce, shared by getRadiance and the wavefront integrator.
 
-        double U = drand48();
-        double terminationProbability = hitObj->color.max();  // the Russian roulette is based on the maximum color component
+    // Russian roulette on the colour at the hit point: surviving paths are
+    // divided by the survival probability, so the estimate stays unbiased.
+    // Moves the sampler to the bounce's dimensions (see sampler.h) and always
+    // draws the roulette sample; returns false when the path ends.
+    bool survive(int depth, Vector &color, Sampler &sampler) const {
+        sampler.startBounce(depth);
+        double U = sampler.get1D();
         if (depth > 4) {
-            if (depth > 10 || U > terminationProbability) {
-                return Vector();
+            Scalar survival = std::min<Scalar>(1, color.max());
+            if (depth > 10 || U >= survival) {
+                if (RENDER_STATS) stats.rouletteKills++;
+                return false;
             }
-            // Scale the radiance by the survival probability to maintain energy conservation
-            hitObj->color = hitObj->color / terminationProbability;
+            color = color / survival;
         }
+        return true;
+    }
 
-        // if (depth > 0) return Vector();
-
-        Vector hitPos = r.origin + r.direction * result.second;
-        Vector normal = hitObj->getNormal(hitPos);
-        if (normal.dot(r.direction) > 0) {
+    // Surface normal at a hit, flipped to face the incoming ray
+    Vector facingNormal(const Hit &hit, const Ray &ray, const Vector &hitPos) const {
+        Vector normal = scene->normal(hit.prim, hitPos, hit.sub);
+        if (normal.dot(ray.direction) > 0) {
             normal = normal * -1;
         }
-        Vector color = hitObj->getColor(hitPos);
-        Vector lightSampling;
-        if (hitObj->material == MIRROR) {
-            // Calculate reflection direction
-            Vector reflectionDirection = (reflect(r.direction, normal)).normalize();
-            // Get radiance along the reflection direction
-            return hitObj->emit + color * getRadiance(Ray(hitPos, reflectionDirection), depth + 1);
-        }
+        return normal;
+    }
+
+    // The SurfaceFeatures of a camera ray's hit with the given colour
+    void describeHit(const Hit &hit, const Ray &ray, const Vector &hitPos, Vector color, SurfaceFeatures &f) const {
+        f.normal = facingNormal(hit, ray, hitPos);
+        f.albedo = color.clamp();
+        f.depth = hit.t;
+    }
+
+    Ray mirrorRay(const Ray &ray, const Vector &hitPos, const Vector &normal) {
+        return Ray(offsetOrigin(hitPos, normal), reflect(ray.direction, normal).normalize());
+    }
+
+    // Follows the reflection with probability kr, otherwise the refraction; the
+    // weights kr and 1 - kr cancel against the choice probabilities
+    Ray glassRay(const Ray &ray, const Vector &hitPos, const Vector &normal, Sampler &sampler) {
+        // set a fixed IOR for all glass
+        Scalar ior = 2;
+        Scalar kr = fresnel(ray.direction, normal, ior);
+        sampler.seekBounce(DIM_CHOICE);
+        bool reflected = sampler.get1D() < kr;
+        Vector direction = reflected ? reflect(ray.direction, normal).normalize() : refract(ray.direction, normal, ior).normalize();
+        if (RENDER_STATS) (reflected ? stats.glassReflections : stats.glassRefractions)++;
+        // Offset the origin slightly off the surface, on the side the ray leaves from
+        Scalar offset = std::max<Scalar>(EPSILON, selfHitOffset(hitPos));
+        Vector origin = (direction.dot(normal) < 0) ? hitPos - normal * offset : hitPos + normal * offset;
+        return Ray(origin, direction);
+    }
+
+    // Cosine-weighted bounce into the hemisphere around the normal
+    Ray diffuseRay(const Vector &hitPos, const Vector &normal, Sampler &sampler) const {
+        sampler.seekBounce(DIM_DIRECTION);
+        Scalar angle = 2 * M_PI * sampler.get1D();
+        Scalar dist_cen = std::sqrt(Scalar(sampler.get1D()));
+        Vector u, v;
+        tangentFrame(normal, u, v);
+        Vector d = (u * std::cos(angle) * dist_cen + v * std::sin(angle) * dist_cen + normal * std::sqrt(1 - dist_cen * dist_cen)).normalize();
+        return Ray(offsetOrigin(hitPos, normal), d);
+    }
+
+    // The density per unit solid angle with which diffuseRay draws `direction`
+    static Scalar diffusePdf(const Vector &direction, const Vector &normal) {
+        return std::max<Scalar>(0, direction.dot(normal)) * M_1_PI;
+    }
+
+    // Power heuristic weight of a sample drawn with density `pdf` against
+    // another strategy that has density `other` for it (Veach 1997)
+    static Scalar powerHeuristic(Scalar pdf, Scalar other) {
+        if (std::isinf(pdf)) return 1;
+        return pdf * pdf / (pdf * pdf + other * other);
+    }
 
-        else if (hitObj->material == GLASS) {
-            
-            // set a fixed IOR for all glass
-            double ior = 2;
-            
-            // Calculate reflection direction and refraction direction
-            Vector reflectionDirection = (reflect(r.direction, normal)).normalize();
-            Vector refractionDirection = (refract(r.direction, normal, ior)).normalize();
-
-            // Compute reflection and refraction ray origins (offset the ray slightly off the surface along the surface normal)
-            Vector reflectionOrigin = (reflectionDirection.dot(normal) < 0) ? hitPos - normal * EPSILON : hitPos + normal * EPSILON;
-            Vector refractionOrigin = (refractionDirection.dot(normal) < 0) ? hitPos - normal * EPSILON : hitPos + normal * EPSILON;
-
-            // Compute reflection and refraction colors
-            Vector reflectionColor = getRadiance(Ray(reflectionOrigin, reflectionDirection), depth + 1);
-            Vector refractionColor = getRadiance(Ray(refractionOrigin, refractionDirection), depth + 1);
-
-            // Use Fresnel equation to compute the ratio of reflection and refraction
-            float kr = fresnel(r.direction, normal, ior);
-            return hitObj->emit + color * (reflectionColor * kr + refractionColor * (1 - kr));
+    // Picks a light in proportion to its power and a direction toward it (see
+    // CompiledScene::sampleLight), and sets up the shadow ray. Returns false if
+    // there is no light or the direction is behind the surface. The direct
+    // light is one half of a multiple importance sampling estimate: it is
+    // weighted against the chance that the diffuse bounce finds the same
+    // light, whose emission is weighted the other way (emissionWeight).
+    bool connectLight(const Vector &hitPos, const Vector &normal, Sampler &sampler, ShadowQuery &q) const {
+        if (scene->lights.empty()) return false;
+        double pmf;
+        sampler.seekBounce(DIM_CHOICE);
+        q.light = scene->lights.sample(sampler.get1D(), pmf);
+        LightSample s;
+        if (!scene->sampleLight(q.light, hitPos, sampler, s)) return false;
+        Scalar wi = s.direction.dot(normal);
+        if (!(wi > 0)) return false;
+        q.ray = Ray(offsetOrigin(hitPos, normal), s.direction);
+        q.distance = s.distance;
+        Scalar lightPdf = pmf * s.pdf;
+        q.contribution = scene->material(q.light).emit * (wi * M_1_PI / lightPdf * powerHeuristic(lightPdf, diffusePdf(s.direction, normal)));
+        if (scene->primitives[q.light].type == PRIM_MESH) {
+            // A mesh can hide the point behind its own nearer triangles, so it
+            // is tested like any other surface, up to just short of the point.
+            // The triangle the point is on is found again only to within
+            // EPSILON, or in a float build some 16 self-hit offsets when the
+            // ray grazes it.
+            q.distance -= std::max<Scalar>(EPSILON, 16 * selfHitOffset(hitPos + s.direction * s.distance));
+            q.light = NO_PRIMITIVE;
         }
+        return true;
+    }
 
-        else {
-            if (EMITTER_SAMPLING) {
-                for (Shape *light : scene) {
-                    if (light->emit.max() == 0) continue;  // Skip non-emissive objects
-
-                    Vector lightPos = light->randomPoint();
-                    Vector lightDirection = (lightPos - hitPos).normalize();
-                    Ray rayToLight = Ray(hitPos, lightDirection);
-                    auto lightHit = getIntersection(rayToLight);
-                    if (light == lightHit.first) {
-                        double wi = lightDirection.dot(normal);
-                        if (wi > 0) {
-                            double srad = 1.5;
-                            double cos_a_max = sqrt(1 - srad * srad / (hitPos - lightPos).dot(hitPos - lightPos));
-                            double omega = 2 * M_PI * (1 - cos_a_max);
-                            lightSampling += light->emit * wi * omega * M_1_PI;
-                        }
-                    }
+    // The weight of the emission that `ray` finds at `hit`. `bouncePdf` is
+    // the density of the diffuse bounce that made the ray, or 0 after the
+    // camera or a mirror or glass surface, which connectLight cannot stand in for.
+    Scalar emissionWeight(const Hit &hit, const Ray &ray, Scalar bouncePdf) const {
+        if (bouncePdf == 0) return 1;
+        Scalar pmf = scene->lights.pmf(hit.prim);
+        if (pmf == 0) return 1;
+        return powerHeuristic(bouncePdf, pmf * scene->lightPdf(hit.prim, ray.origin, ray.direction, hit.t, hit.sub));
+    }
+
+    // With Policy::caching, at a diffuse hit: once the path has made
+    // RadianceCache::lookupAfter diffuse bounces, finds the hit's cell in the
+    // radiance cache and, if the cell's estimate is good enough, adds the
+    // light the surface reflects by that estimate. True when the path ends
+    // there. Hits before that are not looked up, and do not train their cells.
+    bool cachedRadiance(const Vector &hitPos, const Vector &normal, const Vector &color, const Vector &throughput,
+                        CachePath &path, Vector &radiance) {
+        path.cell = RadianceCache::NO_CELL;
+        if (path.diffuseBounces < radianceCache->lookupAfter) return false;
+        path.cell = radianceCache->cell(hitPos, normal);
+        Vector cached;
+        if (!radianceCache->lookup(path.cell, cached)) return false;
+        if (RENDER_STATS) stats.cacheHits++;
+        radiance += throughput * color * cached;
+        path.add(color * cached);
+        return true;
+    }
+
+    // Iterative path tracer. The path carries its throughput (the product of
+    // the surface colours so far) instead of recursing, and glass picks either
+    // the reflected or the refracted ray with the Fresnel probability, so a
+    // sample costs at most one path of 11 intersections plus its shadow rays.
+    // The render modes come from `Policy` (see policy.h); with Policy::features
+    // the first hit is described in `*features`.
+    template <typename Policy = DefaultTracePolicy>
+    Vector getRadiance(const Ray &r, Sampler &sampler, SurfaceFeatures *features = nullptr) {
+        Vector radiance, throughput(1, 1, 1);
+        Ray ray = r;
+        Scalar bouncePdf = 0;  // of the diffuse bounce that made `ray`, for emissionWeight
+        CachePath cachePath;   // with Policy::caching
+        bool timed = RENDER_STATS && stats.timesPath();
+        int depth = 0;
+        for (; ; ++depth) {
+            if (RENDER_STATS) (depth == 0 ? stats.cameraRays : stats.secondaryRays)++;
+            Hit result = stats.traced(timed, [&] { return getIntersection(ray); });
+            if (result.prim == NO_PRIMITIVE) break;  // Black if no intersection
+            const MaterialRecord &hitMat = scene->material(result.prim);
+            Vector hitPos = ray.origin + ray.direction * result.t;
+            if (hitMat.emit.max() > 0) {  // Emitters end the path
+                if constexpr (Policy::features) {
+                    if (depth == 0) describeHit(result, ray, hitPos, hitMat.emit, *features);
                 }
+                Scalar weight = 1;
+                if constexpr (Policy::emitterSampling) weight = emissionWeight(result, ray, bouncePdf);
+                radiance += throughput * hitMat.emit * weight;
+                if constexpr (Policy::caching) cachePath.add(hitMat.emit * weight);
+                break;
             }
 
-            double angle = 2 * M_PI * drand48();
-            double dist_cen = sqrt(drand48());
-            Vector u;
-            if (fabs(normal.x) > 0.1) {
-                u = Vector(0, 1, 0);
-            } else {
-                u = Vector(1, 0, 0);
+            Vector color = scene->color(hitMat, hitPos);
+            if constexpr (Policy::features) {
+                if (depth == 0) describeHit(result, ray, hitPos, color, *features);
             }
-            u = u.cross(normal).normalize();
-            Vector v = normal.cross(u);
-            Vector d = (u * cos(angle) * dist_cen + v * sin(angle) * dist_cen + normal * sqrt(1 - dist_cen * dist_cen)).normalize();
-            Vector reflected = getRadiance(Ray(hitPos, d), depth + 1);
-            if (!EMITTER_SAMPLING || depth == 0) {
-                return hitObj->emit + color * lightSampling + color * reflected;
+            if (!survive(depth, color, sampler)) break;
+            Vector normal = facingNormal(result, ray, hitPos);
+
+            if (Policy::materials == ALL_MATERIALS && hitMat.type == MIRROR) {
+                ray = mirrorRay(ray, hitPos, normal);
+                bouncePdf = 0;
+                if constexpr (Policy::caching) cachePath.bounce(color);
+            } else if (Policy::materials == ALL_MATERIALS && hitMat.type == GLASS) {
+                ray = glassRay(ray, hitPos, normal, sampler);
+                bouncePdf = 0;
+                if constexpr (Policy::caching) cachePath.bounce(color);
+            } else {
+                if constexpr (Policy::caching) {
+                    if (cachedRadiance(hitPos, normal, color, throughput, cachePath, radiance)) break;
+                    cachePath.bounce(color);
+                    cachePath.record();
+                }
+                if constexpr (Policy::emitterSampling) {
+                    ShadowQuery shadow;
+                    if (connectLight(hitPos, normal, sampler, shadow)) {
+                        if (RENDER_STATS) stats.shadowRays++;
+                        if (!stats.traced(timed, [&] { return occluded(shadow); })) {
+                            radiance += throughput * color * shadow.contribution;
+                            if constexpr (Policy::caching) cachePath.add(shadow.contribution);
+                        }
+                    }
+                }
+                ray = diffuseRay(hitPos, normal, sampler);
+                bouncePdf = diffusePdf(ray.direction, normal);
             }
-            return color * lightSampling + color * reflected;
+            throughput = throughput * color;
         }
+        if constexpr (Policy::caching) cachePath.commit(*radianceCache);
+        if (RENDER_STATS) stats.countDepth(depth);
+        return radiance;
     }
 
 };
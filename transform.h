@@ -0,0 +1,147 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+#include <memory>
+#include "vector.h"
+#include "ray.h"
+#include "sampler.h"
+#include "shapes.h"
+#include "bvh.h"
+
+// Affine transform p' = A p + t, stored as a 3x4 matrix together with its
+// inverse. Both are built from the factors (translation, scale, rotation),
+// whose inverses are known, so nothing is inverted or recomputed per ray.
+struct Transform {
+    Scalar m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};    // object to world
+    Scalar inv[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};  // world to object
+
+    static Transform translate(const Vector &t) {
+        Transform r;
+        r.m[0][3] = t.x; r.m[1][3] = t.y; r.m[2][3] = t.z;
+        r.inv[0][3] = -t.x; r.inv[1][3] = -t.y; r.inv[2][3] = -t.z;
+        return r;
+    }
+
+    static Transform scale(const Vector &s) {
+        Transform r;
+        r.m[0][0] = s.x; r.m[1][1] = s.y; r.m[2][2] = s.z;
+        r.inv[0][0] = 1 / s.x; r.inv[1][1] = 1 / s.y; r.inv[2][2] = 1 / s.z;
+        return r;
+    }
+
+    // By `angle` radians about `axis`, counter-clockwise looking down the axis
+    static Transform rotate(const Vector &axis, Scalar angle) {
+        Vector a = axis.normalize();
+        Scalar s = sin(angle), c = cos(angle), k = 1 - c;
+        Scalar R[3][3] = {{c + a.x * a.x * k, a.x * a.y * k - a.z * s, a.x * a.z * k + a.y * s},
+                          {a.y * a.x * k + a.z * s, c + a.y * a.y * k, a.y * a.z * k - a.x * s},
+                          {a.z * a.x * k - a.y * s, a.z * a.y * k + a.x * s, c + a.z * a.z * k}};
+        Transform r;
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                r.m[i][j] = R[i][j];
+                r.inv[i][j] = R[j][i];  // a rotation's inverse is its transpose
+            }
+        }
+        return r;
+    }
+
+    // This transform followed by `next`
+    Transform then(const Transform &next) const {
+        Transform r;
+        multiply(next.m, m, r.m);
+        multiply(inv, next.inv, r.inv);
+        return r;
+    }
+
+    Vector point(const Vector &p) const { return apply(m, p, 1); }
+    Vector vector(const Vector &v) const { return apply(m, v, 0); }
+    Vector inversePoint(const Vector &p) const { return apply(inv, p, 1); }
+    Vector inverseVector(const Vector &v) const { return apply(inv, v, 0); }
+
+    // Normals go through the transposed inverse, which keeps them
+    // perpendicular to the surface under scaling; not normalised
+    Vector normal(const Vector &n) const {
+        return Vector(inv[0][0] * n.x + inv[1][0] * n.y + inv[2][0] * n.z,
+                      inv[0][1] * n.x + inv[1][1] * n.y + inv[2][1] * n.z,
+                      inv[0][2] * n.x + inv[1][2] * n.y + inv[2][2] * n.z);
+    }
+
+    // Box around the transformed corners of `box`
+    AABB bounds(const AABB &box) const {
+        AABB r;
+        for (int i = 0; i < 8; ++i) r.grow(point(Vector(i & 1 ? box.hi.x : box.lo.x, i & 2 ? box.hi.y : box.lo.y, i & 4 ? box.hi.z : box.lo.z)));
+        return r;
+    }
+
+private:
+    static Vector apply(const Scalar a[3][4], const Vector &p, Scalar w) {
+        return Vector(a[0][0] * p.x + a[0][1] * p.y + a[0][2] * p.z + a[0][3] * w,
+                      a[1][0] * p.x + a[1][1] * p.y + a[1][2] * p.z + a[1][3] * w,
+                      a[2][0] * p.x + a[2][1] * p.y + a[2][2] * p.z + a[2][3] * w);
+    }
+
+    // out = a after b
+    static void multiply(const Scalar a[3][4], const Scalar b[3][4], Scalar out[3][4]) {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j] + (j == 3 ? a[i][3] : 0);
+            }
+        }
+    }
+};
+
+// A shape placed in the scene by a transform, with its own material. The
+// base geometry is shared: any number of instances can refer to one mesh,
+// which is stored (and its BVH built) once. A ray is moved into the base's
+// space rather than the geometry into the world. The shapes expect unit
+// directions, so the ray is renormalised there and the distance scaled back.
+//
+// The scene treats an instance as a shape of unknown type, so an emissive
+// instance lights what it is seen from but is not sampled as a light.
+struct Instance : Shape {
+    std::shared_ptr<const Shape> base;
+    Transform transform;
+
+    Instance(const std::shared_ptr<const Shape> &base_, const Transform &transform_, const Vector &color_, const Vector &emit_,
+             Material material_)
+        : Shape(color_, emit_, material_), base(base_), transform(transform_) {}
+
+    // The ray in the base's space, and the world distance per unit of distance there
+    Ray toObject(const Ray &r, Scalar &scale) const {
+        Vector d = transform.inverseVector(r.direction);
+        Scalar length = std::sqrt(d.dot(d));
+        scale = 1 / length;
+        return Ray(transform.inversePoint(r.origin), d / length);
+    }
+
+    Scalar intersects(const Ray &r) const override {
+        Scalar scale;
+        return base->intersects(toObject(r, scale)) * scale;
+    }
+
+    Scalar intersectsPrimitive(const Ray &r, uint32_t &prim) const override {
+        Scalar scale;
+        return base->intersectsPrimitive(toObject(r, scale), prim) * scale;
+    }
+
+    Vector getNormal(const Vector &p) const override {
+        return transform.normal(base->getNormal(transform.inversePoint(p))).normalize();
+    }
+
+    Vector getPrimitiveNormal(const Vector &p, uint32_t prim) const override {
+        return transform.normal(base->getPrimitiveNormal(transform.inversePoint(p), prim)).normalize();
+    }
+
+    Vector randomPoint(Sampler &sampler) const override { return transform.point(base->randomPoint(sampler)); }
+
+    bool getBounds(AABB &box) const override {
+        AABB local;
+        if (!base->getBounds(local)) return false;
+        box = transform.bounds(local);
+        return true;
+    }
+};
+
+#endif // TRANSFORM_H
@@ -3,37 +3,54 @@
 
 #include <cmath>
 
-struct Vector {
-    double x, y, z;
-    Vector(const Vector &o) : x(o.x), y(o.y), z(o.z) {}
-    Vector(double x_=0, double y_=0, double z_=0) : x(x_), y(y_), z(z_) {}
-    inline Vector operator+(const Vector &o) const { return Vector(x + o.x, y + o.y, z + o.z); }
-    inline Vector &operator+=(const Vector &rhs) { x += rhs.x; y += rhs.y; z += rhs.z; return *this; }
-    inline Vector operator-(const Vector &o) const { return Vector(x - o.x, y - o.y, z - o.z); }
-    inline Vector operator-() const { return Vector(-x, -y, -z); }  // Unary minus operator
-    inline Vector operator*(const Vector &o) const { return Vector(x * o.x, y * o.y, z * o.z); }
-    inline Vector operator/(double o) const { return Vector(x / o, y / o, z / o); }
-    inline Vector operator*(double o) const { return Vector(x * o, y * o, z * o); }
-    inline double dot(const Vector &o) const { return x * o.x + y * o.y + z * o.z; }
-    inline Vector normalize() const { return *this * (1 / sqrt(x * x + y * y + z * z)); } // Marked as const
-    inline Vector cross(const Vector &o) const { return Vector(y * o.z - z * o.y, z * o.x - x * o.z, x * o.y - y * o.x); }
-    inline double min() const { return fmin(x, fmin(y, z)); } // Marked as const
-    inline double max() const { return fmax(x, fmax(y, z)); } // Marked as const
-    inline Vector &abs() { x = fabs(x); y = fabs(y); z = fabs(z); return *this; }
-    inline Vector &clamp() {
-        auto clampDouble = [](double x) {
-            if (x < 0) return 0.0;
-            if (x > 1) return 1.0;
+// Scalar type of the geometry: vectors, rays, hit distances, the SIMD packs
+// and the integrator's arithmetic. Build with -DRENDER_PRECISION=float for
+// the single-precision renderer, which fits twice the lanes in a SIMD
+// register and halves the size of the scene data.
+#ifndef RENDER_PRECISION
+#define RENDER_PRECISION double
+#endif
+
+template <typename T>
+struct VectorT {
+    T x, y, z;
+    VectorT(const VectorT &o) : x(o.x), y(o.y), z(o.z) {}
+    VectorT(T x_=0, T y_=0, T z_=0) : x(x_), y(y_), z(z_) {}
+    VectorT &operator=(const VectorT &o) = default;
+    // Between precisions, for values that cross from double-precision code (the camera, say)
+    template <typename U>
+    explicit VectorT(const VectorT<U> &o) : x(T(o.x)), y(T(o.y)), z(T(o.z)) {}
+    inline VectorT operator+(const VectorT &o) const { return VectorT(x + o.x, y + o.y, z + o.z); }
+    inline VectorT &operator+=(const VectorT &rhs) { x += rhs.x; y += rhs.y; z += rhs.z; return *this; }
+    inline VectorT operator-(const VectorT &o) const { return VectorT(x - o.x, y - o.y, z - o.z); }
+    inline VectorT operator-() const { return VectorT(-x, -y, -z); }  // Unary minus operator
+    inline VectorT operator*(const VectorT &o) const { return VectorT(x * o.x, y * o.y, z * o.z); }
+    inline VectorT operator/(T o) const { return VectorT(x / o, y / o, z / o); }
+    inline VectorT operator*(T o) const { return VectorT(x * o, y * o, z * o); }
+    inline T dot(const VectorT &o) const { return x * o.x + y * o.y + z * o.z; }
+    inline VectorT normalize() const { return *this * (1 / std::sqrt(x * x + y * y + z * z)); } // Marked as const
+    inline VectorT cross(const VectorT &o) const { return VectorT(y * o.z - z * o.y, z * o.x - x * o.z, x * o.y - y * o.x); }
+    inline T min() const { return std::fmin(x, std::fmin(y, z)); } // Marked as const
+    inline T max() const { return std::fmax(x, std::fmax(y, z)); } // Marked as const
+    inline VectorT &abs() { x = std::fabs(x); y = std::fabs(y); z = std::fabs(z); return *this; }
+    inline VectorT &clamp() {
+        auto clampScalar = [](T x) {
+            if (x < 0) return T(0);
+            if (x > 1) return T(1);
             return x;
         };
-        x = clampDouble(x); y = clampDouble(y); z = clampDouble(z);
+        x = clampScalar(x); y = clampScalar(y); z = clampScalar(z);
         return *this;
     }
+
+    // Overloaded operator for multiplying a scalar with a Vector; a friend, so
+    // that a double constant still converts when T is float
+    friend inline VectorT operator*(T scalar, const VectorT &vec) {
+        return VectorT(vec.x * scalar, vec.y * scalar, vec.z * scalar);
+    }
 };
 
-// Overloaded operator for multiplying a float with a Vector
-inline Vector operator*(double scalar, const Vector &vec) {
-    return Vector(vec.x * scalar, vec.y * scalar, vec.z * scalar);
-}
+typedef RENDER_PRECISION Scalar;
+typedef VectorT<Scalar> Vector;
 
 #endif // VECTOR_H
@@ -0,0 +1,226 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <vector>
+#include <cstdint>
+#include "vector.h"
+#include "ray.h"
+#include "sampler.h"
+#include "scene.h"
+#include "tracer.h"
+
+// Wavefront (stream) integrator. Instead of following one path to the end,
+// it keeps a queue of paths (a tile's worth) and runs each stage over the
+// whole queue before the next: extend (intersect), classify (emitters,
+// Russian roulette, sort by material), shade per material, then trace the
+// shadow rays and accumulate. Every stage keeps its own code and data hot,
+// and the camera rays of the first extend go through the packet traversal.
+//
+// A path remembers how many sampling dimensions it has used, so it draws
+// exactly the numbers Tracer::getRadiance would and the image is the same.
+struct PathState {
+    Ray ray;
+    Vector throughput, radiance;
+    Hit hit = {NO_PRIMITIVE, 0, 0};
+    Vector hitPos, normal, color;  // of the current hit, set by classify
+    ShadowQuery shadow;  // of a diffuse hit, traced by connect
+    Scalar bouncePdf = 0;  // of the diffuse bounce that made `ray`, for Tracer::emissionWeight
+    CachePath cache;  // with Policy::caching
+    SurfaceFeatures features;  // of the first hit, recorded with Policy::features
+    unsigned int pixel, dimension;
+    unsigned int rays = 0;  // traced so far, counted only with RENDER_STATS
+};
+
+struct WavefrontIntegrator {
+    std::vector<PathState> paths;
+    std::vector<uint32_t> active, next;          // path indices, in pixel order
+    std::vector<uint32_t> diffuse, mirror, glass;  // material queues of the current bounce
+    std::vector<uint32_t> shadows;  // paths with a shadow ray to trace
+
+    void clear() { paths.clear(); }
+
+    // Queues a camera ray; `sampler` is positioned on the pixel's sample and
+    // has already drawn the numbers for the ray
+    void addPath(unsigned int pixel, const Ray &ray, const Sampler &sampler) {
+        PathState p;
+        p.ray = ray;
+        p.throughput = Vector(1, 1, 1);
+        p.pixel = pixel;
+        p.dimension = sampler.dimension;
+        paths.push_back(p);
+    }
+
+    // Runs all queued paths to completion; the result is in each path's `radiance`
+    template <typename Policy = DefaultTracePolicy>
+    void trace(Tracer &tracer, Sampler &sampler, unsigned int pass) {
+        active.clear();
+        for (uint32_t i = 0; i < paths.size(); ++i) active.push_back(i);
+        for (int depth = 0; !active.empty(); ++depth) {
+            extend(tracer, depth == 0);
+            classify<Policy>(tracer, sampler, pass, depth);
+            if (Policy::materials == ALL_MATERIALS) {
+                shadeMirror<Policy>(tracer);
+                shadeGlass<Policy>(tracer, sampler, pass);
+            }
+            shadeDiffuse<Policy>(tracer, sampler, pass);
+            connect<Policy>(tracer);
+            active.swap(next);
+        }
+        if constexpr (Policy::caching) {
+            for (const PathState &p : paths) p.cache.commit(*tracer.radianceCache);
+        }
+    }
+
+private:
+    static void resume(Sampler &sampler, unsigned int pass, const PathState &p) {
+        sampler.startPixelSample(p.pixel, pass);
+        sampler.dimension = p.dimension;
+    }
+
+    void extend(Tracer &tracer, bool coherent) {
+        uint64_t start = RENDER_STATS ? statsClock() : 0;
+        if (RENDER_STATS) {
+            (coherent ? tracer.stats.cameraRays : tracer.stats.secondaryRays) += active.size();
+            for (uint32_t i : active) paths[i].rays++;
+        }
+        extendPaths(tracer, coherent);
+        if (RENDER_STATS) tracer.stats.traceTicks += statsClock() - start;
+    }
+
+    void extendPaths(Tracer &tracer, bool coherent) {
+        if (!coherent) {
+            for (uint32_t i : active) paths[i].hit = tracer.getIntersection(paths[i].ray);
+            return;
+        }
+        // Neighbouring camera rays point the same way; trace them as packets
+        for (size_t first = 0; first < active.size(); first += SIMD_WIDTH) {
+            int n = std::min<size_t>(SIMD_WIDTH, active.size() - first);
+            Ray rays[SIMD_WIDTH];
+            Hit hits[SIMD_WIDTH];
+            for (int k = 0; k < n; ++k) rays[k] = paths[active[first + k]].ray;
+            tracer.getIntersectionPacket(rays, n, hits);
+            for (int k = 0; k < n; ++k) paths[active[first + k]].hit = hits[k];
+        }
+    }
+
+    // Ends the paths that missed or hit an emitter, plays Russian roulette,
+    // and sorts the survivors into the material queues
+    template <typename Policy>
+    void classify(Tracer &tracer, Sampler &sampler, unsigned int pass, int depth) {
+        const CompiledScene &scene = *tracer.scene;
+        next.clear();
+        diffuse.clear();
+        mirror.clear();
+        glass.clear();
+        for (uint32_t i : active) {
+            PathState &p = paths[i];
+            if (p.hit.prim == NO_PRIMITIVE) {
+                if (RENDER_STATS) tracer.stats.countDepth(depth);
+                continue;
+            }
+            const MaterialRecord &hitMat = scene.material(p.hit.prim);
+            p.hitPos = p.ray.origin + p.ray.direction * p.hit.t;
+            if (hitMat.emit.max() > 0) {
+                if constexpr (Policy::features) {
+                    if (depth == 0) tracer.describeHit(p.hit, p.ray, p.hitPos, hitMat.emit, p.features);
+                }
+                Scalar weight = 1;
+                if constexpr (Policy::emitterSampling) weight = tracer.emissionWeight(p.hit, p.ray, p.bouncePdf);
+                p.radiance += p.throughput * hitMat.emit * weight;
+                if constexpr (Policy::caching) p.cache.add(hitMat.emit * weight);
+                if (RENDER_STATS) tracer.stats.countDepth(depth);
+                continue;
+            }
+            p.color = scene.color(hitMat, p.hitPos);
+            if constexpr (Policy::features) {
+                if (depth == 0) tracer.describeHit(p.hit, p.ray, p.hitPos, p.color, p.features);
+            }
+            resume(sampler, pass, p);
+            bool survived = tracer.survive(depth, p.color, sampler);
+            p.dimension = sampler.dimension;
+            if (!survived) {
+                if (RENDER_STATS) tracer.stats.countDepth(depth);
+                continue;
+            }
+            p.normal = tracer.facingNormal(p.hit, p.ray, p.hitPos);
+
+            if (Policy::materials == ALL_MATERIALS && hitMat.type == MIRROR) {
+                mirror.push_back(i);
+            } else if (Policy::materials == ALL_MATERIALS && hitMat.type == GLASS) {
+                glass.push_back(i);
+            } else {
+                if constexpr (Policy::caching) {
+                    if (tracer.cachedRadiance(p.hitPos, p.normal, p.color, p.throughput, p.cache, p.radiance)) {
+                        if (RENDER_STATS) tracer.stats.countDepth(depth);
+                        continue;
+                    }
+                }
+                diffuse.push_back(i);
+            }
+            next.push_back(i);
+        }
+    }
+
+    template <typename Policy>
+    void shadeMirror(Tracer &tracer) {
+        for (uint32_t i : mirror) {
+            PathState &p = paths[i];
+            p.ray = tracer.mirrorRay(p.ray, p.hitPos, p.normal);
+            p.bouncePdf = 0;
+            p.throughput = p.throughput * p.color;
+            if constexpr (Policy::caching) p.cache.bounce(p.color);
+        }
+    }
+
+    template <typename Policy>
+    void shadeGlass(Tracer &tracer, Sampler &sampler, unsigned int pass) {
+        for (uint32_t i : glass) {
+            PathState &p = paths[i];
+            resume(sampler, pass, p);
+            p.ray = tracer.glassRay(p.ray, p.hitPos, p.normal, sampler);
+            p.bouncePdf = 0;
+            p.dimension = sampler.dimension;
+            p.throughput = p.throughput * p.color;
+            if constexpr (Policy::caching) p.cache.bounce(p.color);
+        }
+    }
+
+    // Picks a light for the shadow queue, then the bounce
+    template <typename Policy>
+    void shadeDiffuse(Tracer &tracer, Sampler &sampler, unsigned int pass) {
+        shadows.clear();
+        for (uint32_t i : diffuse) {
+            PathState &p = paths[i];
+            resume(sampler, pass, p);
+            if (Policy::emitterSampling && tracer.connectLight(p.hitPos, p.normal, sampler, p.shadow)) shadows.push_back(i);
+            p.ray = tracer.diffuseRay(p.hitPos, p.normal, sampler);
+            p.bouncePdf = Tracer::diffusePdf(p.ray.direction, p.normal);
+            p.dimension = sampler.dimension;
+            p.throughput = p.throughput * p.color;
+            if constexpr (Policy::caching) {
+                p.cache.bounce(p.color);
+                p.cache.record();
+            }
+        }
+    }
+
+    // Traces the shadow rays; a light counts when nothing blocks it. The
+    // throughput already has the colour of the surface the ray leaves.
+    template <typename Policy>
+    void connect(Tracer &tracer) {
+        uint64_t start = RENDER_STATS ? statsClock() : 0;
+        for (uint32_t i : shadows) {
+            PathState &p = paths[i];
+            if (tracer.occluded(p.shadow)) continue;
+            p.radiance += p.throughput * p.shadow.contribution;
+            if constexpr (Policy::caching) p.cache.add(p.shadow.contribution);
+        }
+        if (RENDER_STATS) {
+            tracer.stats.shadowRays += shadows.size();
+            for (uint32_t i : shadows) paths[i].rays++;
+            tracer.stats.traceTicks += statsClock() - start;
+        }
+    }
+};
+
+#endif // WAVEFRONT_H